@@ -0,0 +1,501 @@
+/* Asynchronous page I/O used by the file BTree.
+
+   An AsyncIO queues reads and writes of the tree file and reports their
+   completion through callbacks, so many transfers can be in flight at
+   the same time. Callbacks only run inside poll, on the thread that
+   calls it, so they can use the tree without any locking.
+
+   UringIO submits the transfers to a Linux io_uring, set up with the
+   raw system calls. ThreadIO runs pread/pwrite on a pool of threads,
+   for kernels without io_uring. Backends without a file descriptor
+   (std::fstream, memory map) get SyncIO, which does every transfer when
+   it is queued. */
+
+#ifndef B_TREE_AIO_HH
+#define B_TREE_AIO_HH
+
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "b_tree_storage.hh"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define B_TREE_HAS_URING 1
+#endif
+#endif
+
+// Number of transfers that can be in flight at once
+#ifndef AIO_QUEUE_DEPTH
+#define AIO_QUEUE_DEPTH 64
+#endif
+
+// Number of threads of ThreadIO
+#ifndef AIO_THREADS
+#define AIO_THREADS 4
+#endif
+
+// A queued transfer
+struct AsyncRequest
+{
+    bool write;                         // Is true for a write
+    long offset;                        // File offset
+    char* data;                         // Buffer, must stay valid until completion
+    int length;                         // Number of bytes
+    int result;                         // Bytes transferred or -errno
+    std::function<void(int)> done;      // Called with result on completion
+    struct iovec iov;                   // Vector used by io_uring
+};
+
+// An asynchronous transfer queue
+class AsyncIO
+{
+public:
+    virtual ~AsyncIO() {}
+
+    // Functions to queue a transfer. done is called with the number of
+    // bytes transferred, or -errno, from a later call to poll
+    void read(long offset, char* data, int length, std::function<void(int)> done);
+    void write(long offset, char* data, int length, std::function<void(int)> done);
+
+    // A function to run the callbacks of completed transfers. When wait
+    // is true it blocks until at least one completes, if any is in
+    // flight. Returns the number of transfers still in flight
+    virtual int poll(bool wait) = 0;
+
+    // A function that returns the name of the backend
+    virtual const char* name() = 0;
+
+protected:
+    // A function to start a transfer
+    virtual void submit(AsyncRequest* request) = 0;
+
+    // A function to run the callback of a completed transfer
+    void complete(AsyncRequest* request);
+};
+
+// Transfers done when they are queued
+class SyncIO : public AsyncIO
+{
+    Storage* storage;                       // Tree file
+    std::deque<AsyncRequest*> completed;    // Transfers waiting for poll
+
+public:
+    SyncIO(Storage* _storage);     // Constructor
+
+    ~SyncIO();
+
+    int poll(bool wait);
+    const char* name();
+
+protected:
+    void submit(AsyncRequest* request);
+};
+
+// Transfers run by a pool of threads with pread/pwrite
+class ThreadIO : public AsyncIO
+{
+    int fd;                                 // Tree file descriptor
+    std::vector<std::thread> threads;       // Workers
+    std::mutex mutex;                       // Protects everything below
+    std::condition_variable queued;         // Signaled when a transfer is queued
+    std::condition_variable finished;       // Signaled when a transfer completes
+    std::deque<AsyncRequest*> pending;      // Transfers waiting for a worker
+    std::deque<AsyncRequest*> completed;    // Transfers waiting for poll
+    int in_flight;                          // Transfers not polled yet
+    bool stopping;                          // Is true when the workers must exit
+
+public:
+    ThreadIO(int _fd, int _threads = AIO_THREADS);     // Constructor
+
+    ~ThreadIO();
+
+    int poll(bool wait);
+    const char* name();
+
+protected:
+    void submit(AsyncRequest* request);
+
+private:
+    // The function run by every worker
+    void work();
+};
+
+#ifdef B_TREE_HAS_URING
+// Transfers submitted to an io_uring
+class UringIO : public AsyncIO
+{
+    int fd;                     // Tree file descriptor
+    int ring;                   // Ring descriptor
+    unsigned entries;           // Number of submission queue entries
+    int in_flight;              // Transfers submitted and not completed
+    unsigned to_submit;         // Entries queued and not submitted
+
+    void* sq_map;               // Submission ring mapping
+    long sq_map_size;
+    void* cq_map;               // Completion ring mapping
+    long cq_map_size;
+    io_uring_sqe* sqes;         // Submission queue entries
+    long sqes_size;
+
+    unsigned* sq_tail;          // Submission ring pointers
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;          // Completion ring pointers
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+
+public:
+    UringIO(int _fd, int _entries = AIO_QUEUE_DEPTH);  // Constructor
+
+    ~UringIO();
+
+    // A function to check if the ring could be set up
+    bool valid();
+
+    int poll(bool wait);
+    const char* name();
+
+protected:
+    void submit(AsyncRequest* request);
+
+private:
+    // A function to submit the queued entries, waiting for min_complete
+    // completions
+    int enter(unsigned min_complete);
+
+    // A function to run the callbacks of the completions in the ring.
+    // Returns the number of completions
+    int reap();
+};
+#endif
+
+// A function to create the best transfer queue for a storage. Only a
+// storage with a descriptor gets one that overlaps transfers
+AsyncIO* make_async_io(Storage* storage, int depth = AIO_QUEUE_DEPTH){
+    int fd = storage->descriptor();
+    if(fd == -1)
+        return new SyncIO(storage);
+
+#ifdef B_TREE_HAS_URING
+    UringIO* uring = new UringIO(fd, depth);
+    if(uring->valid())
+        return uring;
+    delete uring;
+#endif
+
+    return new ThreadIO(fd);
+}
+
+// AsyncIO definitions
+void AsyncIO::read(long offset, char* data, int length, std::function<void(int)> done){
+    AsyncRequest* request = new AsyncRequest();
+    request->write = false;
+    request->offset = offset;
+    request->data = data;
+    request->length = length;
+    request->result = 0;
+    request->done = done;
+    this->submit(request);
+}
+
+void AsyncIO::write(long offset, char* data, int length, std::function<void(int)> done){
+    AsyncRequest* request = new AsyncRequest();
+    request->write = true;
+    request->offset = offset;
+    request->data = data;
+    request->length = length;
+    request->result = 0;
+    request->done = done;
+    this->submit(request);
+}
+
+void AsyncIO::complete(AsyncRequest* request){
+    if(request->done)
+        request->done(request->result);
+    delete request;
+}
+
+// SyncIO definitions
+SyncIO::SyncIO(Storage* _storage){
+    this->storage = _storage;
+}
+
+SyncIO::~SyncIO(){
+    this->poll(false);
+}
+
+int SyncIO::poll(bool){
+    // Transfers are done when they are submitted, so there is nothing to
+    // wait for. Callbacks may queue more transfers
+    while(!this->completed.empty()){
+        AsyncRequest* request = this->completed.front();
+        this->completed.pop_front();
+        this->complete(request);
+    }
+    return 0;
+}
+
+const char* SyncIO::name(){
+    return "sync";
+}
+
+void SyncIO::submit(AsyncRequest* request){
+    if(request->write)
+        this->storage->write(request->offset, request->data, request->length);
+    else
+        this->storage->read(request->offset, request->data, request->length);
+
+    request->result = request->length;
+    this->completed.push_back(request);
+}
+
+// ThreadIO definitions
+ThreadIO::ThreadIO(int _fd, int _threads){
+    this->fd = _fd;
+    this->in_flight = 0;
+    this->stopping = false;
+
+    for(int i = 0; i < _threads; i++)
+        this->threads.emplace_back(&ThreadIO::work, this);
+}
+
+ThreadIO::~ThreadIO(){
+    while(this->poll(true) > 0){}
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->queued.notify_all();
+    for(std::thread &thread : this->threads)
+        thread.join();
+}
+
+int ThreadIO::poll(bool wait){
+    std::deque<AsyncRequest*> ready;
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        if(wait)
+            this->finished.wait(lock, [this]{ return !this->completed.empty() || this->in_flight == 0; });
+        ready.swap(this->completed);
+        this->in_flight -= ready.size();
+    }
+
+    // Callbacks run without the lock, they may queue more transfers
+    for(AsyncRequest* request : ready)
+        this->complete(request);
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->in_flight;
+}
+
+const char* ThreadIO::name(){
+    return "threads";
+}
+
+void ThreadIO::submit(AsyncRequest* request){
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->pending.push_back(request);
+        this->in_flight++;
+    }
+    this->queued.notify_one();
+}
+
+void ThreadIO::work(){
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    while(true){
+        this->queued.wait(lock, [this]{ return !this->pending.empty() || this->stopping; });
+        if(this->pending.empty())
+            return;
+
+        AsyncRequest* request = this->pending.front();
+        this->pending.pop_front();
+        lock.unlock();
+
+        ssize_t n;
+        if(request->write)
+            n = pwrite(this->fd, request->data, request->length, request->offset);
+        else
+            n = pread(this->fd, request->data, request->length, request->offset);
+        request->result = (n < 0) ? -errno : (int)n;
+
+        lock.lock();
+        this->completed.push_back(request);
+        this->finished.notify_all();
+    }
+}
+
+#ifdef B_TREE_HAS_URING
+// UringIO definitions
+UringIO::UringIO(int _fd, int _entries){
+    this->fd = _fd;
+    this->in_flight = 0;
+    this->to_submit = 0;
+    this->sq_map = MAP_FAILED;
+    this->cq_map = MAP_FAILED;
+    this->sqes = (io_uring_sqe*)MAP_FAILED;
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    this->ring = syscall(__NR_io_uring_setup, _entries, &params);
+    if(this->ring < 0)
+        return;
+    this->entries = params.sq_entries;
+
+    // Map the rings, a single mapping holds both on recent kernels
+    this->sq_map_size = params.sq_off.array+params.sq_entries*sizeof(unsigned);
+    this->cq_map_size = params.cq_off.cqes+params.cq_entries*sizeof(io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(single && this->cq_map_size > this->sq_map_size)
+        this->sq_map_size = this->cq_map_size;
+
+    this->sq_map = mmap(nullptr, this->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        this->ring, IORING_OFF_SQ_RING);
+    if(this->sq_map == MAP_FAILED)
+        return;
+
+    if(single){
+        this->cq_map = this->sq_map;
+        this->cq_map_size = 0;
+    }else{
+        this->cq_map = mmap(nullptr, this->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            this->ring, IORING_OFF_CQ_RING);
+        if(this->cq_map == MAP_FAILED)
+            return;
+    }
+
+    this->sqes_size = params.sq_entries*sizeof(io_uring_sqe);
+    this->sqes = (io_uring_sqe*)mmap(nullptr, this->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     this->ring, IORING_OFF_SQES);
+    if(this->sqes == MAP_FAILED)
+        return;
+
+    char* sq = (char*)this->sq_map;
+    this->sq_tail = (unsigned*)(sq+params.sq_off.tail);
+    this->sq_mask = (unsigned*)(sq+params.sq_off.ring_mask);
+    this->sq_array = (unsigned*)(sq+params.sq_off.array);
+
+    char* cq = (char*)this->cq_map;
+    this->cq_head = (unsigned*)(cq+params.cq_off.head);
+    this->cq_tail = (unsigned*)(cq+params.cq_off.tail);
+    this->cq_mask = (unsigned*)(cq+params.cq_off.ring_mask);
+    this->cqes = (io_uring_cqe*)(cq+params.cq_off.cqes);
+}
+
+UringIO::~UringIO(){
+    if(this->valid())
+        while(this->poll(true) > 0){}
+
+    if(this->sqes != MAP_FAILED)
+        munmap(this->sqes, this->sqes_size);
+    if(this->cq_map != MAP_FAILED && this->cq_map != this->sq_map)
+        munmap(this->cq_map, this->cq_map_size);
+    if(this->sq_map != MAP_FAILED)
+        munmap(this->sq_map, this->sq_map_size);
+    if(this->ring >= 0)
+        ::close(this->ring);
+}
+
+bool UringIO::valid(){
+    return this->ring >= 0 && this->sqes != MAP_FAILED;
+}
+
+int UringIO::poll(bool wait){
+    // Completions already in the ring need no system call
+    int count = this->reap();
+
+    // Submit what is queued, and wait for a completion if asked to
+    bool block = wait && count == 0 && this->in_flight > 0;
+    if(this->to_submit > 0 || block)
+        this->enter(block ? 1 : 0);
+
+    while(this->reap() > 0);
+    return this->in_flight;
+}
+
+const char* UringIO::name(){
+    return "io_uring";
+}
+
+void UringIO::submit(AsyncRequest* request){
+    // Keep every completion room in the ring
+    while(this->in_flight >= (int)this->entries){
+        this->enter(1);
+        this->reap();
+    }
+
+    unsigned tail = *this->sq_tail;
+    unsigned idx = tail & *this->sq_mask;
+    io_uring_sqe* sqe = &this->sqes[idx];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+
+    request->iov.iov_base = request->data;
+    request->iov.iov_len = request->length;
+    sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = this->fd;
+    sqe->off = request->offset;
+    sqe->addr = (unsigned long)&request->iov;
+    sqe->len = 1;
+    sqe->user_data = (unsigned long)request;
+
+    this->sq_array[idx] = idx;
+    __atomic_store_n(this->sq_tail, tail+1, __ATOMIC_RELEASE);
+    this->to_submit++;
+    this->in_flight++;
+
+    // Submit in groups, so a batch of transfers costs a single call
+    if(this->to_submit >= this->entries/2)
+        this->enter(0);
+}
+
+int UringIO::enter(unsigned min_complete){
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int n;
+    do{
+        n = syscall(__NR_io_uring_enter, this->ring, this->to_submit, min_complete, flags, nullptr, 0);
+    }while(n < 0 && errno == EINTR);
+
+    if(n > 0)
+        this->to_submit -= (unsigned)n < this->to_submit ? (unsigned)n : this->to_submit;
+    return n;
+}
+
+int UringIO::reap(){
+    int count = 0;
+    unsigned head = *this->cq_head;
+
+    while(head != __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE)){
+        io_uring_cqe* cqe = &this->cqes[head & *this->cq_mask];
+        AsyncRequest* request = (AsyncRequest*)cqe->user_data;
+        request->result = cqe->res;
+        head++;
+        __atomic_store_n(this->cq_head, head, __ATOMIC_RELEASE);
+
+        this->in_flight--;
+        count++;
+        this->complete(request);
+
+        // A callback may have submitted and reaped, read the head again
+        head = *this->cq_head;
+    }
+    return count;
+}
+#endif
+
+#endif
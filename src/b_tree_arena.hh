@@ -0,0 +1,142 @@
+/* Node allocators of the in-memory BTree.
+
+   A tree gets the memory of its nodes from an allocator object it owns.
+   An allocator has allocate(size) and deallocate(p, size), returning
+   memory aligned to NODE_ALIGNMENT, and a constant owns_nodes that tells
+   whether its destructor releases every node it handed out.
+
+   NodeArena is a slab allocator: nodes are cut from large chunks, freed
+   nodes are kept on a free list per node size and handed out again, and
+   the whole tree goes away with its chunks. HeapNodeAllocator takes every
+   node from the global heap. */
+
+#ifndef B_TREE_ARENA_HH
+#define B_TREE_ARENA_HH
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Cache line size nodes are aligned to
+#define NODE_ALIGNMENT 64
+
+// Size of the chunks the arena cuts nodes from
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+// An allocator that takes every node from the global heap
+class HeapNodeAllocator
+{
+public:
+    // Nodes left at destruction are not released
+    static const bool owns_nodes = false;
+
+    // A function to allocate size bytes
+    void *allocate(size_t size);
+
+    // A function to free the size bytes at p
+    void deallocate(void *p, size_t size);
+};
+
+// A slab allocator that recycles the nodes of a tree
+class NodeArena
+{
+    // A freed node, linked through its first bytes
+    struct FreeNode
+    {
+        FreeNode *next;
+    };
+
+    std::vector<std::pair<void*, size_t>> chunks;       // Chunks and their sizes
+    char *cursor;                                       // Next free byte of the last chunk
+    char *end;                                          // End of the last chunk
+    std::vector<std::pair<size_t, FreeNode*>> free;     // Free list of every node size
+
+public:
+    // Nodes left at destruction go away with the chunks
+    static const bool owns_nodes = true;
+
+    NodeArena();                    // Constructor
+
+    ~NodeArena();                   // Destructor, frees every chunk
+
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    // A function to allocate size bytes, from the free list of that size
+    // if it has a node
+    void *allocate(size_t size);
+
+    // A function to put the size bytes at p on the free list of that size
+    void deallocate(void *p, size_t size);
+
+private:
+    // A function that returns the head of the free list of size
+    FreeNode *&free_list(size_t size);
+};
+
+// HeapNodeAllocator definitions
+void *HeapNodeAllocator::allocate(size_t size){
+    return ::operator new(size, std::align_val_t(NODE_ALIGNMENT));
+}
+
+void HeapNodeAllocator::deallocate(void *p, size_t size){
+    ::operator delete(p, size, std::align_val_t(NODE_ALIGNMENT));
+}
+
+// NodeArena definitions
+NodeArena::NodeArena(){
+    this->cursor = nullptr;
+    this->end = nullptr;
+}
+
+NodeArena::~NodeArena(){
+    for(std::pair<void*, size_t> &chunk : this->chunks)
+        ::operator delete(chunk.first, chunk.second, std::align_val_t(NODE_ALIGNMENT));
+}
+
+void *NodeArena::allocate(size_t size){
+    // Sizes are kept multiple of the alignment so nodes stay aligned
+    size = (size + NODE_ALIGNMENT-1) / NODE_ALIGNMENT * NODE_ALIGNMENT;
+
+    FreeNode *&head = this->free_list(size);
+    if(head != nullptr){
+        FreeNode *node = head;
+        head = node->next;
+        return node;
+    }
+
+    // Start a new chunk when the last one can't fit the node. What is
+    // left of the old chunk is not used
+    if(this->cursor == nullptr || (size_t)(this->end - this->cursor) < size){
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        char *chunk = (char*)::operator new(chunk_size, std::align_val_t(NODE_ALIGNMENT));
+        this->chunks.push_back({chunk, chunk_size});
+        this->cursor = chunk;
+        this->end = chunk + chunk_size;
+    }
+
+    void *p = this->cursor;
+    this->cursor += size;
+    return p;
+}
+
+void NodeArena::deallocate(void *p, size_t size){
+    size = (size + NODE_ALIGNMENT-1) / NODE_ALIGNMENT * NODE_ALIGNMENT;
+
+    FreeNode *&head = this->free_list(size);
+    FreeNode *node = (FreeNode*)p;
+    node->next = head;
+    head = node;
+}
+
+NodeArena::FreeNode *&NodeArena::free_list(size_t size){
+    // A tree has only a couple of node sizes
+    for(std::pair<size_t, FreeNode*> &list : this->free)
+        if(list.first == size)
+            return list.second;
+    this->free.push_back({size, nullptr});
+    return this->free.back().second;
+}
+
+#endif
@@ -0,0 +1,332 @@
+/* Membership filter of the keys of the file BTree.
+
+   A blocked Bloom filter: every key sets BLOOM_BLOCK_WORDS bits, one in
+   each word of a single cache line block chosen by its hash, so a lookup
+   reads one line of memory. A key that has no bits set is not on the
+   tree, and its search needs no page at all.
+
+   Bits are only ever set. Removed keys keep theirs, and are counted so
+   the tree rebuilds the filter once they, or the keys added past the ones
+   it was sized for, make it too loose.
+
+   The filter is stored next to the tree file with a clean mark, written
+   when the tree is checkpointed. The first change after that clears the
+   mark on disk before the tree is changed, so a filter found without it
+   after a crash is rebuilt from the tree. */
+
+#ifndef B_TREE_BLOOM_HH
+#define B_TREE_BLOOM_HH
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+
+#include <unistd.h>
+
+#include "b_tree_storage.hh"
+
+// Default bits of the filter per key
+#define BLOOM_BITS_PER_KEY 10
+
+// Words of a block, which takes a cache line
+#define BLOOM_BLOCK_WORDS 8
+
+// Fewest keys a filter is sized for
+#define BLOOM_MIN_KEYS 1024
+
+// Times more keys than the tree holds a rebuilt filter is sized for
+#define BLOOM_GROWTH 2
+
+// Marks a filter file
+#define BLOOM_MAGIC 0x4d4f4c42u
+
+// Size of the header of a filter file, the blocks after it stay aligned
+#define BLOOM_HEADER_SIZE 64
+
+// Bytes of the blocks written or read at once
+#define BLOOM_IO_CHUNK (1 << 20)
+
+// Header of a filter file
+struct BloomHeader
+{
+    uint32_t magic;         // BLOOM_MAGIC
+    int32_t bits_per_key;   // Bits of the filter per key it is sized for
+    int64_t block_count;    // Number of blocks
+    int64_t capacity;       // Keys the filter is sized for
+    int64_t added;          // Keys whose bits were set
+    int64_t removed;        // Keys removed since
+    int64_t pages;          // Node pages of the tree when it was written
+    int32_t clean;          // 1 if the filter matches the tree on disk
+    int32_t generation;     // Id of the contents of the tree file
+};
+
+// A blocked Bloom filter of int keys
+class BloomFilter
+{
+    std::string fpath;              // Filter file path
+    int bits_per_key;               // Bits per key it is sized for
+    long block_count;               // Number of blocks
+    std::atomic<uint64_t>* words;   // Bits, block after block
+    long capacity;                  // Keys it is sized for
+    std::atomic<long> added;        // Keys whose bits were set
+    std::atomic<long> removed;      // Keys removed since
+    std::atomic<bool> clean;        // Is true while the file is marked clean
+    std::mutex file_latch;          // Taken to clear the mark of the file
+
+public:
+    BloomFilter(std::string _fpath, int _bits_per_key = BLOOM_BITS_PER_KEY);    // Constructor, the filter is empty
+
+    ~BloomFilter();
+
+    BloomFilter(const BloomFilter&) = delete;
+    BloomFilter& operator=(const BloomFilter&) = delete;
+
+    // A function to check if there is a filter file at fpath
+    static bool exists(const std::string &fpath);
+
+    // A function to empty the filter, sizing it for keys keys
+    void reset(long keys);
+
+    // A function to set the bits of key. Many threads can add at once,
+    // along with the lookups
+    void add(int key);
+
+    // A function to count a key removed from the tree. Its bits stay
+    void forget();
+
+    // A function to check if key may be on the tree. Returns false only
+    // if it was never added
+    bool may_contain(int key);
+
+    // A function to check if the filter should be rebuilt, because more
+    // keys were added than it is sized for, or half of them are removed
+    bool saturated();
+
+    // Access to the bits per key
+    int get_bits_per_key();
+
+    // A function to load the filter from its file. Returns false, leaving
+    // the filter as it was, if the file is missing, damaged, not clean or
+    // written for other contents than the tree generation of pages node
+    // pages. The bits per key of a readable file are taken anyway
+    bool load(int generation, long pages);
+
+    // A function to write the filter to its file, marked clean, for the
+    // tree generation of pages node pages. Returns false if it could not
+    // be written
+    bool save(int generation, long pages);
+
+    // A function to delete the filter file
+    void erase();
+
+private:
+    // A function that returns the hash of key
+    static uint64_t hash(int key);
+
+    // A function that returns the bit of word i of a block for hash
+    static uint64_t mask(uint64_t h, int i);
+
+    // A function to clear the clean mark of the file, the first time the
+    // filter changes after it was written
+    void touch();
+
+    // A function to allocate block_count empty blocks
+    void allocate();
+};
+
+BloomFilter::BloomFilter(std::string _fpath, int _bits_per_key){
+    this->fpath = _fpath;
+    this->bits_per_key = (_bits_per_key < 1) ? BLOOM_BITS_PER_KEY : _bits_per_key;
+    this->block_count = 0;
+    this->words = nullptr;
+    this->capacity = 0;
+    this->added = 0;
+    this->removed = 0;
+    this->clean = false;
+    this->reset(BLOOM_MIN_KEYS);
+}
+
+BloomFilter::~BloomFilter(){
+    free(this->words);
+}
+
+bool BloomFilter::exists(const std::string &fpath){
+    return access(fpath.c_str(), F_OK) == 0;
+}
+
+void BloomFilter::allocate(){
+    free(this->words);
+    long bytes = this->block_count*BLOOM_BLOCK_WORDS*sizeof(uint64_t);
+    this->words = (std::atomic<uint64_t>*)alloc_aligned(bytes);
+    for(long i = 0; i < this->block_count*BLOOM_BLOCK_WORDS; i++)
+        new (&this->words[i]) std::atomic<uint64_t>(0);
+}
+
+void BloomFilter::reset(long keys){
+    this->touch();
+
+    this->capacity = (keys < BLOOM_MIN_KEYS) ? BLOOM_MIN_KEYS : keys;
+    long bits = this->capacity*this->bits_per_key;
+    long block_bits = BLOOM_BLOCK_WORDS*64;
+    this->block_count = (bits+block_bits-1)/block_bits;
+    this->allocate();
+    this->added = 0;
+    this->removed = 0;
+}
+
+uint64_t BloomFilter::hash(int key){
+    // Finalizer of MurmurHash3, every bit of the key reaches every bit
+    uint64_t h = (uint32_t)key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t BloomFilter::mask(uint64_t h, int i){
+    // Odd multipliers spread the low half of the hash over the words
+    static const uint32_t salt[BLOOM_BLOCK_WORDS] = {
+        0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+        0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+    };
+    return 1ULL << (((uint32_t)h*salt[i]) >> 26);
+}
+
+void BloomFilter::add(int key){
+    this->touch();
+
+    uint64_t h = hash(key);
+    std::atomic<uint64_t>* block = &this->words[((h >> 32)*this->block_count >> 32)*BLOOM_BLOCK_WORDS];
+    for(int i = 0; i < BLOOM_BLOCK_WORDS; i++)
+        block[i].fetch_or(mask(h, i), std::memory_order_relaxed);
+    this->added++;
+}
+
+void BloomFilter::forget(){
+    // A filter with more bits than keys is still right, the file keeps
+    // its mark
+    this->removed++;
+}
+
+bool BloomFilter::may_contain(int key){
+    uint64_t h = hash(key);
+    std::atomic<uint64_t>* block = &this->words[((h >> 32)*this->block_count >> 32)*BLOOM_BLOCK_WORDS];
+    bool all = true;
+    for(int i = 0; i < BLOOM_BLOCK_WORDS; i++){
+        uint64_t m = mask(h, i);
+        all &= (block[i].load(std::memory_order_relaxed) & m) == m;
+    }
+    return all;
+}
+
+bool BloomFilter::saturated(){
+    return this->added > this->capacity || this->removed*2 > this->added;
+}
+
+int BloomFilter::get_bits_per_key(){
+    return this->bits_per_key;
+}
+
+bool BloomFilter::load(int generation, long pages){
+    Storage* file = make_storage(FSTREAM_STORAGE, this->fpath, 0);
+    if(!file->is_open() || file->size() < BLOOM_HEADER_SIZE){
+        delete file;
+        return false;
+    }
+
+    char buffer[BLOOM_HEADER_SIZE];
+    BloomHeader header;
+    file->read(0, buffer, BLOOM_HEADER_SIZE);
+    memcpy(&header, buffer, sizeof(header));
+    if(header.magic != BLOOM_MAGIC || header.bits_per_key < 1){
+        delete file;
+        return false;
+    }
+    this->bits_per_key = header.bits_per_key;
+
+    long bytes = header.block_count*BLOOM_BLOCK_WORDS*sizeof(uint64_t);
+    if(header.clean != 1 || header.generation != generation || header.pages != pages || header.block_count < 1 ||
+       header.capacity < 1 || file->size() < BLOOM_HEADER_SIZE+bytes){
+        delete file;
+        return false;
+    }
+
+    this->block_count = header.block_count;
+    this->capacity = header.capacity;
+    this->allocate();
+    for(long done = 0; done < bytes; done += BLOOM_IO_CHUNK){
+        int length = std::min((long)BLOOM_IO_CHUNK, bytes-done);
+        file->read(BLOOM_HEADER_SIZE+done, (char*)this->words+done, length);
+    }
+    this->added = header.added;
+    this->removed = header.removed;
+    this->clean = true;
+
+    delete file;
+    return true;
+}
+
+bool BloomFilter::save(int generation, long pages){
+    std::lock_guard<std::mutex> file_lock(this->file_latch);
+    Storage* file = make_storage(FSTREAM_STORAGE, this->fpath, 0);
+    if(!file->open(true)){
+        delete file;
+        return false;
+    }
+
+    // The blocks are on disk before the header says they are clean
+    long bytes = this->block_count*BLOOM_BLOCK_WORDS*sizeof(uint64_t);
+    for(long done = 0; done < bytes; done += BLOOM_IO_CHUNK){
+        int length = std::min((long)BLOOM_IO_CHUNK, bytes-done);
+        file->write(BLOOM_HEADER_SIZE+done, (const char*)this->words+done, length);
+    }
+    file->sync();
+
+    char buffer[BLOOM_HEADER_SIZE] = {0};
+    BloomHeader header = {BLOOM_MAGIC, this->bits_per_key, this->block_count, this->capacity,
+                          this->added, this->removed, pages, 1, generation};
+    memcpy(buffer, &header, sizeof(header));
+    file->write(0, buffer, BLOOM_HEADER_SIZE);
+    file->sync();
+    file->close();
+    delete file;
+
+    this->clean = true;
+    return true;
+}
+
+void BloomFilter::touch(){
+    if(!this->clean)
+        return;
+
+    std::lock_guard<std::mutex> file_lock(this->file_latch);
+    if(!this->clean)
+        return;
+
+    // The mark is cleared on disk before the change can reach the tree
+    Storage* file = make_storage(FSTREAM_STORAGE, this->fpath, 0);
+    if(file->is_open()){
+        int32_t no = 0;
+        file->write(offsetof(BloomHeader, clean), (const char*)&no, sizeof(no));
+        file->sync();
+    }
+    delete file;
+    this->clean = false;
+}
+
+void BloomFilter::erase(){
+    std::lock_guard<std::mutex> file_lock(this->file_latch);
+    std::remove(this->fpath.c_str());
+    this->clean = false;
+}
+
+#endif
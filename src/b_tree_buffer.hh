@@ -0,0 +1,469 @@
+/* Buffer pool used by the file BTree.
+
+   Pages are kept in a fixed number of frames, bounded by a memory budget
+   given in bytes. A page stays resident while it is pinned, and modified
+   pages are only written back to the file when they are evicted or when
+   the pool is flushed. Victims are chosen with the CLOCK algorithm, so
+   the root and the upper levels of the tree, which are touched by every
+   operation, tend to stay in memory.
+
+   When the storage can access pages in place (a mapped file) the pool
+   hands out the mapped pages directly and keeps no frames at all.
+
+   With a write-ahead log, every page remembers the LSN of the last
+   operation that changed it, and the log is synced up to that LSN
+   before the page is written back.
+
+   The pool can be shared by several threads. Its bookkeeping is guarded
+   by a mutex, but pages are read and written back with the mutex
+   released, so threads that miss on different pages read them at the
+   same time, and a dirty victim doesn't stall the hits of other threads.
+   A frame being read is marked as loading, and one being written back as
+   writing, and other users of that page wait for it. The pool doesn't
+   guard the page contents, callers do that with their own latches. */
+
+#ifndef B_TREE_BUFFER_HH
+#define B_TREE_BUFFER_HH
+
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "b_tree_storage.hh"
+#include "b_tree_wal.hh"
+
+// Page of a free frame. Page -1 is valid, it is the page just before base
+#define NO_PAGE INT_MIN
+
+// A buffer pool frame
+struct BufferFrame
+{
+    char *data;         // Page data
+    int page;           // Page held by this frame (NO_PAGE when the frame is free)
+    int pin_count;      // Number of users currently holding the page
+    bool dirty;         // Is true when the page must be written back
+    bool referenced;    // CLOCK reference bit
+    long lsn;           // Log position of the last change, 0 if not logged
+    bool loading;       // Is true while the page is being read from the file
+    bool writing;       // Is true while the page is being written back
+};
+
+// A buffer pool of fixed size pages
+class BufferPool
+{
+    Storage *storage;                       // Backing file
+    bool in_place;                          // Is true when pages are used directly from the storage
+    long base;                              // File offset of the first page
+    int page_size;                          // Size of every page in bytes
+    std::vector<BufferFrame> frames;        // Frames of the pool
+    std::unordered_map<int, int> table;     // Page to frame mapping
+    int hand;                               // CLOCK hand
+    WriteAheadLog *log;                     // Log synced before pages are written, may be nullptr
+    long writes;                            // Number of pages written back so far
+    std::mutex mutex;                       // Guards the frames metadata and the table
+    std::condition_variable transferred;    // Signaled when a frame finishes loading or writing
+
+public:
+    // Minimum number of frames, so a split always finds room for the
+    // pages it pins at the same time
+    static const int MIN_FRAMES = 8;
+
+    BufferPool(Storage *_storage, long _base, int _page_size, long _budget);  // Constructor
+
+    ~BufferPool();
+
+    // A function to pin a page, reading it from the file if needed.
+    // Returns the page data or nullptr if no frame can be freed
+    char* fetch_page(int page);
+
+    // A function to pin a page that is not on the file yet. The page is
+    // zero filled and marked as dirty
+    char* new_page(int page);
+
+    // A function to release a pinned page. dirty tells if the caller
+    // modified the page
+    void unpin_page(int page, bool dirty);
+
+    // A function to set the log of the changes to the pages
+    void set_log(WriteAheadLog *_log);
+
+    // A function to set the LSN of the operation that changed a page
+    void set_lsn(int page, long lsn);
+
+    // A function to hint that pages will be fetched soon. Pages that are
+    // not resident are read ahead by the storage, contiguous pages with a
+    // single request
+    void prefetch(std::vector<int> pages);
+
+    // A function to check if a page can be pinned without reading it
+    bool resident(int page);
+
+    // A function to add a clean page read by the caller, unless the page
+    // is resident already or every frame is pinned
+    void install(int page, const char* data);
+
+    // A function that returns the number of pages written back so far.
+    // A page read while this changes may be older than the file
+    long get_writes();
+
+    // A function to write a page back to the file if it is dirty
+    void flush_page(int page);
+
+    // A function to write every dirty page back to the file
+    void flush_all();
+
+    // A function to drop every page without writing it back
+    void reset();
+
+    // Access to the pool configuration
+    int get_page_size();
+    int get_capacity();
+
+private:
+    // A function to find a frame for a new page, evicting if needed.
+    // Returns -1 if every frame is pinned. Called with the mutex held,
+    // which is released while a dirty victim is written back, so the
+    // callers check the table again afterwards
+    int find_victim(std::unique_lock<std::mutex> &lock);
+
+    // A function to wait until nobody reads or writes back frame
+    void wait_transfer(std::unique_lock<std::mutex> &lock, BufferFrame &frame);
+
+    // Functions to transfer a frame from/to the file. The mutex must not
+    // be held
+    void read_frame(BufferFrame &frame);
+    void write_frame(BufferFrame &frame, long lsn);
+
+    // A function to write a dirty frame back with the mutex released.
+    // Pins taken meanwhile wait until it is on the file
+    void write_back(std::unique_lock<std::mutex> &lock, BufferFrame &frame);
+};
+
+BufferPool::BufferPool(Storage *_storage, long _base, int _page_size, long _budget){
+    this->storage = _storage;
+    this->base = _base;
+    this->page_size = _page_size;
+    this->hand = 0;
+    this->log = nullptr;
+    this->writes = 0;
+
+    // Mapped pages need no frames
+    this->in_place = _storage->mapped();
+    if(this->in_place)
+        return;
+
+    int capacity = _budget/_page_size;
+    if(capacity < MIN_FRAMES)
+        capacity = MIN_FRAMES;
+
+    this->frames.resize(capacity);
+    for(BufferFrame &frame : this->frames){
+        // Frames are aligned, so they can be used for O_DIRECT transfers
+        frame.data = alloc_aligned(_page_size);
+        frame.page = NO_PAGE;
+        frame.pin_count = 0;
+        frame.dirty = false;
+        frame.referenced = false;
+        frame.lsn = 0;
+        frame.loading = false;
+        frame.writing = false;
+    }
+}
+
+BufferPool::~BufferPool(){
+    this->flush_all();
+
+    for(BufferFrame &frame : this->frames)
+        free(frame.data);
+}
+
+char* BufferPool::fetch_page(int page){
+    if(this->in_place)
+        return this->storage->address(this->base+(long)page*this->page_size, this->page_size);
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    int idx;
+    while(true){
+        // Page hit, only pin it. If another thread is still reading or
+        // writing the page wait for it, the pin keeps the frame from
+        // being reused meanwhile
+        auto it = this->table.find(page);
+        if(it != this->table.end()){
+            BufferFrame &frame = this->frames[it->second];
+            frame.pin_count++;
+            frame.referenced = true;
+            this->wait_transfer(lock, frame);
+            return frame.data;
+        }
+
+        // Page miss, bring it from the file. Another thread may bring it
+        // while a victim is written back
+        idx = this->find_victim(lock);
+        if(idx == -1)
+            return nullptr;
+        if(this->table.count(page) == 0)
+            break;
+    }
+
+    BufferFrame &frame = this->frames[idx];
+    frame.page = page;
+    frame.pin_count = 1;
+    frame.dirty = false;
+    frame.referenced = true;
+    frame.lsn = 0;
+    frame.loading = true;
+    this->table[page] = idx;
+
+    // Read without the mutex, so other threads can use the pool meanwhile
+    lock.unlock();
+    this->read_frame(frame);
+    lock.lock();
+
+    frame.loading = false;
+    this->transferred.notify_all();
+    return frame.data;
+}
+
+char* BufferPool::new_page(int page){
+    if(this->in_place){
+        char* data = this->storage->address(this->base+(long)page*this->page_size, this->page_size);
+        if(data != nullptr)
+            memset(data, 0, this->page_size);
+        return data;
+    }
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    int idx;
+    while(true){
+        auto it = this->table.find(page);
+        if(it != this->table.end()){
+            // The old contents must be on the file before they are cleared
+            idx = it->second;
+            this->wait_transfer(lock, this->frames[idx]);
+            if(this->frames[idx].page == page)
+                break;
+            continue;
+        }
+
+        idx = this->find_victim(lock);
+        if(idx == -1)
+            return nullptr;
+        if(this->table.count(page) == 0)
+            break;
+    }
+
+    BufferFrame &frame = this->frames[idx];
+    if(frame.page != page)
+        frame.pin_count = 0;
+    frame.page = page;
+    frame.pin_count++;
+    frame.dirty = true;
+    frame.referenced = true;
+    frame.lsn = 0;
+    frame.loading = false;
+    memset(frame.data, 0, this->page_size);
+    this->table[page] = idx;
+
+    return frame.data;
+}
+
+void BufferPool::unpin_page(int page, bool dirty){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto it = this->table.find(page);
+    if(it == this->table.end())
+        return;
+
+    BufferFrame &frame = this->frames[it->second];
+    if(frame.pin_count > 0)
+        frame.pin_count--;
+    if(dirty)
+        frame.dirty = true;
+}
+
+void BufferPool::set_log(WriteAheadLog *_log){
+    this->log = _log;
+}
+
+void BufferPool::set_lsn(int page, long lsn){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto it = this->table.find(page);
+    if(it != this->table.end())
+        this->frames[it->second].lsn = lsn;
+}
+
+void BufferPool::prefetch(std::vector<int> pages){
+    std::sort(pages.begin(), pages.end());
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    size_t i = 0;
+    while(i < pages.size()){
+        // Resident pages need no I/O
+        if(!this->in_place && this->table.count(pages[i]) > 0){
+            i++;
+            continue;
+        }
+
+        // Extend the run while the next page is contiguous and missing
+        size_t j = i+1;
+        while(j < pages.size() && pages[j] == pages[j-1]+1 &&
+              (this->in_place || this->table.count(pages[j]) == 0))
+            j++;
+
+        this->storage->prefetch(this->base+(long)pages[i]*this->page_size,
+                                (long)(pages[j-1]-pages[i]+1)*this->page_size);
+        i = j;
+    }
+}
+
+bool BufferPool::resident(int page){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->in_place || this->table.count(page) > 0;
+}
+
+void BufferPool::install(int page, const char* data){
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if(this->in_place || this->table.count(page) > 0)
+        return;
+
+    // The page may arrive while a victim is written back
+    int idx = this->find_victim(lock);
+    if(idx == -1 || this->table.count(page) > 0)
+        return;
+
+    BufferFrame &frame = this->frames[idx];
+    frame.page = page;
+    frame.pin_count = 0;
+    frame.dirty = false;
+    frame.referenced = true;
+    frame.lsn = 0;
+    frame.loading = false;
+    memcpy(frame.data, data, this->page_size);
+    this->table[page] = idx;
+}
+
+long BufferPool::get_writes(){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->writes;
+}
+
+void BufferPool::flush_page(int page){
+    std::unique_lock<std::mutex> lock(this->mutex);
+    auto it = this->table.find(page);
+    if(it == this->table.end())
+        return;
+
+    BufferFrame &frame = this->frames[it->second];
+    this->wait_transfer(lock, frame);
+    if(frame.page == page && frame.dirty)
+        this->write_back(lock, frame);
+}
+
+void BufferPool::flush_all(){
+    std::unique_lock<std::mutex> lock(this->mutex);
+    for(BufferFrame &frame : this->frames){
+        this->wait_transfer(lock, frame);
+        if(frame.page != NO_PAGE && frame.dirty)
+            this->write_back(lock, frame);
+    }
+    lock.unlock();
+    this->storage->flush();
+}
+
+void BufferPool::reset(){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    for(BufferFrame &frame : this->frames){
+        frame.page = NO_PAGE;
+        frame.pin_count = 0;
+        frame.dirty = false;
+        frame.referenced = false;
+        frame.lsn = 0;
+        frame.loading = false;
+        frame.writing = false;
+    }
+    this->table.clear();
+    this->hand = 0;
+}
+
+int BufferPool::get_page_size(){
+    return this->page_size;
+}
+
+int BufferPool::get_capacity(){
+    return this->frames.size();
+}
+
+int BufferPool::find_victim(std::unique_lock<std::mutex> &lock){
+    int capacity = this->frames.size();
+
+    // Two full turns are enough to clear every reference bit once
+    for(int step = 0; step < 2*capacity; step++){
+        int idx = this->hand;
+        this->hand = (this->hand+1) % capacity;
+
+        BufferFrame &frame = this->frames[idx];
+        if(frame.page == NO_PAGE)
+            return idx;
+        if(frame.pin_count > 0 || frame.loading || frame.writing)
+            continue;
+
+        // Give recently used pages a second chance
+        if(frame.referenced){
+            frame.referenced = false;
+            continue;
+        }
+
+        // A dirty page is written back first. It is only evicted if
+        // nobody wanted it meanwhile
+        if(frame.dirty){
+            this->write_back(lock, frame);
+            if(frame.pin_count > 0 || frame.referenced || frame.dirty || frame.page == NO_PAGE)
+                continue;
+        }
+
+        // Evict the page
+        this->table.erase(frame.page);
+        frame.page = NO_PAGE;
+        return idx;
+    }
+
+    return -1;
+}
+
+void BufferPool::wait_transfer(std::unique_lock<std::mutex> &lock, BufferFrame &frame){
+    this->transferred.wait(lock, [&frame]{ return !frame.loading && !frame.writing; });
+}
+
+void BufferPool::read_frame(BufferFrame &frame){
+    this->storage->read(this->base+(long)frame.page*this->page_size, frame.data, this->page_size);
+}
+
+void BufferPool::write_frame(BufferFrame &frame, long lsn){
+    // The log must hold the change before the page does
+    if(this->log != nullptr && lsn > this->log->durable_lsn())
+        this->log->sync(lsn);
+
+    this->storage->write(this->base+(long)frame.page*this->page_size, frame.data, this->page_size);
+}
+
+void BufferPool::write_back(std::unique_lock<std::mutex> &lock, BufferFrame &frame){
+    // Changes made while the page is written mark it dirty again
+    frame.dirty = false;
+    frame.writing = true;
+    long lsn = frame.lsn;
+
+    lock.unlock();
+    this->write_frame(frame, lsn);
+    lock.lock();
+
+    // Readers that bypass the pool compare this count to know if the
+    // file changed under them, so it moves once the page is written
+    this->writes++;
+    frame.writing = false;
+    this->transferred.notify_all();
+}
+
+#endif
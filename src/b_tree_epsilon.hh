@@ -0,0 +1,728 @@
+/* A write-optimized file BTree of int keys, a B-epsilon tree.
+
+   An insert on the file BTree of b_tree_file.hh goes down to a leaf and
+   rewrites it, so random inserts cost about one leaf write each. Here
+   inner pages keep a small fanout and use the rest of the page as a
+   buffer of pending messages, inserts and removes of keys. A message is
+   added to the buffer of the root. When a buffer overflows, the messages
+   for the child with the most of them move down together, to the buffer
+   of the child or, on a leaf, into its keys. A leaf is then written once
+   for a whole batch of messages instead of once per key.
+
+   A page keeps at most one message per key, the newest one, and messages
+   on a page are newer than any message for the same key below it. A
+   search goes down like on a BTree, and stops at the first buffer that
+   has a message for its key.
+
+   Keys are a set: inserts and removes are blind and don't tell whether
+   the key was present. Leaves are linked in key order, split when the
+   messages they take don't fit, and are not merged when they empty. The
+   tree has one user at a time. */
+
+#ifndef B_TREE_EPSILON_HH
+#define B_TREE_EPSILON_HH
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "b_tree_buffer.hh"
+#include "b_tree_simd.hh"
+#include "b_tree_storage.hh"
+
+// Page geometry, the same as the one of the file BTree
+#ifndef DEFAULT_PAGE_SIZE
+#define DEFAULT_PAGE_SIZE 4096
+#endif
+#ifndef MIN_PAGE_SIZE
+#define MIN_PAGE_SIZE 512
+#endif
+#ifndef MAX_PAGE_SIZE
+#define MAX_PAGE_SIZE 65536
+#endif
+#ifndef DEFAULT_CACHE_SIZE
+#define DEFAULT_CACHE_SIZE (1 << 20)
+#endif
+
+// Size of the info header of an epsilon tree (root, page size, pages,
+// fanout). The header takes the whole first page of the file
+#define EPSILON_HEADER_SIZE (sizeof(int)*4)
+
+// Default number of children of an inner page
+#define EPSILON_DEFAULT_FANOUT 16
+
+// Layout of an epsilon page: (leaf, n, m, link, data). A leaf holds n
+// keys and link is the next leaf. An inner page holds n pivots, n+1
+// children and m messages, as an array of keys and an array of types
+#define EPAGE_LEAF_OFFSET 0
+#define EPAGE_N_OFFSET (sizeof(int))
+#define EPAGE_M_OFFSET (sizeof(int)*2)
+#define EPAGE_LINK_OFFSET (sizeof(int)*3)
+#define EPAGE_DATA_OFFSET (sizeof(int)*4)
+
+// Number of keys of a leaf
+#define EPSILON_LEAF_KEYS(page_size) ((int)(((page_size)-EPAGE_DATA_OFFSET)/sizeof(int)))
+
+// Number of messages of an inner page, after its pivots and children
+#define EPSILON_BUFFER_SIZE(page_size, fanout) \
+    ((int)(((page_size)-EPAGE_DATA_OFFSET-sizeof(int)*(2*(fanout)-1))/(sizeof(int)+1)))
+
+// Types of the messages
+enum MessageType {EPSILON_INSERT = 1, EPSILON_REMOVE = 2};
+
+// A pending change of a key
+struct Message
+{
+    int key;        // Key changed
+    int type;       // MessageType
+};
+
+// The contents of a page, read out of the pool
+struct EpsilonNode
+{
+    bool leaf;                      // Is true when the page is a leaf
+    int link;                       // Next leaf, -1 on inner pages
+    std::vector<int> keys;          // Keys of a leaf, pivots of an inner page
+    std::vector<int> children;      // Children of an inner page
+    std::vector<Message> messages;  // Messages of an inner page, in key order
+};
+
+// A view of an epsilon page, read and written in place
+class EpsilonPage
+{
+    char *data;         // Page data
+    int fanout;         // Maximum number of children
+    int buffer;         // Maximum number of messages
+
+public:
+    EpsilonPage(char *_data = nullptr, int _fanout = 0, int _buffer = 0)
+        : data(_data), fanout(_fanout), buffer(_buffer) {}
+
+    // A function to check if the view points to a page
+    bool valid() { return this->data != nullptr; }
+
+    // Access to the header fields
+    bool is_leaf() { return this->field(EPAGE_LEAF_OFFSET) != 0; }
+    int get_n() { return this->field(EPAGE_N_OFFSET); }
+    int get_m() { return this->field(EPAGE_M_OFFSET); }
+    int get_link() { return this->field(EPAGE_LINK_OFFSET); }
+
+    // Access to the arrays: keys of a leaf or pivots, children, and the
+    // keys and types of the messages
+    int* keys() { return (int*)&this->data[EPAGE_DATA_OFFSET]; }
+    int* children() { return this->keys()+this->fanout-1; }
+    int* message_keys() { return this->children()+this->fanout; }
+    uint8_t* message_types() { return (uint8_t*)(this->message_keys()+this->buffer); }
+
+    // A function that returns the index of the message for k, -1 if
+    // there is none
+    int find_message(int k);
+
+    // A function to add a message in place. A message for the same key is
+    // replaced. Returns false if the buffer is full
+    bool add_message(const Message &msg);
+
+    // Functions to copy the page to a node and back
+    void read(EpsilonNode &node);
+    void write(const EpsilonNode &node);
+
+private:
+    // Access to the int fields of the header
+    int field(size_t offset);
+    void set_field(size_t offset, int value);
+};
+
+// A write-optimized file BTree of int keys
+class EpsilonBTree
+{
+    int root;               // Root file position
+    int page_size;          // Size of every page of the file
+    int fanout;             // Maximum number of children of an inner page
+    int leaf_keys;          // Maximum number of keys of a leaf
+    int buffer_size;        // Maximum number of messages of an inner page
+    int node_count;         // Number of pages on the file
+    std::string fpath;      // File path
+    Storage* storage;       // File backend
+    long cache_size;        // Memory budget of the buffer pool, in bytes
+    BufferPool* pool;       // Page cache between the tree and the file
+
+public:
+
+    // Constructor. _storage is a StorageType and _hints are the MmapHints
+    // used by the mapped storage
+    EpsilonBTree(std::string _fpath, long _cache_size = DEFAULT_CACHE_SIZE,
+                 int _storage = FSTREAM_STORAGE, int _hints = 0);
+
+    ~EpsilonBTree();                // Destructor, writes cached pages back
+
+    EpsilonBTree(const EpsilonBTree&) = delete;
+    EpsilonBTree& operator=(const EpsilonBTree&) = delete;
+
+    // A function to write every cached page back to the file
+    void flush();
+
+    // A function to load the tree info from the file header
+    void load_info_header();
+
+    // A function to initialize the tree and the file. The page size must
+    // be a power of two between MIN_PAGE_SIZE and MAX_PAGE_SIZE. Inner
+    // pages have up to _fanout children, at least 3, and the rest of the
+    // page buffers messages, which must fit at least two per child
+    void init(int _page_size = DEFAULT_PAGE_SIZE, int _fanout = EPSILON_DEFAULT_FANOUT);
+
+    // Access to the page geometry
+    int get_page_size();
+    int get_fanout();
+    int get_buffer_size();
+
+    // A function to search key, merging the messages on its path. Returns
+    // true if it is present
+    bool search(int key);
+
+    // Functions to insert and remove key. Both are blind, they only add a
+    // message to the root
+    void insert(int key);
+    void remove(int key);
+
+    // A function to print every key in order
+    void traverse();
+
+private:
+    // A function to write the tree info to the file header
+    void store_info_header();
+
+    // A function to set the page geometry and rebuild the pool for it
+    void set_geometry(int _page_size, int _fanout);
+
+    // Functions to pin a page of the pool and to release it
+    EpsilonPage pin_page(int ptr);
+    void unpin_page(int ptr, bool dirty);
+
+    // A function to add an empty page to the file, stored at ptr. The
+    // page is returned pinned
+    EpsilonPage new_page(bool leaf, int &ptr);
+
+    // A function to add a message to the root, and to grow the tree when
+    // the root splits
+    void put(const Message &msg);
+
+    // A function to add the sorted messages to the subtree rooted at ptr.
+    // A leaf applies them, an inner page buffers them and sends them down
+    // in batches once its buffer overflows. The pages the subtree grows by
+    // are returned on split, as (separator, pointer) pairs
+    void push(int ptr, std::vector<Message> &messages, std::vector<std::pair<int, int>> &split);
+
+    // A function to send down the messages of node for the child with the
+    // most of them, until its buffer fits
+    void spill(EpsilonNode &node);
+
+    // A function to store node on the page at ptr. If it doesn't fit, it
+    // is spread evenly over new pages that are returned on split
+    void store(int ptr, EpsilonNode &node, std::vector<std::pair<int, int>> &split);
+
+    // A function to add a root over the old one and the pages it grew by,
+    // as long as the new root grows too
+    void growRoot(std::vector<std::pair<int, int>> &split);
+
+    // A function to print the keys of the subtree rooted at ptr, with the
+    // sorted messages of its ancestors applied
+    void traverse(int ptr, const std::vector<Message> &pending);
+
+    // A function to merge the sorted messages newer into the sorted older.
+    // A newer message replaces an older one for the same key
+    static void merge_messages(std::vector<Message> &older, const std::vector<Message> &newer);
+
+    // A function to apply the sorted messages to the sorted keys
+    static void apply_messages(std::vector<int> &keys, const std::vector<Message> &messages);
+
+    // A function that returns the index of the child of the pivots that
+    // holds key. Keys equal to a pivot are on its right
+    static int route(const std::vector<int> &pivots, int key);
+};
+
+// EpsilonPage definitions
+int EpsilonPage::field(size_t offset){
+    int value;
+    memcpy(&value, &this->data[offset], sizeof(int));
+    return value;
+}
+
+void EpsilonPage::set_field(size_t offset, int value){
+    memcpy(&this->data[offset], &value, sizeof(int));
+}
+
+int EpsilonPage::find_message(int k){
+    int m = this->get_m();
+    int i = lower_bound_keys(this->message_keys(), m, k);
+    return (i < m && this->message_keys()[i] == k) ? i : -1;
+}
+
+bool EpsilonPage::add_message(const Message &msg){
+    int m = this->get_m();
+    int* keys = this->message_keys();
+    uint8_t* types = this->message_types();
+    int i = lower_bound_keys(keys, m, msg.key);
+
+    // The newest message of a key is the only one kept
+    if(i < m && keys[i] == msg.key){
+        types[i] = msg.type;
+        return true;
+    }
+    if(m == this->buffer)
+        return false;
+
+    memmove(&keys[i+1], &keys[i], sizeof(int)*(m-i));
+    memmove(&types[i+1], &types[i], m-i);
+    keys[i] = msg.key;
+    types[i] = msg.type;
+    this->set_field(EPAGE_M_OFFSET, m+1);
+    return true;
+}
+
+void EpsilonPage::read(EpsilonNode &node){
+    int n = this->get_n();
+    node.leaf = this->is_leaf();
+    node.link = this->get_link();
+    node.keys.assign(this->keys(), this->keys()+n);
+    node.children.clear();
+    node.messages.clear();
+    if(node.leaf)
+        return;
+
+    int m = this->get_m();
+    node.children.assign(this->children(), this->children()+n+1);
+    node.messages.reserve(m);
+    for(int i = 0; i < m; i++)
+        node.messages.push_back({this->message_keys()[i], this->message_types()[i]});
+}
+
+void EpsilonPage::write(const EpsilonNode &node){
+    int n = node.keys.size();
+    int m = node.messages.size();
+    this->set_field(EPAGE_LEAF_OFFSET, node.leaf ? 1 : 0);
+    this->set_field(EPAGE_N_OFFSET, n);
+    this->set_field(EPAGE_M_OFFSET, node.leaf ? 0 : m);
+    this->set_field(EPAGE_LINK_OFFSET, node.link);
+    std::copy(node.keys.begin(), node.keys.end(), this->keys());
+    if(node.leaf)
+        return;
+
+    std::copy(node.children.begin(), node.children.end(), this->children());
+    for(int i = 0; i < m; i++){
+        this->message_keys()[i] = node.messages[i].key;
+        this->message_types()[i] = node.messages[i].type;
+    }
+}
+
+// EpsilonBTree definitions
+EpsilonBTree::EpsilonBTree(std::string _fpath, long _cache_size, int _storage, int _hints){
+    this->root = 0;
+    this->page_size = 0;
+    this->fanout = 0;
+    this->leaf_keys = 0;
+    this->buffer_size = 0;
+    this->node_count = 0;
+    this->fpath = _fpath;
+    this->storage = make_storage(_storage, _fpath, _hints);
+    this->cache_size = _cache_size;
+    this->pool = nullptr;
+
+    this->set_geometry(DEFAULT_PAGE_SIZE, EPSILON_DEFAULT_FANOUT);
+}
+
+EpsilonBTree::~EpsilonBTree(){
+    this->flush();
+    delete this->pool;
+    delete this->storage;
+}
+
+void EpsilonBTree::flush(){
+    if(this->storage->is_open())
+        this->pool->flush_all();
+}
+
+void EpsilonBTree::set_geometry(int _page_size, int _fanout){
+    // Cached pages are written back under the old geometry
+    if(_page_size != this->page_size){
+        delete this->pool;
+        this->pool = new BufferPool(this->storage, _page_size, _page_size, this->cache_size);
+    }
+
+    // The header takes the first page
+    this->page_size = _page_size;
+    this->fanout = _fanout;
+    this->leaf_keys = EPSILON_LEAF_KEYS(_page_size);
+    this->buffer_size = EPSILON_BUFFER_SIZE(_page_size, _fanout);
+}
+
+void EpsilonBTree::load_info_header(){
+    if(this->storage->is_open()){
+        char buffer[EPSILON_HEADER_SIZE];
+
+        // The header page may only be in the pool
+        this->pool->flush_page(-1);
+        this->storage->read(0, buffer, EPSILON_HEADER_SIZE);
+
+        int _root, _page_size, _node_count, _fanout;
+        memcpy(&_root, buffer, sizeof(int));
+        memcpy(&_page_size, &buffer[sizeof(int)], sizeof(int));
+        memcpy(&_node_count, &buffer[sizeof(int)*2], sizeof(int));
+        memcpy(&_fanout, &buffer[sizeof(int)*3], sizeof(int));
+
+        if(_page_size < MIN_PAGE_SIZE || _page_size > MAX_PAGE_SIZE || (_page_size & (_page_size-1)) != 0)
+            return;
+        if(_fanout < 3 || EPSILON_BUFFER_SIZE(_page_size, _fanout) < 2*_fanout)
+            return;
+
+        this->set_geometry(_page_size, _fanout);
+        this->root = _root;
+        this->node_count = _node_count;
+    }
+}
+
+void EpsilonBTree::store_info_header(){
+    if(this->storage->is_open()){
+        char* buffer = this->pool->fetch_page(-1);
+        if(buffer == nullptr)
+            return;
+
+        memcpy(buffer, &this->root, sizeof(int));
+        memcpy(&buffer[sizeof(int)], &this->page_size, sizeof(int));
+        memcpy(&buffer[sizeof(int)*2], &this->node_count, sizeof(int));
+        memcpy(&buffer[sizeof(int)*3], &this->fanout, sizeof(int));
+        this->pool->unpin_page(-1, true);
+    }
+}
+
+void EpsilonBTree::init(int _page_size, int _fanout){
+    // The page size must be a power of two inside the limits, with room
+    // for the messages of every child
+    if(_page_size < MIN_PAGE_SIZE || _page_size > MAX_PAGE_SIZE || (_page_size & (_page_size-1)) != 0)
+        return;
+    if(_fanout < 3 || EPSILON_BUFFER_SIZE(_page_size, _fanout) < 2*_fanout)
+        return;
+
+    // (Re)creates the file, so init also works when it does not exist yet
+    this->storage->open(true);
+
+    if(this->storage->is_open()){
+        // Cached pages belong to the old file
+        this->pool->reset();
+        this->set_geometry(_page_size, _fanout);
+        this->node_count = 0;
+
+        // initializes with an empty leaf as root
+        this->root = 0;
+        int ptr;
+        EpsilonPage r = this->new_page(true, ptr);
+        if(r.valid())
+            this->unpin_page(ptr, true);
+    }
+}
+
+int EpsilonBTree::get_page_size(){
+    return this->page_size;
+}
+
+int EpsilonBTree::get_fanout(){
+    return this->fanout;
+}
+
+int EpsilonBTree::get_buffer_size(){
+    return this->buffer_size;
+}
+
+EpsilonPage EpsilonBTree::pin_page(int ptr){
+    return EpsilonPage(this->pool->fetch_page(ptr), this->fanout, this->buffer_size);
+}
+
+void EpsilonBTree::unpin_page(int ptr, bool dirty){
+    this->pool->unpin_page(ptr, dirty);
+}
+
+EpsilonPage EpsilonBTree::new_page(bool leaf, int &ptr){
+    ptr = this->node_count++;
+    this->store_info_header();
+
+    EpsilonPage x(this->pool->new_page(ptr), this->fanout, this->buffer_size);
+    if(x.valid()){
+        EpsilonNode empty;
+        empty.leaf = leaf;
+        empty.link = -1;
+        x.write(empty);
+    }
+    return x;
+}
+
+bool EpsilonBTree::search(int key){
+    if(!this->storage->is_open())
+        return false;
+
+    int ptr = this->root;
+    while(true){
+        EpsilonPage x = this->pin_page(ptr);
+        if(!x.valid())
+            return false;
+
+        int n = x.get_n();
+        if(x.is_leaf()){
+            int i = lower_bound_keys(x.keys(), n, key);
+            bool found = (i < n && x.keys()[i] == key);
+            this->unpin_page(ptr, false);
+            return found;
+        }
+
+        // The first message for key on the path is the newest
+        int j = x.find_message(key);
+        if(j != -1){
+            bool found = (x.message_types()[j] == EPSILON_INSERT);
+            this->unpin_page(ptr, false);
+            return found;
+        }
+
+        int next = x.children()[upper_bound_keys(x.keys(), n, key)];
+        this->unpin_page(ptr, false);
+        ptr = next;
+    }
+}
+
+void EpsilonBTree::insert(int key){
+    this->put({key, EPSILON_INSERT});
+}
+
+void EpsilonBTree::remove(int key){
+    this->put({key, EPSILON_REMOVE});
+}
+
+void EpsilonBTree::put(const Message &msg){
+    if(!this->storage->is_open())
+        return;
+
+    // Most messages just join the buffer of the root, in place
+    EpsilonPage r = this->pin_page(this->root);
+    if(!r.valid())
+        return;
+    if(!r.is_leaf() && r.add_message(msg)){
+        this->unpin_page(this->root, true);
+        return;
+    }
+    this->unpin_page(this->root, false);
+
+    std::vector<Message> messages(1, msg);
+    std::vector<std::pair<int, int>> split;
+    this->push(this->root, messages, split);
+    this->growRoot(split);
+}
+
+void EpsilonBTree::push(int ptr, std::vector<Message> &messages, std::vector<std::pair<int, int>> &split){
+    EpsilonPage x = this->pin_page(ptr);
+    if(!x.valid())
+        return;
+    EpsilonNode node;
+    x.read(node);
+    this->unpin_page(ptr, false);
+
+    if(node.leaf){
+        apply_messages(node.keys, messages);
+    }else{
+        merge_messages(node.messages, messages);
+        this->spill(node);
+    }
+    this->store(ptr, node, split);
+}
+
+void EpsilonBTree::spill(EpsilonNode &node){
+    while((int)node.messages.size() > this->buffer_size){
+        // Count the messages of every child, they are in key order
+        int best = 0;
+        size_t best_first = 0, best_last = 0;
+        size_t first = 0;
+        for(size_t c = 0; c < node.children.size(); c++){
+            size_t last = first;
+            while(last < node.messages.size() && route(node.keys, node.messages[last].key) == (int)c)
+                last++;
+            if(last-first > best_last-best_first){
+                best = c;
+                best_first = first;
+                best_last = last;
+            }
+            first = last;
+        }
+
+        // The batch leaves the buffer and goes down together
+        std::vector<Message> batch(node.messages.begin()+best_first, node.messages.begin()+best_last);
+        node.messages.erase(node.messages.begin()+best_first, node.messages.begin()+best_last);
+
+        std::vector<std::pair<int, int>> child_split;
+        this->push(node.children[best], batch, child_split);
+
+        // The pages the child grew by follow it
+        for(size_t j = 0; j < child_split.size(); j++){
+            node.keys.insert(node.keys.begin()+best+j, child_split[j].first);
+            node.children.insert(node.children.begin()+best+j+1, child_split[j].second);
+        }
+    }
+}
+
+void EpsilonBTree::store(int ptr, EpsilonNode &node, std::vector<std::pair<int, int>> &split){
+    int m = node.keys.size();
+
+    // Count the pages needed. Every inner page after the first takes a
+    // pivot as separator, a leaf keeps its first key
+    int k;
+    if(node.leaf)
+        k = (m+this->leaf_keys-1)/this->leaf_keys;
+    else
+        k = (m+this->fanout)/this->fanout;
+    if(k < 1)
+        k = 1;
+    int stored = node.leaf ? m : m-(k-1);
+
+    // The first page keeps its place, the new ones follow it on the chain
+    std::vector<int> ptrs(1, ptr);
+    for(int j = 1; j < k; j++){
+        int new_ptr;
+        EpsilonPage y = this->new_page(node.leaf, new_ptr);
+        if(!y.valid())
+            return;
+        this->unpin_page(new_ptr, true);
+        ptrs.push_back(new_ptr);
+    }
+
+    int pos = 0;
+    size_t msg = 0;
+    for(int j = 0; j < k; j++){
+        int cnt = stored/k + (j < stored%k ? 1 : 0);
+        EpsilonNode y;
+        y.leaf = node.leaf;
+        y.link = node.leaf ? (j+1 < k ? ptrs[j+1] : node.link) : -1;
+        y.keys.assign(node.keys.begin()+pos, node.keys.begin()+pos+cnt);
+        if(j > 0)
+            split.push_back({node.keys[node.leaf ? pos : pos-1], ptrs[j]});
+
+        // Messages go with the children they are for, up to the next
+        // separator
+        if(!node.leaf){
+            y.children.assign(node.children.begin()+pos, node.children.begin()+pos+cnt+1);
+            size_t last = msg;
+            while(last < node.messages.size() && (j+1 == k || node.messages[last].key < node.keys[pos+cnt]))
+                last++;
+            y.messages.assign(node.messages.begin()+msg, node.messages.begin()+last);
+            msg = last;
+        }
+
+        EpsilonPage x = this->pin_page(ptrs[j]);
+        if(!x.valid())
+            return;
+        x.write(y);
+        this->unpin_page(ptrs[j], true);
+
+        pos += node.leaf ? cnt : cnt+1;
+    }
+}
+
+void EpsilonBTree::growRoot(std::vector<std::pair<int, int>> &split){
+    // While the root grows by pages, the tree grows in height
+    while(!split.empty()){
+        int ptr;
+        EpsilonPage r = this->new_page(false, ptr);
+        if(!r.valid())
+            return;
+        this->unpin_page(ptr, true);
+
+        EpsilonNode node;
+        node.leaf = false;
+        node.link = -1;
+        node.children.push_back(this->root);
+        for(std::pair<int, int> &s : split){
+            node.keys.push_back(s.first);
+            node.children.push_back(s.second);
+        }
+
+        split.clear();
+        this->store(ptr, node, split);
+        this->root = ptr;
+        this->store_info_header();
+    }
+}
+
+void EpsilonBTree::merge_messages(std::vector<Message> &older, const std::vector<Message> &newer){
+    std::vector<Message> merged;
+    merged.reserve(older.size()+newer.size());
+    size_t a = 0, b = 0;
+    while(a < older.size() || b < newer.size()){
+        if(b == newer.size() || (a < older.size() && older[a].key < newer[b].key)){
+            merged.push_back(older[a++]);
+        }else{
+            if(a < older.size() && older[a].key == newer[b].key)
+                a++;
+            merged.push_back(newer[b++]);
+        }
+    }
+    older.swap(merged);
+}
+
+void EpsilonBTree::apply_messages(std::vector<int> &keys, const std::vector<Message> &messages){
+    std::vector<int> result;
+    result.reserve(keys.size()+messages.size());
+    size_t a = 0, b = 0;
+    while(a < keys.size() || b < messages.size()){
+        if(b == messages.size() || (a < keys.size() && keys[a] < messages[b].key)){
+            result.push_back(keys[a++]);
+        }else{
+            // The message decides if its key stays
+            if(a < keys.size() && keys[a] == messages[b].key)
+                a++;
+            if(messages[b].type == EPSILON_INSERT)
+                result.push_back(messages[b].key);
+            b++;
+        }
+    }
+    keys.swap(result);
+}
+
+int EpsilonBTree::route(const std::vector<int> &pivots, int key){
+    return upper_bound_keys(pivots.data(), pivots.size(), key);
+}
+
+void EpsilonBTree::traverse(){
+    if(!this->storage->is_open())
+        return;
+
+    std::vector<Message> pending;
+    this->traverse(this->root, pending);
+}
+
+void EpsilonBTree::traverse(int ptr, const std::vector<Message> &pending){
+    EpsilonPage x = this->pin_page(ptr);
+    if(!x.valid())
+        return;
+    EpsilonNode node;
+    x.read(node);
+    this->unpin_page(ptr, false);
+
+    if(node.leaf){
+        apply_messages(node.keys, pending);
+        for(int key : node.keys)
+            std::cout << " " << key;
+        return;
+    }
+
+    // The messages of the ancestors are newer than the ones of the page
+    merge_messages(node.messages, pending);
+    size_t first = 0;
+    for(size_t c = 0; c < node.children.size(); c++){
+        size_t last = first;
+        while(last < node.messages.size() && route(node.keys, node.messages[last].key) == (int)c)
+            last++;
+        std::vector<Message> below(node.messages.begin()+first, node.messages.begin()+last);
+        this->traverse(node.children[c], below);
+        first = last;
+    }
+}
+
+#endif
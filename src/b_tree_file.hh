@@ -36,9 +36,124 @@
 #include <iostream>
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
 #include <fstream>
+#include <istream>
+#include <iterator>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "b_tree_aio.hh"
+#include "b_tree_bloom.hh"
+#include "b_tree_buffer.hh"
+#include "b_tree_latch.hh"
+#include "b_tree_pack.hh"
+#include "b_tree_storage.hh"
+#include "b_tree_simd.hh"
+#include "b_tree_wal.hh"
+
+// Default size of a node page on the file
+#define DEFAULT_PAGE_SIZE 4096
+
+// Limits of the page size, which must be a power of two
+#define MIN_PAGE_SIZE 512
+#define MAX_PAGE_SIZE 65536
+
+// Size of the info header (root, t, page size, layout, free pages, first
+// free page, value size, packed, generation). The header takes the whole
+// first page of the file, so every node page is aligned on disk
+#define HEADER_SIZE (sizeof(int)*9)
+
+// Default memory budget of the buffer pool, in bytes
+#define DEFAULT_CACHE_SIZE (1 << 20)
+
+// Minimum number of pool frames of a logged tree, the pages changed by an
+// operation stay pinned until it commits
+#define WAL_MIN_FRAMES 256
+
+// Number of sibling pages a cursor reads ahead of its position
+#define CURSOR_READAHEAD 8
+
+// Layout of a node page: (t, n, leaf, keys, children). B+ leaves keep
+// their values after the children
+#define NODE_T_OFFSET 0
+#define NODE_N_OFFSET (sizeof(int))
+#define NODE_LEAF_OFFSET (sizeof(int)*2)
+#define NODE_KEYS_OFFSET (sizeof(int)*3)
+
+// Maximum number of keys of a node page, there is one more child than keys
+#define NODE_MAX_KEYS(page_size) (((page_size)-NODE_KEYS_OFFSET-sizeof(int))/(sizeof(int)*2))
+
+// A free page is marked with a negative key count, and its first key slot
+// links to the next free page
+#define FREE_PAGE_MARK (-1)
+
+// Maximum number of keys of a B+ leaf page. Leaves have no children, only
+// the (prev, next) links, which take the place of the child array, and
+// the values of the keys after them
+#define NODE_LEAF_MAX_KEYS(page_size, value_size) \
+    (((page_size)-NODE_KEYS_OFFSET-sizeof(int)*2)/(sizeof(int)+(value_size)))
+
+// Minimum number of keys a B+ leaf page must fit, bounds the value size
+#define NODE_LEAF_MIN_KEYS 4
+
+// Layout of a packed B+ leaf page: (t, n, leaf, PackedHeader, keys,
+// values). The keys take as many bytes as their encoding needs, and the
+// values follow them
+#define PACKED_DATA_OFFSET (NODE_KEYS_OFFSET+sizeof(PackedHeader))
+
+// Times more keys than a plain B+ leaf a packed leaf can hold
+#define PACKED_LEAF_FACTOR 8
+
+// Layouts of the file. A B+ tree keeps every key on leaves linked in key
+// order, and inner nodes only hold separators copied from the leaves
+enum TreeLayout {BTREE_LAYOUT = 0, BPLUS_LAYOUT = 1};
+
+// Orders of the pages of a compacted file. Breadth first stores every
+// level after the one above it. Van Emde Boas order stores the top half
+// of the levels first, then every subtree under them the same way, so
+// any path is spread over few runs of the file
+enum CompactOrder {BFS_ORDER = 0, VEB_ORDER = 1};
+
+// Fields of a packed B+ leaf page after (t, n, leaf)
+struct PackedHeader
+{
+    int encoding;       // PackEncoding of the keys
+    int prev;           // Links of the leaf, -1 at the ends of the chain
+    int next;
+    int base;           // First key, for the frame of reference
+    int width;          // Bits of every packed number
+};
+
+// The packed B+ leaves a thread has pinned, decoded by page pointer. A
+// leaf is decoded when the thread pins it first, and encoded back on its
+// page when the thread releases its last pin, if it was changed
+struct ScratchSet
+{
+    struct Leaf
+    {
+        char* page;                 // Pinned page of the leaf
+        std::vector<char> data;     // Decoded leaf, laid out like a B+ leaf page
+        int pins;                   // Pins held by the thread
+        bool dirty;                 // Is true when the leaf was changed
+    };
+
+    std::unordered_map<int, Leaf> leaves;       // Pinned leaves
+    std::vector<std::vector<char>> spare;       // Buffers of released leaves
+};
 
 // A BTree file node
 class BTreeNode
@@ -48,9 +163,16 @@ class BTreeNode
     int *C;             // And array of child file positions
     int n;              // Current number of keys
     bool leaf;          // Is true when node is leaf. Otherwise false
+    int max_keys;       // Size of the key array, set by the page size
 
 public:
-    BTreeNode(int _t, bool _leaf);  // Constructor
+    BTreeNode(int _t, bool _leaf, int _max_keys = NODE_MAX_KEYS(DEFAULT_PAGE_SIZE));  // Constructor
+
+    ~BTreeNode();                   // Destructor
+
+    // Nodes own their arrays, so they are not copied
+    BTreeNode(const BTreeNode&) = delete;
+    BTreeNode& operator=(const BTreeNode&) = delete;
     
     // A function to check if BTree is empty
     bool is_empty();
@@ -61,29 +183,145 @@ public:
     // A function to search a key in subtree rooted with this node
     BTreeNode *search(int k);       // returns NULL if k is not present
 
-    // A function to serialize node data
-    char* serialize();
+    // A function to serialize node data into a node page with page_keys
+    // key slots. B+ leaves keep their (prev, next) links on C
+    void serialize(char* data, int page_keys);
 
-    // A function to deserialize node data
-    void deserialize(char* data);
+    // A function to deserialize node data from a node page with page_keys
+    // key slots
+    void deserialize(char* data, int page_keys);
 
     // Access to private attributes
     friend class BTree;
 };
 
-// A file BTree
+// A view of a node page, reads and edits the page data in place.
+// Keys and children are only decoded when they are touched
+class NodeView
+{
+    char *data;         // Page data
+    int max_keys;       // Size of the key array of the page
+    int value_size;     // Size of the value of every key, 0 if the page has none
+
+public:
+    NodeView(char *_data = nullptr, int _max_keys = 0, int _value_size = 0)
+        : data(_data), max_keys(_max_keys), value_size(_value_size) {}
+
+    // A function to check if the view points to a page
+    bool valid() { return this->data != nullptr; }
+
+    // Access to the raw page data
+    char* page() { return this->data; }
+
+    // Access to the page fields
+    int get_t() { return this->get_int(NODE_T_OFFSET); }
+    void set_t(int _t) { this->set_int(NODE_T_OFFSET, _t); }
+    int get_n() { return this->get_int(NODE_N_OFFSET); }
+    void set_n(int _n) { this->set_int(NODE_N_OFFSET, _n); }
+    bool is_leaf() { return this->data[NODE_LEAF_OFFSET] != 0; }
+    void set_leaf(bool _leaf) { this->data[NODE_LEAF_OFFSET] = _leaf; }
+    int key(int i) { return this->get_int(NODE_KEYS_OFFSET+sizeof(int)*i); }
+    void set_key(int i, int k) { this->set_int(NODE_KEYS_OFFSET+sizeof(int)*i, k); }
+    int child(int i) { return this->get_int(this->children_offset()+sizeof(int)*i); }
+    void set_child(int i, int c) { this->set_int(this->children_offset()+sizeof(int)*i, c); }
+
+    // Links of a B+ leaf, -1 at the ends of the chain
+    int get_prev() { return this->child(0); }
+    void set_prev(int ptr) { this->set_child(0, ptr); }
+    int get_next() { return this->child(1); }
+    void set_next(int ptr) { this->set_child(1, ptr); }
+
+    // Values of a B+ leaf, stored after its links
+    char* value(int i) { return &this->data[this->children_offset()+sizeof(int)*2+(size_t)this->value_size*i]; }
+
+    // A function to set the value i, to zeroes if v is nullptr
+    void set_value(int i, const char* v);
+
+    // A function to move count values from index from to index to
+    void move_values(int to, int from, int count);
+
+    // Typed views of the key and child arrays
+    int* keys() { return (int*)&this->data[NODE_KEYS_OFFSET]; }
+    int* children() { return (int*)&this->data[this->children_offset()]; }
+
+    // A function that returns the index of the first key greater than
+    // or equal to k
+    int find_key(int k);
+
+private:
+    int children_offset() { return NODE_KEYS_OFFSET+sizeof(int)*this->max_keys; }
+
+    int get_int(int offset){
+        int value;
+        memcpy(&value, &this->data[offset], sizeof(int));
+        return value;
+    }
+
+    void set_int(int offset, int value){
+        memcpy(&this->data[offset], &value, sizeof(int));
+    }
+};
+
+class BTreeBulkLoader;
+
+// A file BTree. Searches and inserts can run on many threads at once:
+// they latch the node pages top-down with lock coupling, and an insert
+// releases the pages above a child once the child is not full, so it
+// can't split up to them. Removes and batched inserts fix nodes on the
+// way back up and take the whole tree instead. On a logged tree inserts
+// also take turns, but they wait for their log sync together
 class BTree
 {
-    int root;               // Root file position
+    std::atomic<int> root;  // Root file position
     int t;                  // Maximum degree
+    int leaf_t;             // Maximum degree of leaves
+    int layout;             // TreeLayout of the file
+    int page_size;          // Size of every page of the file
+    int max_keys;           // Number of keys that fit in a page
+    int leaf_max_keys;      // Number of keys that fit in a B+ leaf page
+    int value_size;         // Size of the value of every key of a B+ tree, 0 if keys have none
+    bool packed;            // Is true when the keys of B+ leaves are compressed
     BTreeNode* node;        // Current loaded node
     int node_ptr;           // Current node pointer
+    std::atomic<int> node_count;    // Number of nodes on the file
+    int free_count;         // Number of free pages on the file
+    int free_head;          // First free page, -1 if there is none
+    int generation;         // Id of the contents of the file, new on every init and bulk load
     std::string fpath;      // File path
-    std::fstream file;      // File stream (input/output, binary)
+    Storage* storage;       // File backend (std::fstream or memory map)
+    long cache_size;        // Memory budget of the buffer pool, in bytes
+    BufferPool* pool;       // Page cache between the tree and the file
+    WriteAheadLog* wal;     // Log of the changed pages, nullptr if not logged
+    BloomFilter* filter;    // Filter of the keys, nullptr if the tree keeps none
+    bool sync_commit;       // Is true when operations wait for their log sync
+    std::vector<int> op_pages;      // Pages changed by the current operation
+    std::vector<char> op_records;   // Log records of the current operation
+    std::shared_mutex tree_latch;   // Shared by operations that latch pages, exclusive otherwise
+    std::shared_mutex root_latch;   // Guards root until its page is latched
+    std::mutex writer_latch;        // Taken by the inserts of a logged tree
+    std::recursive_mutex meta_latch;    // Guards the node count, the free list and the header
+    PageLatches latches;            // Latches of the node pages
 
 public:
 
-    BTree(std::string _fpath);      // Constructor
+    // Constructor. _storage is a StorageType and _hints are the MmapHints
+    // used by the mapped storage. A _logged tree keeps a write-ahead log
+    // next to the file, and the committed operations found there are
+    // applied again when the tree is opened
+    BTree(std::string _fpath, long _cache_size = DEFAULT_CACHE_SIZE,
+          int _storage = FSTREAM_STORAGE, int _hints = 0, bool _logged = false);
+
+    ~BTree();                       // Destructor, writes cached nodes back
+
+    // A function to write every cached node back to the file. A logged
+    // tree syncs the file and empties the log (a checkpoint). The filter
+    // of the keys is stored too, built again first if it got too loose
+    void flush();
+
+    // A function to choose if the operations of a logged tree return only
+    // once their log records are on disk. Otherwise they become durable
+    // with the next sync of the log
+    void set_sync_commit(bool _sync_commit);
 
     // A function to load BTree info from the file header
     void load_info_header();
@@ -91,40 +329,562 @@ public:
     // A function to store BTree info in the file header
     void store_info_header(int _root, int _t);
 
-    // A function to initialize Btree and file
-    void init(int _t);
+    // A function to initialize Btree and file. The page size must be a
+    // power of two between MIN_PAGE_SIZE and MAX_PAGE_SIZE. When _t is
+    // lower than 3 or doesn't fit in a page, the fanout is the largest
+    // one the page allows. _layout is a TreeLayout, B+ leaves hold as many
+    // more keys than t as their page allows. A B+ tree can keep a value of
+    // _value_size bytes with every key, on its leaves. A _packed B+ tree
+    // compresses the keys of its leaves, which then hold as many keys as
+    // fit once encoded, up to PACKED_LEAF_FACTOR times more
+    void init(int _t, int _page_size = DEFAULT_PAGE_SIZE, int _layout = BTREE_LAYOUT,
+              int _value_size = 0, bool _packed = false);
+
+    // Access to the page geometry
+    int get_page_size();
+    int get_max_keys();
+    int get_layout();
+    int get_value_size();
+    bool is_packed();
 
     // A function to load a node from secondary memory to the primary memory,
-    // using a pointer
+    // using a pointer. The node is loaded on the node shared by every
+    // thread
     void load_node(int ptr);
 
     // A function to store a node from primary memory to secondary memory,
-    // using a pointer
-    void store_node(int ptr, BTreeNode node);
+    // using a pointer. Returns false if it was not stored, a packed leaf
+    // whose keys don't fit its page is rejected
+    bool store_node(int ptr, BTreeNode &node);
 
     // A function to add a new node to secondary memory
-    // Returns file pointer
-    int add_node(BTreeNode node);
+    // Returns file pointer, or -1 like store_node
+    int add_node(BTreeNode &node);
 
-    // A function to insert key k
+    // A function to insert key k. On a tree with values, its value is
+    // zeroed
     void insert(int key);
 
-    // A function to insert key k in a non-full node
-    void insertNonFull(int key);
+    // Functions to read, set and change the value of key on a B+ tree with
+    // values. Value must be trivially copyable and as large as the values
+    // of the tree, otherwise nothing is done and false is returned. get
+    // returns false if key is not present, put and upsert return true if
+    // key was added. upsert changes the value of a present key in place
+    // with update, and adds key with value otherwise
+    template <typename Value>
+    bool get(int key, Value &value);
+    template <typename Value>
+    bool put(int key, const Value &value);
+    template <typename Value, typename Update>
+    bool upsert(int key, const Value &value, Update update);
+
+    // A function to insert count keys, in any order. The keys are sorted
+    // and routed down the tree together, so every node is read and
+    // written once per batch, and full nodes are split as many times as
+    // needed at once
+    void insert_batch(const int* keys, int count);
+    void insert_batch(const std::vector<int> &keys);
+
+    // A function to remove key k. Returns false if k is not present
+    bool remove(int key);
 
-    // A function to split full nodes
-    void splitChild(int i, BTreeNode* y, BTreeNode* p);
+    // A function to insert key k in the subtree rooted with the non-full
+    // node x, stored at ptr, with value (zeroes if it is nullptr). When
+    // update is given and key is already on its leaf, the value is changed
+    // with update instead. Returns true if key was added. x must be pinned
+    // and is unpinned on return
+    bool insertNonFull(int ptr, NodeView x, int key, const char* value = nullptr,
+                       const std::function<void(char*)>* update = nullptr);
 
-    // A function to search key on tree
+    // A function to split the child y of p, which is full or can't fit
+    // key. i is the index of y in the child array of p
+    void splitChild(int i, NodeView p, NodeView y, int key);
+
+    // A function to search key on tree. The node found is loaded on the
+    // node shared by every thread, threads use find instead
     BTreeNode* search(int key);
+
+    // A function that returns the file pointer of the node holding key,
+    // or -1. It can be called by many threads at once
+    int find(int key);
+
+    // A function to search many keys at once. The lookups go down the
+    // tree together one level at a time, and every node page a level
+    // needs is read once, in file order. results[i] is the file pointer
+    // of the node holding keys[i], or -1. Returns the number of keys
+    // found. Like find, it can be called by many threads at once
+    int search_many(const std::vector<int> &keys, std::vector<int> &results);
+
+    // A function to build the tree bottom-up from keys sorted in ascending
+    // order, replacing its contents. Nodes are filled up to fill*t keys and
+    // written in one sequential pass, the header is written at the end.
+    // Returns false, leaving the tree empty, if the keys aren't sorted
+    template <typename Iterator>
+    bool bulk_load(Iterator first, Iterator last, double fill = 1.0);
+
+    // A function to bulk load whitespace separated keys from a stream
+    bool bulk_load(std::istream &input, double fill = 1.0);
+
+    // A function to rewrite the tree on a new file, with its nodes filled
+    // up to fill*t keys and stored in a CompactOrder, and to replace the
+    // file with it. The new file takes the place of the old one with a
+    // rename, so a crash leaves either tree whole. Cursors and
+    // asynchronous operations must be created again afterwards. Returns
+    // false, leaving the tree as it was, if the new file can't be written
+    bool compact(int order = BFS_ORDER, double fill = 1.0);
+
+    // A function to keep a filter of the keys, of bits_per_key bits per
+    // key, so searches for missing keys skip the descent. The filter is
+    // built from the tree, kept by every insert and remove, and stored
+    // next to the file, where the tree finds it when it is opened again
+    void enable_filter(int bits_per_key = BLOOM_BITS_PER_KEY);
+
+    // A function to stop keeping the filter and delete its file
+    void disable_filter();
+
+    // A function to print every key in order
+    void traverse();
+
+private:
+    // A function to pin a node page, latching it in the mode of the
+    // calling thread. Returns an invalid view if ptr is not a node of the
+    // file. A packed leaf is decoded, unless decode is false, then the
+    // view is of the packed page and is only read with node_find,
+    // node_key and node_next
+    NodeView pin_node(int ptr, bool decode = true);
+
+    // A function to release a pinned node page and its latch. A page
+    // changed by a logged operation stays pinned until the operation
+    // commits
+    void unpin_node(int ptr, bool dirty);
+
+    // A function that returns the packed leaves the calling thread holds
+    // decoded
+    ScratchSet& scratch_set();
+
+    // A function to pin the decoded packed leaf of the page raw, decoding
+    // it if the thread doesn't hold it yet. A fresh leaf starts empty.
+    // Returns an invalid view if the page is not a leaf
+    NodeView decode_node(int ptr, NodeView raw, bool fresh = false);
+
+    // A function to release a pin of a decoded packed leaf, encoding it
+    // on its page with the last one. Returns whether the page changed
+    bool encode_node(int ptr, bool dirty);
+
+    // Functions to encode the decoded leaf x on page and to decode page
+    // on x. x must fit a packed page
+    void pack_leaf(NodeView &x, char* page);
+    void unpack_leaf(char* page, NodeView &x);
+
+    // A function that returns the bytes of a packed leaf of n keys from
+    // first to last, whose distances take width bits
+    int packed_size(int n, int first, int last, int width);
+
+    // A function that returns how many of the n sorted keys fit on a
+    // packed leaf
+    int packed_fit(const int* keys, int n);
+
+    // A function to check if all of the n sorted keys fit on a packed leaf
+    bool packed_fits(const int* keys, int n);
+
+    // A function to check if node fits its page. Only packed leaves can
+    // hold fewer keys than their slots
+    bool node_fits(BTreeNode &node);
+
+    // A function that returns how many keys the full packed leaf y keeps
+    // when it splits to make room for key, so both halves take the least
+    // room. key_first is set when key must start the new leaf
+    int packed_split(NodeView &y, int key, bool &key_first);
+
+    // Functions to read a node that may be a packed leaf pinned without
+    // decoding: the index of the first key greater than or equal to key,
+    // the key i and the next leaf
+    int node_find(NodeView &x, int key);
+    int node_key(NodeView &x, int i);
+    int node_next(NodeView &x);
+
+    // A function to log the pages changed by the current operation as a
+    // single commit and release them. Returns the LSN of the commit, or 0
+    // if nothing was logged
+    long commit_operation();
+
+    // A function to wait for the log sync of a commit, when operations
+    // wait for it
+    void wait_commit(long lsn);
+
+    // A function to write every cached node back to the file and empty
+    // the log, without taking the tree
+    void checkpoint();
+
+    // A function to search key, loading the node found on result and
+    // copying the value of key to value when they are not nullptr.
+    // Returns the file pointer of the node or -1
+    int find(int key, BTreeNode* result, char* value);
+
+    // A function to insert key with value, or to change its value with
+    // update when it is present and update is given. Returns true if key
+    // was added
+    bool insert(int key, const char* value, const std::function<void(char*)>* update);
+
+    // A function that returns the latches the calling thread holds on
+    // the pages of this tree
+    LatchSet& latch_set();
+
+    // A function to add an empty node page to the file. The page is left
+    // pinned and latched, and its file pointer is returned on ptr
+    NodeView new_node(bool leaf, int &ptr);
+
+    // A function to set the page geometry and rebuild the pool for it
+    void set_page_size(int _page_size);
+
+    // A function that returns a new random id for the contents of a file,
+    // never 0, the id of files written before there were ids
+    static int new_generation();
+
+    // A function to set the layout, deriving the leaf degree from t
+    void set_layout(int _layout);
+
+    // A function that returns the number of key slots of a node page
+    int page_keys(bool leaf);
+
+    // A function that returns the maximum number of keys of a node
+    int capacity(NodeView &x);
+
+    // A function to check if the node x has to split before key is added.
+    // A packed leaf is also full when key would not fit on its page
+    bool is_full(NodeView &x, int key);
+
+    // A function that returns the size of a decoded packed leaf
+    int scratch_size();
+
+    // A function to split the B+ leaf y of p, copying the first key of
+    // the new leaf up
+    void splitLeaf(int i, NodeView p, NodeView y, int key);
+
+    // A function to insert the sorted keys [first, last) in the subtree
+    // rooted at ptr. The nodes the subtree grows by are returned on split
+    // as (separator, pointer) pairs, to be linked after ptr in its parent
+    void insertSorted(int ptr, const int* first, const int* last,
+                      std::vector<std::pair<int, int>> &split);
+
+    // A function to link the nodes returned on split by the last step of
+    // path to its parent, going up the path while the parents split too
+    void linkSplit(std::vector<std::pair<int, int>> &path, std::vector<std::pair<int, int>> &split);
+
+    // A function to add a root over the old one and the nodes it grew by,
+    // as long as the new root grows too
+    void growRoot(std::vector<std::pair<int, int>> &split);
+
+    // A function to store keys, and children for inner nodes or values
+    // for B+ leaves, on the node at ptr. If they don't fit, they are spread
+    // evenly over new nodes that are returned on split like in insertSorted
+    void storeNodes(int ptr, bool leaf, std::vector<int> &keys, std::vector<int> &children,
+                    std::vector<char> &values, std::vector<std::pair<int, int>> &split);
+
+    // A function that returns the minimum number of keys of a non root node
+    int min_keys(NodeView &x);
+
+    // A function to remove key from the subtree rooted with x, stored at
+    // ptr. Every node entered has more than the minimum number of keys,
+    // so the removal never needs to go back up. x must be pinned and is
+    // unpinned on return
+    bool removeFrom(int ptr, NodeView x, int key);
+
+    // A function to remove key from a B+ tree. Equal keys can be on both
+    // sides of a separator, so the leaf is found first and the nodes that
+    // fall under the minimum are fixed on the way back up
+    bool removeFromLeaf(int key);
+
+    // A function to move a path of (node, child index) steps to the next
+    // node of the same level. Returns the node or -1 at the end
+    int nextOnPath(std::vector<std::pair<int, int>> &path);
+
+    // Functions to get the largest and the smallest key of the subtree
+    // rooted at ptr
+    int getPred(int ptr);
+    int getSucc(int ptr);
+
+    // A function to fill the child idx of x that has the minimum number
+    // of keys. Returns the index of the child that covers the same keys
+    int fill(NodeView x, int idx);
+
+    // Functions to move a key from the sibling w of the child y of x at idx
+    void borrowFromPrev(NodeView x, int idx, NodeView w, NodeView y);
+    void borrowFromNext(NodeView x, int idx, NodeView y, NodeView w);
+
+    // A function to merge the child idx+1 of x into the child idx. The
+    // page of the child idx+1 is freed
+    void merge(NodeView x, int idx);
+
+    // A function to add a node page to the free list
+    void free_node(int ptr);
+
+    // A function that returns the file offset of a node page
+    long node_offset(int ptr);
+
+    // A function to add every key of the tree to loader, in order, with
+    // the values of a B+ tree. Returns false if loader refuses one
+    bool copy_keys(BTreeBulkLoader &loader);
+
+    // A function to write the pages of the tree on a new file at path in
+    // a CompactOrder, with their links following them
+    bool write_ordered(const std::string &path, int order);
+
+    // A function to list the nodes of the subtree rooted at ptr that are
+    // less than levels deep, in van Emde Boas order
+    void veb_order(int ptr, int levels, std::vector<int> &order);
+
+    // A function to list the nodes depth levels under ptr, in key order
+    void nodes_below(int ptr, int depth, std::vector<int> &nodes);
+
+    // A function to fill the filter again with every key of the tree,
+    // sized for BLOOM_GROWTH times their number. The tree must be held
+    void build_filter();
+
+    // The bulk loader writes pages directly
+    friend class BTreeBulkLoader;
+
+    // Cursors walk the node pages
+    friend class BTreeCursor;
+
+    // Asynchronous operations walk the node pages before running
+    friend class BTreeAsync;
+};
+
+// A bottom-up builder of a BTree from sorted keys. Every level keeps the
+// keys and children of at most two nodes, and a node is only written once
+// enough entries follow it for the last node of the level to be at least
+// half full. B+ leaves are written one leaf late, once the page of the
+// next leaf in the chain is known
+class BTreeBulkLoader
+{
+    // Entries of one level that are not written yet
+    struct Level
+    {
+        std::vector<int> keys;          // Pending keys
+        std::vector<int> children;      // Pending children (empty for leaves)
+        std::vector<char> values;       // Pending values of B+ leaves
+    };
+
+    BTree* tree;                // Tree being built
+    int cap;                    // Keys per node while loading
+    int leaf_cap;               // Keys per leaf while loading
+    int leaf_bytes;             // Bytes per packed leaf while loading
+    int leaf_width;             // Widest distance of the pending leaf keys, in bits
+    bool plus;                  // Is true when leaves are B+ leaves
+    std::vector<Level> levels;  // Levels, 0 holds the leaves
+    int buffer_size;            // Size of the page buffers
+    char* page;                 // Aligned buffer for the page being written
+    char* pending;              // Aligned buffer of the last B+ leaf
+    char* encoded;              // Aligned buffer of a packed leaf page
+    int pending_ptr;            // Pointer of the last B+ leaf, -1 if none
+    bool started;               // Is true after the first key
+    int last;                   // Last key added, to check the order
+
+public:
+    BTreeBulkLoader(BTree* _tree, double fill);     // Constructor
+
+    ~BTreeBulkLoader();
+
+    // A function to check if the tree could be reset for loading
+    bool valid();
+
+    // A function to add the next key, with value on a B+ tree with values
+    // (zeroes if it is nullptr). Returns false if it is out of order
+    bool add(int key, const char* value = nullptr);
+
+    // A function to write the pending nodes and the header
+    bool finish();
+
+private:
+    // Functions to add an entry to a level, writing a node when the level
+    // has enough entries
+    void add_key(int h, int key);
+    void add_child(int h, int ptr);
+
+    // A function to write a node from the pending entries of level h
+    int write_node(int h, int first_key, int n);
+
+    // A function to write the last B+ leaf, linking it to next
+    void write_pending(int next);
+};
+
+// An ordered cursor over the keys of a BTree. The cursor keeps the path
+// from the root to its position, so next and prev only touch the pages
+// around it, and no page stays pinned between calls. Siblings of the path
+// that the cursor will visit next are read ahead in the background. On a
+// B+ tree the cursor moves between leaves through their links, and the
+// inner steps of the path only follow along to drive the read ahead.
+// Cursors are invalidated by any change to the tree, and they take no
+// latches, so they must not run along with writers
+class BTreeCursor
+{
+    // A step of the path. On the last step idx is the index of the current
+    // key, on the others it is the index of the child the path goes into
+    struct Step
+    {
+        int ptr;        // Node file pointer
+        int idx;        // Key or child index
+        int ahead;      // Last child read ahead after idx
+        int behind;     // Last child read ahead before idx
+    };
+
+    BTree* tree;                // Tree being walked
+    std::vector<Step> path;     // Path to the current key, empty at the end
+    int current;                // Current key
+    int lo;                     // Lowest key of the range
+    int hi;                     // Highest key of the range
+
+public:
+    BTreeCursor(BTree* _tree);  // Constructor, the range is every key
+
+    // A function to move to the first key greater than or equal to key
+    bool seek(int key);
+
+    // A function to move to the last key lower than or equal to key
+    bool seek_for_prev(int key);
+
+    // Functions to move to the first and the last key of the range
+    bool seek_first();
+    bool seek_last();
+
+    // A function to limit the cursor to the keys in [lo, hi] and move to
+    // the first of them
+    bool range(int _lo, int _hi);
+
+    // A function to check if the cursor is on a key inside the range
+    bool valid();
+
+    // Access to the current key
+    int key();
+
+    // Functions to move to the next and the previous key. Return false
+    // when the cursor leaves the range
+    bool next();
+    bool prev();
+
+    // Functions to copy up to capacity keys into buffer, from the current
+    // key forward or backward, leaving the cursor after the last one.
+    // Return the number of keys copied
+    int next_batch(int* buffer, int capacity);
+    int prev_batch(int* buffer, int capacity);
+
+private:
+    // Functions to go down to the first or last key under ptr
+    bool descend_first(int ptr);
+    bool descend_last(int ptr);
+
+    // Functions to climb from an exhausted node to the ancestor key that
+    // follows or precedes it
+    bool climb_next();
+    bool climb_prev();
+
+    // Functions to move from an exhausted B+ leaf to the next or previous
+    // one in the chain
+    bool next_leaf();
+    bool prev_leaf();
+
+    // Functions to move the inner steps of the path to the next or the
+    // previous leaf
+    void advance_parents();
+    void retreat_parents();
+
+    // A function to read the current key from the last step
+    bool load_current();
+
+    // Functions to read ahead the children of a step that follow or
+    // precede the one the path goes into
+    void read_ahead(Step &step);
+    void read_behind(Step &step);
+};
+
+// Asynchronous searches and inserts on a BTree. An operation first walks
+// down its path reading the missing pages asynchronously, so the reads
+// of many operations are in flight together, then it runs on the pages
+// already in the pool. Reads complete and callbacks run only inside
+// poll, on the thread that calls it, which must be the only one using
+// the tree. Reads only overlap on a tree opened with POSIX_STORAGE or
+// DIRECT_STORAGE, which have a descriptor for io_uring or the reader
+// threads. The default FSTREAM_STORAGE and MMAP_STORAGE get the sync
+// backend, so every read is done when it is queued and the operations
+// run one after the other, as plain calls to insert and find would.
+// backend() returns "sync" then
+class BTreeAsync
+{
+    // An operation walking down its path
+    struct Operation
+    {
+        bool insert;                        // Is true for an insert, false for a search
+        int key;                            // Key searched or inserted
+        int ptr;                            // Next page of the path, -1 at its end
+        std::function<void(int)> done;      // Called with the result
+    };
+
+    BTree* tree;                                                // Tree of the operations
+    AsyncIO* io;                                                // Page reads
+    std::unordered_map<int, std::vector<Operation*>> waiting;   // Operations by page being read
+    int pending;                                                // Operations not completed
+
+public:
+    BTreeAsync(BTree* _tree, int depth = AIO_QUEUE_DEPTH);     // Constructor
+
+    ~BTreeAsync();                  // Destructor, completes every operation
+
+    // Functions to search key. done gets the file pointer of the node
+    // holding key, or -1, like the future
+    void search(int key, std::function<void(int)> done);
+    std::future<int> search(int key);
+
+    // Functions to insert key. done is called, and the future is ready,
+    // once key is in the tree
+    void insert(int key, std::function<void()> done);
+    std::future<void> insert(int key);
+
+    // A function to run the completed reads and the operations waiting on
+    // them. When wait is true it blocks until a read completes. Returns
+    // the number of operations not completed
+    int poll(bool wait = false);
+
+    // A function to run every operation to completion
+    void wait_all();
+
+    // A function that returns the name of the I/O backend
+    const char* backend();
+
+private:
+    // A function to start an operation at the root
+    void start(Operation* op);
+
+    // A function to walk op down while its pages are in the pool. loaded
+    // is true when the page of op was just read
+    void advance(Operation* op, bool loaded);
+
+    // A function that returns the page op goes to after the node x, or
+    // -1 if its path ends at x
+    int route(Operation* op, NodeView &x);
+
+    // A function to read the page of op, shared by every operation that
+    // waits for it
+    void fetch(Operation* op);
+
+    // A function to run op once its path is in the pool
+    void finish(Operation* op);
 };
 
-BTreeNode::BTreeNode(int _t, bool _leaf){
+BTreeNode::BTreeNode(int _t, bool _leaf, int _max_keys){
     this->t = _t;
     this->leaf = _leaf;
     this->n = 0;
-    this->keys = new int [62];
-    this->C = new int [63];
+    this->max_keys = _max_keys;
+    this->keys = new int [_max_keys];
+    this->C = new int [_max_keys+1];
+    memset(this->keys, 0, sizeof(int)*_max_keys);
+    memset(this->C, 0, sizeof(int)*(_max_keys+1));
+}
+
+BTreeNode::~BTreeNode(){
+    delete[] this->keys;
+    delete[] this->C;
 }
 
 // BTreeNode definitions
@@ -132,79 +892,224 @@ bool BTreeNode::is_empty(){
     return (this->n == 0);
 }
 
-void BTreeNode::traverse(){}
+void BTreeNode::traverse(){
+    // Children live on the file, only the keys of this node are printed
+    for (int i = 0; i < this->n; i++)
+        std::cout << " " << this->keys[i];
+}
 
 BTreeNode* BTreeNode::search(int k){
     // Find the first key greater than or equal to k
-    int i = 0;
-    while (i < this->n && k > this->keys[i]) i++;
+    int i = lower_bound_keys(this->keys, this->n, k);
 
     // If the key found is is equal to k, return this node
-    if (keys[i] == k)
+    if (i < this->n && keys[i] == k)
         return this;
 
     // If it isn't, return a null pointer
     return nullptr;
 }
 
-char* BTreeNode::serialize(){
-    char* data = new char[512];
-    int data_idx = 0;
+void BTreeNode::serialize(char* data, int page_keys){
+    NodeView view(data, page_keys);
+
+    // Serializes (t, n, leaf, keys, children), leaves only keep the links
+    view.set_t(this->t);
+    view.set_n(this->n);
+    view.set_leaf(this->leaf);
+    memcpy(view.keys(), this->keys, sizeof(int)*page_keys);
+    memcpy(view.children(), this->C, sizeof(int)*(this->leaf ? 2 : page_keys+1));
+}
 
-    memset(data, 0, 512);
+void BTreeNode::deserialize(char* data, int page_keys){
+    NodeView view(data, page_keys);
 
-    // Serializes (t, n, keys, children, leaf)
-    memcpy(&data[data_idx], &this->t, sizeof(int));
-    data_idx += sizeof(int);
-    memcpy(&data[data_idx], &this->n, sizeof(int));
-    data_idx += sizeof(int);
-    memcpy(&data[data_idx], this->keys, sizeof(int)*62);
-    data_idx += sizeof(int)*62;
-    memcpy(&data[data_idx], this->C, sizeof(int)*63);
-    data_idx += sizeof(int)*63;
-    memcpy(&data[data_idx], &this->leaf, sizeof(bool));
+    // Deserializes (t, n, leaf, keys, children)
+    this->t = view.get_t();
+    this->n = view.get_n();
+    this->leaf = view.is_leaf();
+    memcpy(this->keys, view.keys(), sizeof(int)*page_keys);
+    memcpy(this->C, view.children(), sizeof(int)*(this->leaf ? 2 : page_keys+1));
+}
 
-    return data;
+// NodeView definitions
+int NodeView::find_key(int k){
+    return lower_bound_keys(this->keys(), this->get_n(), k);
 }
 
-void BTreeNode::deserialize(char* data){
-    int data_idx = 0;
+void NodeView::set_value(int i, const char* v){
+    if(v != nullptr)
+        memcpy(this->value(i), v, this->value_size);
+    else
+        memset(this->value(i), 0, this->value_size);
+}
 
-    // Deserializes (t, n, keys, children, leaf)
-    memcpy(&this->t, &data[data_idx], sizeof(int));
-    data_idx += sizeof(int);
-    memcpy(&this->n, &data[data_idx], sizeof(int));
-    data_idx += sizeof(int);
-    memcpy(this->keys, &data[data_idx], sizeof(int)*62);
-    data_idx += sizeof(int)*62;
-    memcpy(this->C, &data[data_idx], sizeof(int)*63);
-    data_idx += sizeof(int)*63;
-    memcpy(&this->leaf, &data[data_idx], sizeof(bool));
+void NodeView::move_values(int to, int from, int count){
+    if(count > 0)
+        memmove(this->value(to), this->value(from), (size_t)this->value_size*count);
 }
 
 // BTree definitions
-BTree::BTree(std::string _fpath){
+BTree::BTree(std::string _fpath, long _cache_size, int _storage, int _hints, bool _logged){
+    this->root = 0;
+    this->t = 0;
+    this->leaf_t = 0;
+    this->layout = BTREE_LAYOUT;
+    this->value_size = 0;
+    this->packed = false;
+    this->node = nullptr;
+    this->node_ptr = -1;
+    this->node_count = 0;
+    this->free_count = 0;
+    this->free_head = -1;
+    this->generation = 0;
     this->fpath = _fpath;
-    this->file = std::fstream(_fpath, std::fstream::in | std::fstream::out | std::fstream::binary);
+    this->storage = make_storage(_storage, _fpath, _hints);
+    this->cache_size = _cache_size;
+    this->pool = nullptr;
+    this->wal = nullptr;
+    this->filter = nullptr;
+    this->sync_commit = true;
+
+    // Operations that reached the log before a crash are finished first
+    if(_logged){
+        this->wal = new WriteAheadLog(_fpath+".wal", WAL_GROUP_DELAY);
+        if(this->storage->is_open() && this->wal->recover(this->storage) > 0 && DEBUG == true)
+            std::cout << "Recovered operations from the log" << std::endl;
+    }
+
+    // The pool and the node cursor follow the page size of the file
+    this->set_page_size(DEFAULT_PAGE_SIZE);
+}
+
+BTree::~BTree(){
+    // The pool writes dirty nodes back, the log is emptied after them
+    this->flush();
+    delete this->pool;
+    delete this->wal;
+    delete this->filter;
+    delete this->storage;
+    delete this->node;
+}
+
+void BTree::flush(){
+    std::unique_lock<std::shared_mutex> tree_lock(this->tree_latch);
+
+    // A filter that lost its precision is built again while the tree is
+    // held, searches read it without latches
+    if(this->filter != nullptr && this->filter->saturated())
+        this->build_filter();
+    this->checkpoint();
+}
+
+void BTree::checkpoint(){
+    if(this->storage->is_open()){
+        this->pool->flush_all();
+
+        // The log is not needed once the file is on disk
+        if(this->wal != nullptr){
+            this->storage->sync();
+            this->wal->reset();
+        }
+
+        // The filter matches the file from here on
+        if(this->filter != nullptr)
+            this->filter->save(this->generation, this->node_count);
+    }
+}
+
+int BTree::new_generation(){
+    static std::random_device source;
+    int id;
+    do
+        id = (int)source();
+    while(id == 0);
+    return id;
+}
+
+void BTree::set_sync_commit(bool _sync_commit){
+    this->sync_commit = _sync_commit;
 }
 
 void BTree::load_info_header(){
-    if(this->file.is_open()){
-        char* buffer = new char[sizeof(int)*2];
+    std::lock_guard<std::recursive_mutex> meta_lock(this->meta_latch);
+    if(this->storage->is_open()){
+        char* buffer = new char[HEADER_SIZE];
 
         if(DEBUG == true){
             std::cout << "Reading info header data" << std::endl;
         }
 
-        this->file.seekg(0, this->file.beg);
-        this->file.read(buffer, sizeof(int)*2);
+        // The header page may only be in the pool
+        this->pool->flush_page(-1);
+        this->storage->read(0, buffer, HEADER_SIZE);
 
-        memcpy(&this->root, buffer, sizeof(int));
+        int _root, _page_size, _layout, _value_size, _packed;
+        memcpy(&_root, buffer, sizeof(int));
+        this->root = _root;
         memcpy(&this->t, &buffer[sizeof(int)], sizeof(int));
+        memcpy(&_page_size, &buffer[sizeof(int)*2], sizeof(int));
+        memcpy(&_layout, &buffer[sizeof(int)*3], sizeof(int));
+        memcpy(&this->free_count, &buffer[sizeof(int)*4], sizeof(int));
+        memcpy(&this->free_head, &buffer[sizeof(int)*5], sizeof(int));
+        memcpy(&_value_size, &buffer[sizeof(int)*6], sizeof(int));
+        memcpy(&_packed, &buffer[sizeof(int)*7], sizeof(int));
+        memcpy(&this->generation, &buffer[sizeof(int)*8], sizeof(int));
+        if(this->free_count <= 0){
+            this->free_count = 0;
+            this->free_head = -1;
+        }
+
+        if(_page_size < MIN_PAGE_SIZE || _page_size > MAX_PAGE_SIZE || (_page_size & (_page_size-1)) != 0){
+            if(DEBUG == true)
+                std::cout << "Invalid page size " << _page_size << std::endl;
+            delete[] buffer;
+            return;
+        }
+
+        // Pages of another size are cached under the wrong geometry
+        if(_page_size != this->page_size){
+            this->set_page_size(_page_size);
+            this->node_count = 0;
+        }
+
+        // Values that leave no room for keys are not usable
+        if(_value_size < 0 || NODE_LEAF_MAX_KEYS(_page_size, _value_size) < NODE_LEAF_MIN_KEYS){
+            if(DEBUG == true)
+                std::cout << "Invalid value size " << _value_size << std::endl;
+            _value_size = 0;
+        }
+        this->value_size = _value_size;
+        this->packed = (_packed == 1);
+        this->set_layout(_layout);
+
+        // Nodes that are still only in the pool are already counted. The
+        // zeroes that end the last one may not be on the storage
+        long size = this->storage->size();
+        int count = size > this->page_size ? (size-1)/this->page_size : 0;
+        if(count > this->node_count)
+            this->node_count = count;
+
+        // A filter left by a crash, or by an older file, is built again
+        if(this->filter == nullptr && BloomFilter::exists(this->fpath+".bloom")){
+            this->filter = new BloomFilter(this->fpath+".bloom");
+            if(!this->filter->load(this->generation, this->node_count)){
+                if(DEBUG == true)
+                    std::cout << "Rebuilding stale key filter" << std::endl;
+                this->build_filter();
+            }
+        }
 
         if(DEBUG == true){
             std::cout << "Root position: " << this->root << std::endl;
             std::cout << "Minimum degree: " << this->t << std::endl;
+            std::cout << "Page size: " << this->page_size << std::endl;
+            std::cout << "Layout: " << (this->layout == BPLUS_LAYOUT ? "B+" : "B") << std::endl;
+            std::cout << "Free pages: " << this->free_count << std::endl;
+            if(this->value_size > 0)
+                std::cout << "Value size: " << this->value_size << std::endl;
+            if(this->packed)
+                std::cout << "Packed leaves" << std::endl;
         }
     
         delete[] buffer;
@@ -212,291 +1117,3029 @@ void BTree::load_info_header(){
 }
 
 void BTree::store_info_header(int _root, int _t){
-    if(this->file.is_open()){
-        char* buffer = new char[sizeof(int)];
+    std::lock_guard<std::recursive_mutex> meta_lock(this->meta_latch);
+    if(this->storage->is_open()){
+        // The header is the page before the first node, so it is logged
+        // with the nodes changed by the same operation
+        char* buffer = this->pool->fetch_page(-1);
+        if(buffer == nullptr)
+            return;
+
         memcpy(buffer, &_root, sizeof(int));
         memcpy( &buffer[sizeof(int)], &_t, sizeof(int));
+        memcpy( &buffer[sizeof(int)*2], &this->page_size, sizeof(int));
+        memcpy( &buffer[sizeof(int)*3], &this->layout, sizeof(int));
+        memcpy( &buffer[sizeof(int)*4], &this->free_count, sizeof(int));
+        memcpy( &buffer[sizeof(int)*5], &this->free_head, sizeof(int));
+        memcpy( &buffer[sizeof(int)*6], &this->value_size, sizeof(int));
+        int _packed = this->packed;
+        memcpy( &buffer[sizeof(int)*7], &_packed, sizeof(int));
+        memcpy( &buffer[sizeof(int)*8], &this->generation, sizeof(int));
  
         if(DEBUG == true)
             std::cout << "Writing info header data" << std::endl;
 
-        this->file.seekp(0, this->file.beg);
-        this->file.write(buffer, sizeof(int)*2);
-
-        delete[] buffer;
+        this->unpin_node(-1, true);
     }
 }
 
-void BTree::init(int _t){
-    if(this->file.is_open()){
+void BTree::init(int _t, int _page_size, int _layout, int _value_size, bool _packed){
+    // The page size must be a power of two inside the limits
+    if(_page_size < MIN_PAGE_SIZE || _page_size > MAX_PAGE_SIZE || (_page_size & (_page_size-1)) != 0){
+        if(DEBUG == true)
+            std::cout << "Invalid page size " << _page_size << std::endl;
+        return;
+    }
+
+    // A leaf must still fit a few keys with their values
+    if(_value_size < 0 || NODE_LEAF_MAX_KEYS(_page_size, _value_size) < NODE_LEAF_MIN_KEYS){
+        if(DEBUG == true)
+            std::cout << "Invalid value size " << _value_size << std::endl;
+        return;
+    }
+
+    std::unique_lock<std::shared_mutex> tree_lock(this->tree_latch);
+
+    // The log of the old file must not be applied to the new one, nor
+    // its filter, even one this tree didn't open
+    if(this->wal != nullptr)
+        this->wal->reset();
+    if(this->filter != nullptr)
+        this->filter->reset(0);
+    else
+        std::remove((this->fpath+".bloom").c_str());
+
+    // (Re)creates the file, so init also works when it does not exist yet
+    this->storage->open(true);
+
+    if(this->storage->is_open()){
+        // Cached pages belong to the old file
+        this->pool->reset();
+        this->op_pages.clear();
+        this->set_page_size(_page_size);
+        this->node_count = 0;
+        this->free_count = 0;
+        this->free_head = -1;
+        this->generation = BTree::new_generation();
+
+        // Derive the fanout from the page size
+        if(_t < 3 || _t > this->max_keys)
+            _t = this->max_keys;
+
         // initializes with root on 0
+        this->root = 0;
+        this->t = _t;
+        this->value_size = _value_size;
+        this->packed = _packed;
+        this->set_layout(_layout);
         this->store_info_header(0, _t);
-       
-        this->node = new BTreeNode(_t, true); 
-        char *root = this->node->serialize();
 
         if(DEBUG == true)
             std::cout << "Initializing BTree root" << std::endl;
 
-        this->file.write(root, 512);
-
-        delete root;
+        NodeView r = this->new_node(true, this->node_ptr);
+        if(r.valid())
+            this->unpin_node(this->node_ptr, true);
+        this->wait_commit(this->commit_operation());
     }
 }
 
-void BTree::load_node(int ptr){
-    if(this->file.is_open()){
-        // Checks size of file
-        this->file.seekg(0, this->file.end);
-        int size = this->file.tellg();
+int BTree::get_page_size(){
+    return this->page_size;
+}
 
-        // Check if pointer is valid on file
-	if((size-sizeof(int)*2)/512 <= (unsigned int)ptr){
-	    this->node_ptr = ptr;
-            char data[512];
+int BTree::get_max_keys(){
+    return this->max_keys;
+}
 
-            if(DEBUG == true)
-                std::cout << "Loading node data from " << sizeof(int)*2+ptr*512 << std::endl;
+int BTree::get_layout(){
+    return this->layout;
+}
 
-            this->file.seekg(sizeof(int)*2+ptr*512, this->file.beg);
-            this->file.read(data, 512);            
+int BTree::get_value_size(){
+    return this->value_size;
+}
 
-            this->node->deserialize(data);
-        }
-    }
+bool BTree::is_packed(){
+    return this->packed;
 }
 
-void BTree::store_node(int ptr, BTreeNode node){
-    if(this->file.is_open()){
-        // Checks size of file
-        this->file.seekg(0, this->file.end);
-        int size = this->file.tellg();
-        // Check if pointer is valid on file
-        if((((size-sizeof(int)*2)/512)-1 >= (unsigned int)ptr)){
-            char* data = node.serialize();
+void BTree::set_page_size(int _page_size){
+    // Cached pages are written back under the old geometry
+    delete this->pool;
+    delete this->node;
 
-            if(DEBUG == true)
-                std::cout << "Storing node data on " << sizeof(int)*2+ptr*512 << std::endl;
+    this->page_size = _page_size;
+    this->max_keys = NODE_MAX_KEYS(_page_size);
+    this->leaf_max_keys = NODE_LEAF_MAX_KEYS(_page_size, this->value_size);
+    if(this->packed)
+        this->leaf_max_keys *= PACKED_LEAF_FACTOR;
 
-            this->file.seekg(sizeof(int)*2+ptr*512, this->file.beg);
-            this->file.write(data, 512);
-        }
-    }
+    // The node cursor must also hold the larger B+ leaves, packed or not
+    this->node = new BTreeNode(this->t, true, NODE_LEAF_MAX_KEYS(_page_size, 0)*PACKED_LEAF_FACTOR);
+
+    // Every page of an operation must fit in the pool until it commits
+    long budget = this->cache_size;
+    if(this->wal != nullptr && budget < (long)WAL_MIN_FRAMES*_page_size)
+        budget = (long)WAL_MIN_FRAMES*_page_size;
+
+    // The header takes the first page
+    this->pool = new BufferPool(this->storage, _page_size, _page_size, budget);
+    this->pool->set_log(this->wal);
 }
 
-int BTree::add_node(BTreeNode node){
-    if(this->file.is_open()){
-        char *data = node.serialize();
+void BTree::set_layout(int _layout){
+    this->layout = (_layout == BPLUS_LAYOUT) ? BPLUS_LAYOUT : BTREE_LAYOUT;
 
-        this->file.seekp(0, this->file.end);
-    
-        int ptr = ((unsigned long)this->file.tellp() - (sizeof(int)*2))/512;
-    
-        this->file.write(data, 512);
-        
-        return ptr;
+    // Only B+ leaves have room for values, and only their keys are packed
+    if(this->layout != BPLUS_LAYOUT){
+        this->value_size = 0;
+        this->packed = false;
+    }
+    this->leaf_max_keys = NODE_LEAF_MAX_KEYS(this->page_size, this->value_size);
+    if(this->packed)
+        this->leaf_max_keys *= PACKED_LEAF_FACTOR;
 
+    // B+ leaves grow in proportion to the room freed by the children, and
+    // shrink with the room taken by the values
+    this->leaf_t = this->t;
+    if(this->layout == BPLUS_LAYOUT && this->max_keys > 0){
+        this->leaf_t = (int)((long)this->t*this->leaf_max_keys/this->max_keys);
+        if(this->leaf_t < NODE_LEAF_MIN_KEYS-1)
+            this->leaf_t = NODE_LEAF_MIN_KEYS-1;
     }
-    return -1;
 }
 
-void BTree::insert(int key){
-    if(this->file.is_open()){
-        if(DEBUG == true)
-            std::cout << "Inserting key " << key << std::endl;
-        // Load root from BTree
-        this->load_node(this->root);
-        // If root node is empty
-        if(this->node->is_empty()){
-            this->node->keys[0] = key;  // Sets node keys
-            this->node->n = 1;          // Updates node key count
-            this->store_node(this->root, *this->node);
+int BTree::page_keys(bool leaf){
+    return (leaf && this->layout == BPLUS_LAYOUT) ? this->leaf_max_keys : this->max_keys;
+}
 
-            if(DEBUG == true)
-                std::cout << "Inserted on empty node" << std::endl;
-        }else{
-            // If root is full, then tree grows in height
-            if(this->node->n == this->t){
-                if(DEBUG == true)
-                    std::cout << "Spliting root node" << std::endl;
+int BTree::capacity(NodeView &x){
+    return x.is_leaf() ? this->leaf_t : this->t;
+}
 
-                // Create new node
-                BTreeNode s(this->t, false);
+bool BTree::is_full(NodeView &x, int key){
+    int n = x.get_n();
+    if(n == this->capacity(x))
+        return true;
+    if(!this->packed || !x.is_leaf() || n == 0)
+        return false;
 
-                // Make old root as child of new root
-                s.C[0] = this->node_ptr;
+    // key can widen the range of the keys, and the distances to the keys
+    // around it, which are never wider than the one they replace
+    const int* keys = x.keys();
+    int i = upper_bound_keys(keys, n, key);
+    int width = delta_width(keys, n);
+    if(i > 0)
+        width = std::max(width, pack_width((uint32_t)key-(uint32_t)keys[i-1]));
+    if(i < n)
+        width = std::max(width, pack_width((uint32_t)keys[i]-(uint32_t)key));
+    int first = std::min(keys[0], key);
+    int last = std::max(keys[n-1], key);
+    return this->packed_size(n+1, first, last, width) > this->page_size;
+}
 
-                // Split the old root and move 1 key to the new root
-                this->splitChild(0, this->node, &s);
+int BTree::scratch_size(){
+    return NODE_KEYS_OFFSET+sizeof(int)*(this->leaf_max_keys+2)+(size_t)this->value_size*this->leaf_max_keys;
+}
 
-                this->store_node(this->node_ptr, *this->node);
-                // New root has two children now. Decide which of the
-                // two children is going to have new key
-                int i = 0;
-                if(s.keys[0] < key)
-                    i++;
+long BTree::node_offset(int ptr){
+    return (long)(ptr+1)*this->page_size;
+}
 
-                this->load_node(s.C[i]);
-                this->insertNonFull(key);
+void BTree::load_node(int ptr){
+    if(this->storage->is_open()){
+        std::shared_lock<std::shared_mutex> tree_lock(this->tree_latch);
+        LatchScope scope(this->latches, this->latch_set(), LATCH_SHARED);
+        NodeView view = this->pin_node(ptr);
 
-                // Add new node to secondary memory
-                int ptr = this->add_node(s);
+        if(view.valid()){
+            this->node_ptr = ptr;
 
-                if(DEBUG == true)
+            if(DEBUG == true)
+                std::cout << "Loading node data from " << this->node_offset(ptr) << std::endl;
+
+            this->node->deserialize(view.page(), this->page_keys(view.is_leaf()));
+            this->unpin_node(ptr, false);
+        }
+    }
+}
+
+bool BTree::store_node(int ptr, BTreeNode &node){
+    if(this->storage->is_open()){
+        if(!this->node_fits(node))
+            return false;
+
+        std::unique_lock<std::shared_mutex> tree_lock(this->tree_latch);
+        NodeView view = this->pin_node(ptr);
+
+        if(view.valid()){
+            if(DEBUG == true)
+                std::cout << "Storing node data on " << this->node_offset(ptr) << std::endl;
+
+            node.serialize(view.page(), this->page_keys(view.is_leaf()));
+            if(this->filter != nullptr)
+                for(int i = 0; i < view.get_n(); i++)
+                    this->filter->add(view.key(i));
+            this->unpin_node(ptr, true);
+            this->wait_commit(this->commit_operation());
+            return true;
+        }
+    }
+    return false;
+}
+
+int BTree::add_node(BTreeNode &node){
+    if(this->storage->is_open()){
+        if(!this->node_fits(node))
+            return -1;
+
+        std::unique_lock<std::shared_mutex> tree_lock(this->tree_latch);
+        int ptr;
+        NodeView view = this->new_node(node.leaf, ptr);
+
+        if(!view.valid())
+            return -1;
+
+        node.serialize(view.page(), this->page_keys(node.leaf));
+        if(this->filter != nullptr)
+            for(int i = 0; i < view.get_n(); i++)
+                this->filter->add(view.key(i));
+        this->unpin_node(ptr, true);
+        this->wait_commit(this->commit_operation());
+
+        return ptr;
+    }
+    return -1;
+}
+
+NodeView BTree::pin_node(int ptr, bool decode){
+    // Check if pointer is valid on file
+    if(ptr < 0 || ptr >= this->node_count)
+        return NodeView();
+
+    // The page is latched before its contents are looked at
+    LatchSet &set = this->latch_set();
+    this->latches.lock(set, ptr);
+
+    // The geometry of the page depends on its kind
+    NodeView view(this->pool->fetch_page(ptr), this->max_keys);
+    if(!view.valid())
+        this->latches.unlock(set, ptr);
+
+    // Packed leaves are used decoded, unless they are only searched
+    if(view.valid() && this->packed && decode){
+        NodeView leaf = this->decode_node(ptr, view);
+        if(leaf.valid())
+            return leaf;
+    }
+    if(view.valid() && view.is_leaf() && this->layout == BPLUS_LAYOUT && !this->packed)
+        return NodeView(view.page(), this->leaf_max_keys, this->value_size);
+    return view;
+}
+
+void BTree::unpin_node(int ptr, bool dirty){
+    // A packed leaf reaches its page with the last pin of the thread
+    if(this->packed)
+        dirty = this->encode_node(ptr, dirty);
+
+    // The first change keeps the pin, so the page can't be written back
+    // before its log record. Logged writers take turns, so the latch can
+    // go already
+    if(dirty && this->wal != nullptr &&
+       std::find(this->op_pages.begin(), this->op_pages.end(), ptr) == this->op_pages.end()){
+        this->op_pages.push_back(ptr);
+    }else{
+        this->pool->unpin_page(ptr, dirty);
+    }
+    this->latches.unlock(this->latch_set(), ptr);
+}
+
+LatchSet& BTree::latch_set(){
+    // Sets are left empty by every operation, so a set of a destroyed
+    // tree can be taken over by a new one
+    static thread_local std::unordered_map<BTree*, LatchSet> sets;
+    return sets[this];
+}
+
+ScratchSet& BTree::scratch_set(){
+    // Like latch sets, only the spare buffers outlive an operation
+    static thread_local std::unordered_map<BTree*, ScratchSet> sets;
+    return sets[this];
+}
+
+NodeView BTree::decode_node(int ptr, NodeView raw, bool fresh){
+    ScratchSet &set = this->scratch_set();
+    auto it = set.leaves.find(ptr);
+
+    // A leaf the thread already holds is shared by its pins, even after
+    // it stops being a leaf on its way to the free list
+    if(it == set.leaves.end()){
+        if(!fresh && !raw.is_leaf())
+            return NodeView();
+
+        it = set.leaves.emplace(ptr, ScratchSet::Leaf()).first;
+        ScratchSet::Leaf &leaf = it->second;
+        if(!set.spare.empty()){
+            leaf.data.swap(set.spare.back());
+            set.spare.pop_back();
+        }
+        leaf.data.resize(this->scratch_size());
+        leaf.page = raw.page();
+        leaf.pins = 0;
+        leaf.dirty = fresh;
+
+        NodeView x(leaf.data.data(), this->leaf_max_keys, this->value_size);
+        if(fresh)
+            memset(leaf.data.data(), 0, leaf.data.size());
+        else
+            this->unpack_leaf(leaf.page, x);
+    }
+
+    it->second.pins++;
+    return NodeView(it->second.data.data(), this->leaf_max_keys, this->value_size);
+}
+
+bool BTree::encode_node(int ptr, bool dirty){
+    ScratchSet &set = this->scratch_set();
+    auto it = set.leaves.find(ptr);
+    if(it == set.leaves.end())
+        return dirty;
+
+    ScratchSet::Leaf &leaf = it->second;
+    leaf.dirty = leaf.dirty || dirty;
+    if(--leaf.pins > 0)
+        return dirty;
+
+    // A freed leaf keeps the free page fields, which are the same on
+    // both layouts
+    bool changed = leaf.dirty;
+    if(changed){
+        NodeView x(leaf.data.data(), this->leaf_max_keys, this->value_size);
+        if(x.is_leaf())
+            this->pack_leaf(x, leaf.page);
+        else
+            memcpy(leaf.page, leaf.data.data(), this->page_size);
+    }
+
+    set.spare.push_back(std::move(leaf.data));
+    set.leaves.erase(it);
+    return changed;
+}
+
+void BTree::pack_leaf(NodeView &x, char* page){
+    int n = x.get_n();
+    const int* keys = x.keys();
+
+    PackedHeader h;
+    h.prev = x.get_prev();
+    h.next = x.get_next();
+    h.base = n > 0 ? keys[0] : 0;
+
+    // The smaller encoding is kept, the frame of reference on a tie
+    int offsets = n > 0 ? pack_width((uint32_t)keys[n-1]-(uint32_t)keys[0]) : 0;
+    int distances = delta_width(keys, n);
+    int bytes;
+    char* data = &page[PACKED_DATA_OFFSET];
+    memset(page, 0, this->page_size);
+    if(packed_bytes(n, offsets) <= delta_bytes(n, distances)){
+        h.encoding = PACK_FOR;
+        h.width = offsets;
+        bytes = packed_bytes(n, offsets);
+        pack_for(keys, n, offsets, data);
+    }else{
+        h.encoding = PACK_DELTA;
+        h.width = distances;
+        bytes = delta_bytes(n, distances);
+        pack_delta(keys, n, distances, data);
+    }
+
+    memcpy(page, x.page(), NODE_KEYS_OFFSET);
+    memcpy(&page[NODE_KEYS_OFFSET], &h, sizeof(PackedHeader));
+    if(this->value_size > 0)
+        memcpy(&data[bytes], x.value(0), (size_t)this->value_size*n);
+}
+
+void BTree::unpack_leaf(char* page, NodeView &x){
+    PackedHeader h;
+    memcpy(&h, &page[NODE_KEYS_OFFSET], sizeof(PackedHeader));
+    memcpy(x.page(), page, NODE_KEYS_OFFSET);
+    x.set_prev(h.prev);
+    x.set_next(h.next);
+
+    int n = x.get_n();
+    int bytes;
+    const char* data = &page[PACKED_DATA_OFFSET];
+    if(h.encoding == PACK_DELTA){
+        bytes = delta_bytes(n, h.width);
+        unpack_delta(data, n, h.width, x.keys());
+    }else{
+        bytes = packed_bytes(n, h.width);
+        unpack_for(data, n, h.width, h.base, x.keys());
+    }
+    if(this->value_size > 0)
+        memcpy(x.value(0), &data[bytes], (size_t)this->value_size*n);
+}
+
+int BTree::packed_size(int n, int first, int last, int width){
+    if(n == 0)
+        return PACKED_DATA_OFFSET;
+    int bytes = std::min(for_bytes(n, first, last), delta_bytes(n, width));
+    return PACKED_DATA_OFFSET+bytes+this->value_size*n;
+}
+
+int BTree::packed_fit(const int* keys, int n){
+    int cap = std::min(n, this->leaf_t);
+    int width = 0;
+    for(int c = 1; c <= cap; c++){
+        if(c > 1)
+            width = std::max(width, pack_width((uint32_t)keys[c-1]-(uint32_t)keys[c-2]));
+        if(this->packed_size(c, keys[0], keys[c-1], width) > this->page_size)
+            return c-1;
+    }
+    return cap;
+}
+
+bool BTree::packed_fits(const int* keys, int n){
+    if(n == 0)
+        return true;
+    return this->packed_size(n, keys[0], keys[n-1], delta_width(keys, n)) <= this->page_size;
+}
+
+bool BTree::node_fits(BTreeNode &node){
+    if(!this->packed || !node.leaf)
+        return true;
+    if(node.n <= this->leaf_t && this->packed_fits(node.keys, node.n))
+        return true;
+
+    if(DEBUG == true)
+        std::cout << "Packed leaf of " << node.n << " keys doesn't fit its page" << std::endl;
+    return false;
+}
+
+int BTree::packed_split(NodeView &y, int key, bool &key_first){
+    int n = y.get_n();
+    const int* keys = y.keys();
+    int pos = upper_bound_keys(keys, n, key);
+
+    // The keys of y with key, and the widest distance of every prefix
+    // and suffix of them
+    std::vector<int> all(keys, keys+pos);
+    all.push_back(key);
+    all.insert(all.end(), keys+pos, keys+n);
+    std::vector<int> left(n+2, 0);
+    std::vector<int> right(n+2, 0);
+    for(int c = 2; c <= n+1; c++)
+        left[c] = std::max(left[c-1], pack_width((uint32_t)all[c-1]-(uint32_t)all[c-2]));
+    for(int c = n-1; c >= 0; c--)
+        right[c] = std::max(right[c+1], pack_width((uint32_t)all[c+1]-(uint32_t)all[c]));
+
+    // The new leaf starts at all[s]. The largest half is kept smallest,
+    // and the halves closest in keys on a tie. Equal keys stay together
+    // when they can, inserts route them to the right of the separator
+    int best = 1;
+    int best_size = INT_MAX;
+    for(int s = 1; s <= n; s++){
+        if(all[s-1] == all[s])
+            continue;
+        int size = std::max(this->packed_size(s, all[0], all[s-1], left[s]),
+                            this->packed_size(n+1-s, all[s], all[n], right[s]));
+        if(size < best_size || (size == best_size && std::abs(2*s-n-1) < std::abs(2*best-n-1))){
+            best = s;
+            best_size = size;
+        }
+    }
+
+    key_first = (best == pos);
+    return best <= pos ? best : best-1;
+}
+
+int BTree::node_find(NodeView &x, int key){
+    if(!this->packed || !x.is_leaf())
+        return x.find_key(key);
+
+    // Offsets from the first key are bisected in place, distances are
+    // decoded one block at a time
+    PackedHeader h;
+    memcpy(&h, &x.page()[NODE_KEYS_OFFSET], sizeof(PackedHeader));
+    const char* data = &x.page()[PACKED_DATA_OFFSET];
+    if(h.encoding == PACK_DELTA)
+        return delta_lower_bound(data, x.get_n(), h.width, key);
+    return for_lower_bound(data, x.get_n(), h.width, h.base, key);
+}
+
+int BTree::node_key(NodeView &x, int i){
+    if(!this->packed || !x.is_leaf())
+        return x.key(i);
+
+    PackedHeader h;
+    memcpy(&h, &x.page()[NODE_KEYS_OFFSET], sizeof(PackedHeader));
+    const char* data = &x.page()[PACKED_DATA_OFFSET];
+    if(h.encoding != PACK_DELTA)
+        return (int)((uint32_t)h.base+unpack_number(data, i, h.width));
+
+    int block[PACK_BLOCK_KEYS];
+    unpack_delta_block(data, x.get_n(), h.width, i/PACK_BLOCK_KEYS, block);
+    return block[i%PACK_BLOCK_KEYS];
+}
+
+int BTree::node_next(NodeView &x){
+    if(!this->packed || !x.is_leaf())
+        return x.get_next();
+
+    PackedHeader h;
+    memcpy(&h, &x.page()[NODE_KEYS_OFFSET], sizeof(PackedHeader));
+    return h.next;
+}
+
+long BTree::commit_operation(){
+    if(this->wal == nullptr || this->op_pages.empty())
+        return 0;
+
+    // Log the final image of every page the operation changed
+    for(int page : this->op_pages){
+        char* data = this->pool->fetch_page(page);
+        this->wal->add(this->op_records, this->node_offset(page), data, this->page_size);
+        this->pool->unpin_page(page, false);
+    }
+    long lsn = this->wal->commit(this->op_records);
+
+    for(int page : this->op_pages){
+        this->pool->set_lsn(page, lsn);
+        this->pool->unpin_page(page, true);
+    }
+    this->op_pages.clear();
+
+    // Bound the log, and the time to recover it
+    if(this->wal->size() > WAL_CHECKPOINT_SIZE)
+        this->checkpoint();
+    return lsn;
+}
+
+void BTree::wait_commit(long lsn){
+    if(this->wal != nullptr && this->sync_commit && lsn > 0)
+        this->wal->sync(lsn);
+}
+
+NodeView BTree::new_node(bool leaf, int &ptr){
+    {
+        std::lock_guard<std::recursive_mutex> meta_lock(this->meta_latch);
+        ptr = this->node_count;
+
+        // Free pages are reused before the file grows. Nobody else can
+        // reach a free page, so it isn't latched
+        bool reused = false;
+        if(this->free_count > 0){
+            char* f = this->pool->fetch_page(this->free_head);
+            if(f != nullptr){
+                ptr = this->free_head;
+                reused = true;
+                this->free_head = NodeView(f, this->max_keys).key(0);
+                this->free_count--;
+                this->pool->unpin_page(ptr, false);
+            }
+        }
+
+        if(reused)
+            this->store_info_header(this->root, this->t);
+        else
+            this->node_count++;
+    }
+
+    // Nobody else can reach the page yet, the latch is free
+    LatchSet &set = this->latch_set();
+    this->latches.lock(set, ptr);
+    bool plus = (leaf && this->layout == BPLUS_LAYOUT);
+    NodeView view(this->pool->new_page(ptr), this->page_keys(leaf), plus ? this->value_size : 0);
+    if(!view.valid()){
+        this->latches.unlock(set, ptr);
+        return view;
+    }
+
+    // A packed leaf is built decoded
+    if(plus && this->packed)
+        view = this->decode_node(ptr, view, true);
+
+    view.set_t(this->t);
+    view.set_leaf(leaf);
+    if(leaf && this->layout == BPLUS_LAYOUT){
+        view.set_prev(-1);
+        view.set_next(-1);
+    }
+
+    // A new page is changed even if its user releases it clean
+    if(this->wal != nullptr &&
+       std::find(this->op_pages.begin(), this->op_pages.end(), ptr) == this->op_pages.end()){
+        this->pool->fetch_page(ptr);
+        this->op_pages.push_back(ptr);
+    }
+
+    return view;
+}
+
+void BTree::free_node(int ptr){
+    std::lock_guard<std::recursive_mutex> meta_lock(this->meta_latch);
+    NodeView x = this->pin_node(ptr);
+    if(!x.valid())
+        return;
+
+    x.set_n(FREE_PAGE_MARK);
+    x.set_leaf(false);
+    x.set_key(0, this->free_head);
+    this->unpin_node(ptr, true);
+
+    this->free_head = ptr;
+    this->free_count++;
+    this->store_info_header(this->root, this->t);
+}
+
+void BTree::insert(int key){
+    this->insert(key, nullptr, nullptr);
+}
+
+template <typename Value>
+bool BTree::get(int key, Value &value){
+    static_assert(std::is_trivially_copyable<Value>::value, "values are copied to and from pages");
+    if(this->value_size == 0 || sizeof(Value) != (size_t)this->value_size)
+        return false;
+    return this->find(key, nullptr, (char*)&value) != -1;
+}
+
+template <typename Value>
+bool BTree::put(int key, const Value &value){
+    return this->upsert(key, value, [&value](Value &old){ old = value; });
+}
+
+template <typename Value, typename Update>
+bool BTree::upsert(int key, const Value &value, Update update){
+    static_assert(std::is_trivially_copyable<Value>::value, "values are copied to and from pages");
+    if(this->value_size == 0 || sizeof(Value) != (size_t)this->value_size)
+        return false;
+
+    // The value is changed on a copy and stored back on the page
+    std::function<void(char*)> change = [&update](char* data){
+        Value old;
+        memcpy(&old, data, sizeof(Value));
+        update(old);
+        memcpy(data, &old, sizeof(Value));
+    };
+    return this->insert(key, (const char*)&value, &change);
+}
+
+bool BTree::insert(int key, const char* value, const std::function<void(char*)>* update){
+    bool added = true;
+    if(this->storage->is_open()){
+        if(DEBUG == true)
+            std::cout << "Inserting key " << key << std::endl;
+
+        // Logged inserts take turns until their records are in the log
+        std::shared_lock<std::shared_mutex> tree_lock(this->tree_latch);
+        std::unique_lock<std::mutex> writer_lock(this->writer_latch, std::defer_lock);
+        if(this->wal != nullptr)
+            writer_lock.lock();
+        LatchScope scope(this->latches, this->latch_set(), LATCH_EXCLUSIVE);
+
+        // The key is on the filter before any search can find it
+        if(this->filter != nullptr)
+            this->filter->add(key);
+
+        // Pin root from BTree. The root can only change while it is full,
+        // so other operations may start as soon as it isn't
+        std::unique_lock<std::shared_mutex> root_lock(this->root_latch);
+        int root_ptr = this->root;
+        NodeView r = this->pin_node(root_ptr);
+        if(!r.valid())
+            return false;
+
+        // If root node is empty
+        if(r.get_n() == 0){
+            r.set_key(0, key);  // Sets node keys
+            r.set_value(0, value);
+            r.set_n(1);         // Updates node key count
+            this->unpin_node(root_ptr, true);
+
+            if(DEBUG == true)
+                std::cout << "Inserted on empty node" << std::endl;
+        }else{
+            // If root is full, then tree grows in height
+            if(this->is_full(r, key)){
+                if(DEBUG == true)
+                    std::cout << "Spliting root node" << std::endl;
+
+                // Create new node
+                int ptr;
+                NodeView s = this->new_node(false, ptr);
+                if(!s.valid()){
+                    this->unpin_node(root_ptr, false);
+                    return false;
+                }
+
+                // Make old root as child of new root
+                s.set_child(0, root_ptr);
+
+                // Split the old root and move 1 key to the new root
+                this->splitChild(0, s, r, key);
+                this->unpin_node(root_ptr, true);
+
+                if(DEBUG == true)
                     std::cout << "New root pointer is " << ptr << std::endl;
 
                 // Change root
                 this->root = ptr;
 
                 this->store_info_header(this->root, this->t);
+                root_lock.unlock();
+
+                // New root has two children now, insertNonFull decides
+                // which of the two is going to have the new key
+                added = this->insertNonFull(ptr, s, key, value, update);
             }else{
-                this->insertNonFull(key);
+                root_lock.unlock();
+                added = this->insertNonFull(root_ptr, r, key, value, update);
             }
         }
+
+        // Every page changed by the insert reaches the file together. The
+        // sync is shared with the inserts that commit meanwhile
+        long lsn = this->commit_operation();
+        if(writer_lock.owns_lock())
+            writer_lock.unlock();
+        this->wait_commit(lsn);
     }
+    return added;
 }
 
-void BTree::insertNonFull(int key){
-    // Initialize index as index of rightmost element
-    int i = this->node->n-1;
+bool BTree::insertNonFull(int ptr, NodeView x, int key, const char* value,
+                          const std::function<void(char*)>* update){
+    bool dirty = false;
 
-    // If this is a leaf node
-    if (this->node->leaf == true)
-    {
-        // The following loop does two things
-        // a) Finds the location of new key to be inserted
-        // b) Moves all greater keys to one place ahead
-        while (i >= 0 && this->node->keys[i] > key)
-        {
-            this->node->keys[i+1] = this->node->keys[i];
-            i--;
-        }
-        
-        // Insert the new key at found location
-        this->node->keys[i+1] = key;
-        this->node->n = this->node->n+1;
-
-        this->store_node(this->node_ptr, *this->node);
-    }
-    else // If this node is not leaf
+    // Walk down from x, splitting full children before entering them
+    while (x.is_leaf() == false)
     {
-        BTreeNode *node_aux = new BTreeNode(0, 0);
-        int node_ptr_aux = this->node_ptr;
+        // Find the child which is going to have the new key, i is the
+        // index of the rightmost key lower or equal to key
+        int i = upper_bound_keys(x.keys(), x.get_n(), key)-1;
 
-        // There was a bug that I couldn't solve, so here is an ugly solution
-        char* data = this->node->serialize();
-        node_aux->deserialize(data);
+        if(DEBUG == true)
+            std::cout << "Descending to child " << i+1 << " for key " << key << std::endl;
 
-        // Find the child which is going to have the new key
-        while (i >= 0 && this->node->keys[i] > key){
-            if(DEBUG == true)
-                std::cout << i << " Key comparison x > y " << this->node->keys[i] << " " << key << std::endl;
-            i--;
+        int next_ptr = x.child(i+1);
+        NodeView y = this->pin_node(next_ptr);
+        if(!y.valid()){
+            this->unpin_node(ptr, dirty);
+            return false;
         }
 
-        int next_node = node_aux->C[i+1];
-        
-        this->load_node(next_node); 
-
         // See if the found child is full
-        if (this->node->n == this->t){
+        bool child_dirty = false;
+        if (this->is_full(y, key)){
             if(DEBUG == true)
-                std::cout << "Spliting leaf node with pointer " << this->node_ptr << std::endl;            
-
-            std::cout << this->node->keys[0] << std::endl;
+                std::cout << "Spliting leaf node with pointer " << next_ptr << std::endl;
 
             // If the child is full, then split it
-            this->splitChild(i+1, this->node, node_aux);
+            this->splitChild(i+1, x, y, key);
+            dirty = true;
+            child_dirty = true;
 
             // After split, the middle key of C[i] goes up and
             // C[i] is splitted into two.  See which of the two
-            // is going to have the new key
-            std::cout << node_aux->keys[i+1] << " " << key << std::endl;
-            if (node_aux->keys[i+1] < key)
-                i++;
+            // is going to have the new key. A B+ separator is the
+            // first key of the right node, so equal keys go right
+            int separator = x.key(i+1);
+            if (separator < key || (separator == key && this->layout == BPLUS_LAYOUT)){
+                this->unpin_node(next_ptr, true);
 
-            this->store_node(node_ptr_aux, *node_aux);
+                next_ptr = x.child(i+2);
+                y = this->pin_node(next_ptr);
+                if(!y.valid()){
+                    this->unpin_node(ptr, dirty);
+                    return false;
+                }
+            }
         }
 
-        this->store_node(this->node_ptr, *this->node);
-
-        this->load_node(node_aux->C[i+1]);
+        this->unpin_node(ptr, dirty);
+        ptr = next_ptr;
+        x = y;
+        dirty = child_dirty;
+    }
 
-        this->insertNonFull(key);
+    // x is a leaf. A key already there only has its value changed
+    int n = x.get_n();
+    if(update != nullptr){
+        int j = x.find_key(key);
+        if(j < n && x.key(j) == key){
+            (*update)(x.value(j));
+            this->unpin_node(ptr, true);
+            return false;
+        }
     }
 
+    // Find the location of new key to be inserted and move all greater
+    // keys, and their values, to one place ahead
+    int i = upper_bound_keys(x.keys(), n, key);
+    memmove(&x.keys()[i+1], &x.keys()[i], sizeof(int)*(n-i));
+    x.move_values(i+1, i, n-i);
+
+    // Insert the new key at found location
+    x.set_key(i, key);
+    x.set_value(i, value);
+    x.set_n(n+1);
+
+    this->unpin_node(ptr, true);
+    return true;
 }
 
-void BTree::splitChild(int i, BTreeNode *y, BTreeNode *p)
+void BTree::splitChild(int i, NodeView p, NodeView y, int key)
 {
-    // Create a new node which is going to store (t-1) keys
-    // of y
-    BTreeNode z = BTreeNode(y->t, y->leaf);
-    z.n = this->t/2;
+    // B+ leaves keep every key
+    if (y.is_leaf() && this->layout == BPLUS_LAYOUT){
+        this->splitLeaf(i, p, y, key);
+        return;
+    }
 
-    // Copy the last (t-1) keys of y to z
-    for (int j = 0; j < this->t/2; j++)
-        z.keys[j] = y->keys[j+t-t/2];
+    // Create a new node which is going to store t/2 keys of y
+    int ptr;
+    NodeView z = this->new_node(y.is_leaf(), ptr);
+    if(!z.valid())
+        return;
+    z.set_n(this->t/2);
 
-    // Copy the last t children of y to z
-    if (y->leaf == false)
-    {
-        for (int j = 0; j < t/2+1; j++)
-            z.C[j] = y->C[j+t-t/2];
-    }
+    // Copy the last t/2 keys of y to z
+    memcpy(z.keys(), &y.keys()[t-t/2], sizeof(int)*(t/2));
+
+    // Copy the last t/2+1 children of y to z
+    if (y.is_leaf() == false)
+        memcpy(z.children(), &y.children()[t-t/2], sizeof(int)*(t/2+1));
 
     // Reduce the number of keys in y
-    y->n = t-t/2-1;
+    y.set_n(t-t/2-1);
 
     // Since this node is going to have a new child,
     // create space of new child
-    for (int j = p->n; j >= i+1; j--)
-        p->C[j+1] = p->C[j];
-
-    int ptr = this->add_node(z);
+    int n = p.get_n();
+    memmove(&p.children()[i+2], &p.children()[i+1], sizeof(int)*(n-i));
 
     // Link the new child to this node
-    p->C[i+1] = ptr;
+    p.set_child(i+1, ptr);
 
     // A key of y will move to this node. Find location of
     // new key and move all greater keys one space ahead
-    for (int j = p->n-1; j >= i; j--)
-        p->keys[j+1] = p->keys[j];
+    memmove(&p.keys()[i+1], &p.keys()[i], sizeof(int)*(n-i));
 
     // Copy the middle key of y to this node
-    p->keys[i] = y->keys[t-t/2-1];
+    p.set_key(i, y.key(t-t/2-1));
 
     // Increment count of keys in this node
-    p->n = p->n + 1;
+    p.set_n(n+1);
+
+    this->unpin_node(ptr, true);
 }
 
-BTreeNode* BTree::search(int key){
-    if(this->file.is_open()){
-	// If a node is already is loaded, save it so it's not lost
-	BTreeNode* result = nullptr;
-	// Load the root and check if it is empty
-	this->load_node(this->root);
-	// If the root is not empty, begin search
-	if(!this->node->is_empty()){
-            result = this->node->search(key);
-	    // If the result is a null pointer, load a new node until a leaf is reached
-            while (!this->node->leaf && result == nullptr){
-	        int i = 0;
-		while (i < this->node->n && key > this->node->keys[i]) i++;
-		    // Load the appropriate child node 
-		    this->load_node(this->node->C[i]);
-
-		    // Try searching again
-		    result = this->node->search(key);
-	    }
-	}
-	if(DEBUG ){
-		if (result != nullptr)
-			std::cout << "Found key " << key << std::endl;
-		else
-			std::cout << "Key " << key << " was not found" << std::endl;
-	}
-	return result;
+void BTree::splitLeaf(int i, NodeView p, NodeView y, int key)
+{
+    int lt = this->leaf_t;
+    int y_ptr = p.child(i);
+    int n = y.get_n();
+
+    // y keeps its first m keys. A packed leaf splits where both halves
+    // take the least room with key, which may start the new leaf alone
+    int m = lt-lt/2;
+    bool key_first = false;
+    if(this->packed)
+        m = this->packed_split(y, key, key_first);
+
+    // Create a new leaf which is going to store the last keys of y
+    int ptr;
+    NodeView z = this->new_node(true, ptr);
+    if(!z.valid())
+        return;
+    z.set_n(n-m);
+    memcpy(z.keys(), &y.keys()[m], sizeof(int)*(n-m));
+    memcpy(z.value(0), y.value(m), (size_t)this->value_size*(n-m));
+    y.set_n(m);
+
+    // Link z between y and its old next leaf
+    int next_ptr = y.get_next();
+    z.set_prev(y_ptr);
+    z.set_next(next_ptr);
+    y.set_next(ptr);
+    if(next_ptr != -1){
+        NodeView w = this->pin_node(next_ptr);
+        if(w.valid()){
+            w.set_prev(ptr);
+            this->unpin_node(next_ptr, true);
+        }
     }
-    return nullptr;
+
+    // Link z to p after y, with its first key as separator
+    int pn = p.get_n();
+    memmove(&p.children()[i+2], &p.children()[i+1], sizeof(int)*(pn-i));
+    p.set_child(i+1, ptr);
+    memmove(&p.keys()[i+1], &p.keys()[i], sizeof(int)*(pn-i));
+    p.set_key(i, key_first ? key : z.key(0));
+    p.set_n(pn+1);
+
+    this->unpin_node(ptr, true);
+}
+
+void BTree::insert_batch(const int* keys, int count){
+    if(!this->storage->is_open() || count <= 0)
+        return;
+
+    if(DEBUG == true)
+        std::cout << "Inserting batch of " << count << " keys" << std::endl;
+
+    std::vector<int> sorted(keys, keys+count);
+    std::sort(sorted.begin(), sorted.end());
+
+    // Nodes are rebuilt on the way back up, so the batch takes the tree
+    std::unique_lock<std::shared_mutex> tree_lock(this->tree_latch);
+    if(this->filter != nullptr)
+        for(int key : sorted)
+            this->filter->add(key);
+
+    // The pages changed by a logged operation stay pinned until it
+    // commits, so a logged batch commits in chunks that fit in the pool.
+    // A key changes at most its path, one new leaf and one new inner node
+    long chunk = count;
+    if(this->wal != nullptr && this->pool->get_capacity() > 0){
+        int height = 0;
+        int ptr = this->root;
+        NodeView x = this->pin_node(ptr);
+        while(x.valid() && !x.is_leaf()){
+            int next_ptr = x.child(0);
+            this->unpin_node(ptr, false);
+            ptr = next_ptr;
+            x = this->pin_node(ptr);
+            height++;
+        }
+        if(x.valid())
+            this->unpin_node(ptr, false);
+
+        chunk = (this->pool->get_capacity()-BufferPool::MIN_FRAMES)/(height+3);
+        if(chunk < 1)
+            chunk = 1;
+    }
+
+    for(long done = 0; done < count; done += chunk){
+        const int* first = sorted.data()+done;
+        const int* last = sorted.data()+std::min((long)count, done+chunk);
+
+        std::vector<std::pair<int, int>> split;
+        this->insertSorted(this->root, first, last, split);
+        this->growRoot(split);
+
+        this->wait_commit(this->commit_operation());
+    }
+}
+
+void BTree::insert_batch(const std::vector<int> &keys){
+    this->insert_batch(keys.data(), keys.size());
+}
+
+void BTree::insertSorted(int ptr, const int* first, const int* last,
+                         std::vector<std::pair<int, int>> &split){
+    NodeView x = this->pin_node(ptr);
+    if(!x.valid())
+        return;
+
+    int n = x.get_n();
+    bool leaf = x.is_leaf();
+    std::vector<int> keys(x.keys(), x.keys()+n);
+    std::vector<int> children;
+    std::vector<char> values;
+    if(!leaf)
+        children.assign(x.children(), x.children()+n+1);
+    else
+        values.assign(x.value(0), x.value(n));
+    this->unpin_node(ptr, false);
+
+    // A leaf takes its keys all at once, after the equal keys it has.
+    // The new keys come with zeroed values
+    if(leaf){
+        int size = this->value_size;
+        std::vector<int> merged;
+        std::vector<char> merged_values;
+        merged.reserve(n+(last-first));
+        merged_values.reserve((size_t)size*(n+(last-first)));
+        int a = 0;
+        while(a < n || first != last){
+            if(first == last || (a < n && keys[a] <= *first)){
+                merged.push_back(keys[a]);
+                merged_values.insert(merged_values.end(), values.begin()+(size_t)size*a,
+                                     values.begin()+(size_t)size*(a+1));
+                a++;
+            }else{
+                merged.push_back(*first++);
+                merged_values.insert(merged_values.end(), size, 0);
+            }
+        }
+        this->storeNodes(ptr, true, merged, children, merged_values, split);
+        return;
+    }
+
+    // Partition the keys by child the way insert routes them: a key goes
+    // to the right of every separator lower or equal to it
+    std::vector<const int*> bounds(n+2);
+    bounds[0] = first;
+    for(int i = 0; i < n; i++)
+        bounds[i+1] = std::lower_bound(bounds[i], last, keys[i]);
+    bounds[n+1] = last;
+
+    std::vector<int> targets;
+    for(int i = 0; i <= n; i++)
+        if(bounds[i] != bounds[i+1])
+            targets.push_back(children[i]);
+    this->pool->prefetch(targets);
+
+    // Insert in every child, and link the nodes each child grows by
+    // right after it
+    std::vector<int> new_keys;
+    std::vector<int> new_children;
+    bool grown = false;
+    for(int i = 0; i <= n; i++){
+        new_children.push_back(children[i]);
+
+        if(bounds[i] != bounds[i+1]){
+            std::vector<std::pair<int, int>> child_split;
+            this->insertSorted(children[i], bounds[i], bounds[i+1], child_split);
+
+            for(std::pair<int, int> &s : child_split){
+                new_keys.push_back(s.first);
+                new_children.push_back(s.second);
+                grown = true;
+            }
+        }
+
+        if(i < n)
+            new_keys.push_back(keys[i]);
+    }
+
+    if(grown)
+        this->storeNodes(ptr, false, new_keys, new_children, values, split);
+}
+
+void BTree::growRoot(std::vector<std::pair<int, int>> &split){
+    // While the root grows by nodes, the tree grows in height
+    while(!split.empty()){
+        int ptr;
+        NodeView r = this->new_node(false, ptr);
+        if(!r.valid())
+            break;
+        this->unpin_node(ptr, true);
+
+        std::vector<int> root_keys;
+        std::vector<int> root_children(1, this->root);
+        std::vector<char> root_values;
+        for(std::pair<int, int> &s : split){
+            root_keys.push_back(s.first);
+            root_children.push_back(s.second);
+        }
+
+        if(DEBUG == true)
+            std::cout << "New root pointer is " << ptr << std::endl;
+
+        split.clear();
+        this->storeNodes(ptr, false, root_keys, root_children, root_values, split);
+        this->root = ptr;
+        this->store_info_header(this->root, this->t);
+    }
+}
+
+void BTree::linkSplit(std::vector<std::pair<int, int>> &path, std::vector<std::pair<int, int>> &split){
+    while(!split.empty() && !path.empty()){
+        int p_ptr = path.back().first;
+        int p_idx = path.back().second;
+        path.pop_back();
+
+        NodeView p = this->pin_node(p_ptr);
+        if(!p.valid())
+            return;
+        int n = p.get_n();
+        std::vector<int> keys(p.keys(), p.keys()+n);
+        std::vector<int> children(p.children(), p.children()+n+1);
+        std::vector<char> values;
+        this->unpin_node(p_ptr, false);
+
+        // The new nodes follow the child they split from
+        for(size_t j = 0; j < split.size(); j++){
+            keys.insert(keys.begin()+p_idx+j, split[j].first);
+            children.insert(children.begin()+p_idx+j+1, split[j].second);
+        }
+
+        split.clear();
+        this->storeNodes(p_ptr, false, keys, children, values, split);
+    }
+    this->growRoot(split);
+}
+
+void BTree::storeNodes(int ptr, bool leaf, std::vector<int> &keys, std::vector<int> &children,
+                       std::vector<char> &values, std::vector<std::pair<int, int>> &split){
+    int m = keys.size();
+    bool copy = leaf && this->layout == BPLUS_LAYOUT;
+    int cap = leaf ? this->leaf_t : this->t;
+
+    // Count the nodes needed. Every node after the first takes a key as
+    // separator, which a B+ leaf also keeps. Packed leaves are filled in
+    // order with as many keys as fit on their page
+    std::vector<int> counts;
+    if(copy && this->packed){
+        for(int pos = 0; pos < m || counts.empty(); pos += counts.back())
+            counts.push_back(this->packed_fit(keys.data()+pos, m-pos));
+    }else{
+        int k = copy ? (m+cap-1)/cap : (m+1+cap)/(cap+1);
+        if(k < 1)
+            k = 1;
+        int stored = copy ? m : m-(k-1);
+        for(int j = 0; j < k; j++)
+            counts.push_back(stored/k + (j < stored%k ? 1 : 0));
+    }
+    int k = counts.size();
+
+    if(DEBUG == true && k > 1)
+        std::cout << "Spreading node with pointer " << ptr << " over " << k << " nodes" << std::endl;
+
+    int prev_ptr = -1;
+    int pos = 0;
+    for(int j = 0; j < k; j++){
+        int cnt = counts[j];
+
+        // The first node keeps its page
+        int node_ptr = ptr;
+        NodeView y;
+        if(j == 0){
+            y = this->pin_node(ptr);
+        }else{
+            y = this->new_node(leaf, node_ptr);
+            split.push_back({keys[copy ? pos : pos-1], node_ptr});
+        }
+        if(!y.valid())
+            return;
+
+        memcpy(y.keys(), &keys[pos], sizeof(int)*cnt);
+        if(!leaf)
+            memcpy(y.children(), &children[pos], sizeof(int)*(cnt+1));
+        if(copy && this->value_size > 0)
+            memcpy(y.value(0), &values[(size_t)this->value_size*pos], (size_t)this->value_size*cnt);
+        y.set_n(cnt);
+
+        // New B+ leaves are linked after the previous one
+        if(copy && j > 0){
+            NodeView w = this->pin_node(prev_ptr);
+            if(w.valid()){
+                int next_ptr = w.get_next();
+                y.set_prev(prev_ptr);
+                y.set_next(next_ptr);
+                w.set_next(node_ptr);
+                this->unpin_node(prev_ptr, true);
+
+                if(next_ptr != -1){
+                    NodeView v = this->pin_node(next_ptr);
+                    if(v.valid()){
+                        v.set_prev(node_ptr);
+                        this->unpin_node(next_ptr, true);
+                    }
+                }
+            }
+        }
+        this->unpin_node(node_ptr, true);
+
+        prev_ptr = node_ptr;
+        pos += copy ? cnt : cnt+1;
+    }
+}
+
+bool BTree::remove(int key){
+    if(!this->storage->is_open())
+        return false;
+
+    if(DEBUG == true)
+        std::cout << "Removing key " << key << std::endl;
+
+    // Nodes under the minimum are fixed with their siblings, out of the
+    // top-down latch order, so a remove takes the tree
+    std::unique_lock<std::shared_mutex> tree_lock(this->tree_latch);
+    int root_ptr = this->root;
+    NodeView r = this->pin_node(root_ptr);
+    if(!r.valid())
+        return false;
+
+    if(r.get_n() == 0){
+        this->unpin_node(root_ptr, false);
+        if(DEBUG == true)
+            std::cout << "The tree is empty" << std::endl;
+        return false;
+    }
+
+    bool found;
+    if(this->layout == BPLUS_LAYOUT){
+        this->unpin_node(root_ptr, false);
+        found = this->removeFromLeaf(key);
+    }else{
+        found = this->removeFrom(root_ptr, r, key);
+    }
+
+    // If the root node has 0 keys, make its first child as the new root
+    // if it has a child, otherwise keep the empty leaf as root
+    r = this->pin_node(root_ptr);
+    if(r.valid()){
+        if(r.get_n() == 0 && !r.is_leaf()){
+            this->root = r.child(0);
+            this->unpin_node(root_ptr, false);
+            this->free_node(root_ptr);
+            this->store_info_header(this->root, this->t);
+        }else{
+            this->unpin_node(root_ptr, false);
+        }
+    }
+
+    this->wait_commit(this->commit_operation());
+
+    // The bits of the key stay until the filter is built again
+    if(found && this->filter != nullptr)
+        this->filter->forget();
+
+    if(DEBUG == true && !found)
+        std::cout << "The key " << key << " does not exist in the tree" << std::endl;
+    return found;
+}
+
+bool BTree::removeFrom(int ptr, NodeView x, int key){
+    bool dirty = false;
+
+    while(true){
+        int n = x.get_n();
+
+        // If the key is on this leaf, remove it
+        if(x.is_leaf()){
+            int idx = x.find_key(key);
+            bool found = (idx < n && x.key(idx) == key);
+            if(found){
+                memmove(&x.keys()[idx], &x.keys()[idx+1], sizeof(int)*(n-idx-1));
+                x.move_values(idx, idx+1, n-idx-1);
+                x.set_n(n-1);
+                dirty = true;
+            }
+            this->unpin_node(ptr, dirty);
+            return found;
+        }
+
+        int idx = x.find_key(key);
+
+        if(idx < n && x.key(idx) == key){
+            // The key is on this inner node. It is replaced by its
+            // predecessor or successor if their child can give a key,
+            // otherwise both children are merged around it
+            NodeView y = this->pin_node(x.child(idx));
+            NodeView z = this->pin_node(x.child(idx+1));
+            if(!y.valid() || !z.valid()){
+                if(y.valid())
+                    this->unpin_node(x.child(idx), false);
+                if(z.valid())
+                    this->unpin_node(x.child(idx+1), false);
+                this->unpin_node(ptr, dirty);
+                return false;
+            }
+            bool y_more = y.get_n() > this->min_keys(y);
+            bool z_more = z.get_n() > this->min_keys(z);
+            this->unpin_node(x.child(idx), false);
+            this->unpin_node(x.child(idx+1), false);
+
+            if(y_more){
+                key = this->getPred(x.child(idx));
+                x.set_key(idx, key);
+            }else if(z_more){
+                key = this->getSucc(x.child(idx+1));
+                x.set_key(idx, key);
+                idx++;
+            }else{
+                this->merge(x, idx);
+            }
+            dirty = true;
+        }else{
+            // The child where the key must be is filled before going
+            // down if it has the minimum number of keys
+            NodeView y = this->pin_node(x.child(idx));
+            if(!y.valid()){
+                this->unpin_node(ptr, dirty);
+                return false;
+            }
+            bool y_min = y.get_n() <= this->min_keys(y);
+            this->unpin_node(x.child(idx), false);
+
+            if(y_min){
+                idx = this->fill(x, idx);
+                dirty = true;
+            }
+        }
+
+        int next_ptr = x.child(idx);
+        NodeView y = this->pin_node(next_ptr);
+        this->unpin_node(ptr, dirty);
+        if(!y.valid())
+            return false;
+
+        ptr = next_ptr;
+        x = y;
+        dirty = false;
+    }
+}
+
+bool BTree::removeFromLeaf(int key){
+    // Go down to the first leaf that can hold key
+    std::vector<std::pair<int, int>> path;
+    int ptr = this->root;
+    NodeView x = this->pin_node(ptr);
+    while(x.valid() && !x.is_leaf()){
+        int idx = x.find_key(key);
+        path.push_back({ptr, idx});
+        int next_ptr = x.child(idx);
+        this->unpin_node(ptr, false);
+        ptr = next_ptr;
+        x = this->pin_node(ptr);
+    }
+    if(!x.valid())
+        return false;
+
+    // If every key of the leaf is lower, the key can only be the first
+    // one of the next leaf
+    int idx = x.find_key(key);
+    if(idx == x.get_n() && !path.empty()){
+        this->unpin_node(ptr, false);
+        ptr = this->nextOnPath(path);
+        x = this->pin_node(ptr);
+        if(!x.valid())
+            return false;
+        idx = 0;
+    }
+
+    int n = x.get_n();
+    if(idx >= n || x.key(idx) != key){
+        this->unpin_node(ptr, false);
+        return false;
+    }
+
+    memmove(&x.keys()[idx], &x.keys()[idx+1], sizeof(int)*(n-idx-1));
+    x.move_values(idx, idx+1, n-idx-1);
+    x.set_n(n-1);
+    bool underflow = (n-1 < this->min_keys(x));
+
+    // The key joins the distances around it, which can widen the delta
+    // encoding of a packed leaf past its page. The leaf is spread over
+    // new leaves then, like a batch insert does. It is released as it
+    // was, since it can't be packed, and storeNodes writes it again
+    if(this->packed && !this->packed_fits(x.keys(), n-1)){
+        std::vector<int> keys(x.keys(), x.keys()+n-1);
+        std::vector<int> children;
+        std::vector<char> values(x.value(0), x.value(n-1));
+        this->unpin_node(ptr, false);
+
+        std::vector<std::pair<int, int>> split;
+        this->storeNodes(ptr, true, keys, children, values, split);
+        this->linkSplit(path, split);
+        return true;
+    }
+    this->unpin_node(ptr, true);
+
+    // Fill the nodes under the minimum from the leaf up. The root can
+    // keep any number of keys
+    while(underflow && !path.empty()){
+        int p_ptr = path.back().first;
+        int p_idx = path.back().second;
+        path.pop_back();
+
+        NodeView p = this->pin_node(p_ptr);
+        if(!p.valid())
+            break;
+        this->fill(p, p_idx);
+        underflow = (p.get_n() < this->min_keys(p));
+        this->unpin_node(p_ptr, true);
+    }
+
+    return true;
+}
+
+int BTree::nextOnPath(std::vector<std::pair<int, int>> &path){
+    size_t depth = path.size();
+
+    // Climb to the first step with a child left
+    while(!path.empty()){
+        NodeView x = this->pin_node(path.back().first);
+        if(!x.valid())
+            return -1;
+        int n = x.get_n();
+        this->unpin_node(path.back().first, false);
+
+        if(path.back().second < n){
+            path.back().second++;
+            break;
+        }
+        path.pop_back();
+    }
+    if(path.empty())
+        return -1;
+
+    // Go down along the first children
+    while(true){
+        NodeView x = this->pin_node(path.back().first);
+        if(!x.valid())
+            return -1;
+        int child = x.child(path.back().second);
+        this->unpin_node(path.back().first, false);
+
+        if(path.size() == depth)
+            return child;
+        path.push_back({child, 0});
+    }
+}
+
+int BTree::min_keys(NodeView &x){
+    // Packed leaves hold keys by their room, not their count, so they are
+    // only fixed once empty, when any sibling can fill or take them
+    if(x.is_leaf() && this->packed)
+        return 1;
+    if(x.is_leaf() && this->layout == BPLUS_LAYOUT)
+        return this->leaf_t/2;
+    return (this->t-1)/2;
+}
+
+int BTree::getPred(int ptr){
+    // Keep moving to the right most node until we reach a leaf
+    NodeView x = this->pin_node(ptr);
+    while(x.valid() && !x.is_leaf()){
+        int next_ptr = x.child(x.get_n());
+        this->unpin_node(ptr, false);
+        ptr = next_ptr;
+        x = this->pin_node(ptr);
+    }
+    if(!x.valid())
+        return 0;
+
+    // Return the last key of the leaf
+    int key = x.key(x.get_n()-1);
+    this->unpin_node(ptr, false);
+    return key;
+}
+
+int BTree::getSucc(int ptr){
+    // Keep moving the left most node starting from ptr until we reach a leaf
+    NodeView x = this->pin_node(ptr);
+    while(x.valid() && !x.is_leaf()){
+        int next_ptr = x.child(0);
+        this->unpin_node(ptr, false);
+        ptr = next_ptr;
+        x = this->pin_node(ptr);
+    }
+    if(!x.valid())
+        return 0;
+
+    // Return the first key of the leaf
+    int key = x.key(0);
+    this->unpin_node(ptr, false);
+    return key;
+}
+
+int BTree::fill(NodeView x, int idx){
+    int n = x.get_n();
+    int y_ptr = x.child(idx);
+
+    // If the previous child has more than the minimum number of keys,
+    // borrow a key from that child
+    if(idx != 0){
+        int w_ptr = x.child(idx-1);
+        NodeView w = this->pin_node(w_ptr);
+        if(w.valid() && w.get_n() > this->min_keys(w)){
+            NodeView y = this->pin_node(y_ptr);
+            if(y.valid()){
+                this->borrowFromPrev(x, idx, w, y);
+                this->unpin_node(y_ptr, true);
+                this->unpin_node(w_ptr, true);
+                return idx;
+            }
+        }
+        if(w.valid())
+            this->unpin_node(w_ptr, false);
+    }
+
+    // If the next child has more than the minimum number of keys,
+    // borrow a key from that child
+    if(idx != n){
+        int w_ptr = x.child(idx+1);
+        NodeView w = this->pin_node(w_ptr);
+        if(w.valid() && w.get_n() > this->min_keys(w)){
+            NodeView y = this->pin_node(y_ptr);
+            if(y.valid()){
+                this->borrowFromNext(x, idx, y, w);
+                this->unpin_node(y_ptr, true);
+                this->unpin_node(w_ptr, true);
+                return idx;
+            }
+        }
+        if(w.valid())
+            this->unpin_node(w_ptr, false);
+    }
+
+    // Merge the child with its sibling. If it is the last child, merge
+    // it with its previous sibling, otherwise with its next sibling
+    if(idx != n){
+        this->merge(x, idx);
+        return idx;
+    }
+    this->merge(x, idx-1);
+    return idx-1;
+}
+
+void BTree::borrowFromPrev(NodeView x, int idx, NodeView w, NodeView y){
+    int yn = y.get_n();
+    int wn = w.get_n();
+
+    // Moving all keys of y one step ahead
+    memmove(&y.keys()[1], &y.keys()[0], sizeof(int)*yn);
+
+    // A B+ leaf takes the last key of w, with its value, which becomes
+    // its separator
+    if(y.is_leaf() && this->layout == BPLUS_LAYOUT){
+        y.move_values(1, 0, yn);
+        y.set_key(0, w.key(wn-1));
+        y.set_value(0, w.value(wn-1));
+        x.set_key(idx-1, y.key(0));
+    }else{
+        // If y is not a leaf, move all its children one step ahead
+        if(!y.is_leaf())
+            memmove(&y.children()[1], &y.children()[0], sizeof(int)*(yn+1));
+
+        // The key from x goes down to y, and the last key of w goes up
+        // to x, with its child
+        y.set_key(0, x.key(idx-1));
+        if(!y.is_leaf())
+            y.set_child(0, w.child(wn));
+        x.set_key(idx-1, w.key(wn-1));
+    }
+
+    y.set_n(yn+1);
+    w.set_n(wn-1);
+}
+
+void BTree::borrowFromNext(NodeView x, int idx, NodeView y, NodeView w){
+    int yn = y.get_n();
+    int wn = w.get_n();
+
+    if(y.is_leaf() && this->layout == BPLUS_LAYOUT){
+        // A B+ leaf takes the first key of w, with its value, the new
+        // first key of w becomes the separator
+        y.set_key(yn, w.key(0));
+        y.set_value(yn, w.value(0));
+        x.set_key(idx, w.key(1));
+        w.move_values(0, 1, wn-1);
+    }else{
+        // The key from x goes down to y, and the first key of w goes up
+        // to x, with its child
+        y.set_key(yn, x.key(idx));
+        if(!y.is_leaf())
+            y.set_child(yn+1, w.child(0));
+        x.set_key(idx, w.key(0));
+
+        if(!w.is_leaf())
+            memmove(&w.children()[0], &w.children()[1], sizeof(int)*wn);
+    }
+
+    // Moving all keys of w one step behind
+    memmove(&w.keys()[0], &w.keys()[1], sizeof(int)*(wn-1));
+
+    y.set_n(yn+1);
+    w.set_n(wn-1);
+}
+
+void BTree::merge(NodeView x, int idx){
+    int n = x.get_n();
+    int y_ptr = x.child(idx);
+    int z_ptr = x.child(idx+1);
+
+    NodeView y = this->pin_node(y_ptr);
+    NodeView z = this->pin_node(z_ptr);
+    if(!y.valid() || !z.valid()){
+        if(y.valid())
+            this->unpin_node(y_ptr, false);
+        if(z.valid())
+            this->unpin_node(z_ptr, false);
+        return;
+    }
+
+    int yn = y.get_n();
+    int zn = z.get_n();
+
+    if(y.is_leaf() && this->layout == BPLUS_LAYOUT){
+        // B+ leaves are concatenated and z leaves the chain
+        memcpy(&y.keys()[yn], z.keys(), sizeof(int)*zn);
+        memcpy(y.value(yn), z.value(0), (size_t)this->value_size*zn);
+        y.set_n(yn+zn);
+
+        int next_ptr = z.get_next();
+        y.set_next(next_ptr);
+        if(next_ptr != -1){
+            NodeView v = this->pin_node(next_ptr);
+            if(v.valid()){
+                v.set_prev(y_ptr);
+                this->unpin_node(next_ptr, true);
+            }
+        }
+    }else{
+        // Pulling a key from x and inserting it into the middle of y,
+        // then copying the keys and children of z at the end of y
+        y.set_key(yn, x.key(idx));
+        memcpy(&y.keys()[yn+1], z.keys(), sizeof(int)*zn);
+        if(!y.is_leaf())
+            memcpy(&y.children()[yn+1], z.children(), sizeof(int)*(zn+1));
+        y.set_n(yn+zn+1);
+    }
+
+    // Moving all keys after idx in x one step before, and the children
+    // after idx+1 too
+    memmove(&x.keys()[idx], &x.keys()[idx+1], sizeof(int)*(n-idx-1));
+    memmove(&x.children()[idx+1], &x.children()[idx+2], sizeof(int)*(n-idx-1));
+    x.set_n(n-1);
+
+    this->unpin_node(y_ptr, true);
+    this->unpin_node(z_ptr, false);
+    this->free_node(z_ptr);
+}
+
+BTreeNode* BTree::search(int key){
+    int ptr = this->find(key, this->node, nullptr);
+    if(ptr == -1)
+        return nullptr;
+
+    this->node_ptr = ptr;
+    return this->node;
+}
+
+int BTree::find(int key){
+    return this->find(key, nullptr, nullptr);
+}
+
+int BTree::find(int key, BTreeNode* result, char* value){
+    if(this->storage->is_open()){
+        int found = -1;
+        std::shared_lock<std::shared_mutex> tree_lock(this->tree_latch);
+
+        // A key the filter never saw is not on any page
+        if(this->filter != nullptr && !this->filter->may_contain(key)){
+            if(DEBUG == true)
+                std::cout << "Key " << key << " was not found" << std::endl;
+            return -1;
+        }
+
+        LatchScope scope(this->latches, this->latch_set(), LATCH_SHARED);
+
+        // Pin the root and check if it is empty. The root can't change
+        // once its page is latched
+        std::shared_lock<std::shared_mutex> root_lock(this->root_latch);
+        int ptr = this->root;
+        NodeView x = this->pin_node(ptr, false);
+        root_lock.unlock();
+
+        // If the root is not empty, begin search. Every child is pinned
+        // before its parent is released, so no split happens in between
+        while (x.valid()){
+            if (x.get_n() == 0){
+                this->unpin_node(ptr, false);
+                break;
+            }
+
+            // Find the first key greater than or equal to key. Packed
+            // leaves are searched without decoding them
+            int i = this->node_find(x, key);
+
+            // B+ inner nodes only route to the first leaf that can hold
+            // key. If all keys of that leaf are lower, the key can only
+            // start the next leaf
+            if (this->layout == BPLUS_LAYOUT){
+                int next_ptr;
+                if (!x.is_leaf())
+                    next_ptr = x.child(i);
+                else if (i == x.get_n())
+                    next_ptr = this->node_next(x);
+                else
+                    next_ptr = -1;
+
+                if (next_ptr != -1){
+                    NodeView y = this->pin_node(next_ptr, false);
+                    this->unpin_node(ptr, false);
+                    ptr = next_ptr;
+                    x = y;
+                    continue;
+                }
+            }
+
+            // Only the node holding the key is decoded
+            if (i < x.get_n() && this->node_key(x, i) == key){
+                std::vector<char> scratch;
+                if (this->packed && x.is_leaf() && (result != nullptr || value != nullptr)){
+                    scratch.resize(this->scratch_size());
+                    NodeView leaf(scratch.data(), this->leaf_max_keys, this->value_size);
+                    this->unpack_leaf(x.page(), leaf);
+                    x = leaf;
+                }
+                if (result != nullptr)
+                    result->deserialize(x.page(), this->page_keys(x.is_leaf()));
+                if (value != nullptr)
+                    memcpy(value, x.value(i), this->value_size);
+                found = ptr;
+                this->unpin_node(ptr, false);
+                break;
+            }
+
+            // If the key is not here and this is a leaf, it is not present
+            if (x.is_leaf()){
+                this->unpin_node(ptr, false);
+                break;
+            }
+
+            // Pin the appropriate child node and try searching again
+            int next_ptr = x.child(i);
+            NodeView y = this->pin_node(next_ptr, false);
+            this->unpin_node(ptr, false);
+            ptr = next_ptr;
+            x = y;
+        }
+
+        if(DEBUG ){
+            if (found != -1)
+                std::cout << "Found key " << key << std::endl;
+            else
+                std::cout << "Key " << key << " was not found" << std::endl;
+        }
+        return found;
+    }
+    return -1;
+}
+
+int BTree::search_many(const std::vector<int> &keys, std::vector<int> &results){
+    results.assign(keys.size(), -1);
+    if(!this->storage->is_open())
+        return 0;
+
+    std::shared_lock<std::shared_mutex> tree_lock(this->tree_latch);
+    LatchSet &set = this->latch_set();
+    LatchScope scope(this->latches, set, LATCH_SHARED);
+
+    // The inner pages of a level stay latched until the pages of the next
+    // one are, like the parent of a single search
+    std::shared_lock<std::shared_mutex> root_lock(this->root_latch);
+    int root_ptr = this->root;
+    std::vector<int> held(1, root_ptr);
+    this->latches.lock(set, root_ptr);
+    root_lock.unlock();
+
+    // Every lookup still going down is a (page, key index) pair. Keys
+    // the filter never saw don't go down at all
+    std::vector<std::pair<int, int>> level;
+    for(int k = 0; k < (int)keys.size(); k++)
+        if(this->filter == nullptr || this->filter->may_contain(keys[k]))
+            level.push_back({root_ptr, k});
+
+    int found = 0;
+    while(!level.empty()){
+        // Group the lookups by page, in file order, and read the pages
+        // of the level ahead
+        std::sort(level.begin(), level.end());
+        std::vector<int> pages;
+        for(std::pair<int, int> &step : level)
+            if(pages.empty() || pages.back() != step.first)
+                pages.push_back(step.first);
+        this->pool->prefetch(pages);
+
+        std::vector<std::pair<int, int>> next_level;
+        std::vector<int> latched;
+        size_t i = 0;
+        while(i < level.size()){
+            int ptr = level[i].first;
+            size_t j = i;
+            while(j < level.size() && level[j].first == ptr)
+                j++;
+
+            // Every lookup of the group shares the pinned page
+            NodeView x = this->pin_node(ptr);
+            std::vector<int> hops;
+            if(x.valid() && x.get_n() > 0){
+                for(size_t m = i; m < j; m++){
+                    int k = level[m].second;
+                    int key = keys[k];
+                    int idx = x.find_key(key);
+
+                    if(idx < x.get_n() && x.key(idx) == key && (x.is_leaf() || this->layout != BPLUS_LAYOUT)){
+                        results[k] = ptr;
+                        found++;
+                    }else if(!x.is_leaf()){
+                        next_level.push_back({x.child(idx), k});
+                    }else if(this->layout == BPLUS_LAYOUT && idx == x.get_n() && x.get_next() != -1){
+                        // The key can only start the next leaf
+                        hops.push_back(k);
+                    }
+                }
+            }
+
+            if(x.valid() && !x.is_leaf()){
+                this->pool->unpin_page(ptr, false);
+                latched.push_back(ptr);
+                i = j;
+                continue;
+            }
+
+            // Leaves are released at once, the lookups that go on to the
+            // next leaf follow the chain left to right, like a split does
+            while(x.valid() && !hops.empty()){
+                int next_ptr = x.get_next();
+                NodeView y = this->pin_node(next_ptr);
+                this->unpin_node(ptr, false);
+                ptr = next_ptr;
+                x = y;
+
+                std::vector<int> more;
+                for(int k = 0; x.valid() && k < (int)hops.size(); k++){
+                    int idx = x.find_key(keys[hops[k]]);
+                    if(idx < x.get_n() && x.key(idx) == keys[hops[k]]){
+                        results[hops[k]] = ptr;
+                        found++;
+                    }else if(idx == x.get_n() && x.get_next() != -1){
+                        more.push_back(hops[k]);
+                    }
+                }
+                hops.swap(more);
+            }
+            if(x.valid())
+                this->unpin_node(ptr, false);
+
+            i = j;
+        }
+
+        for(int ptr : held)
+            this->latches.unlock(set, ptr);
+        held.swap(latched);
+        level.swap(next_level);
+    }
+
+    if(DEBUG == true)
+        std::cout << "Found " << found << " of " << keys.size() << " keys" << std::endl;
+
+    return found;
+}
+
+template <typename Iterator>
+bool BTree::bulk_load(Iterator first, Iterator last, double fill){
+    std::unique_lock<std::shared_mutex> tree_lock(this->tree_latch);
+    BTreeBulkLoader loader(this, fill);
+    if(!loader.valid())
+        return false;
+
+    if(DEBUG == true)
+        std::cout << "Bulk loading BTree" << std::endl;
+
+    for(; first != last; ++first){
+        if(!loader.add(*first)){
+            if(DEBUG == true)
+                std::cout << "Bulk load keys are not sorted" << std::endl;
+
+            // Leave an empty tree behind
+            tree_lock.unlock();
+            this->init(this->t, this->page_size, this->layout, this->value_size, this->packed);
+            return false;
+        }
+    }
+
+    return loader.finish();
+}
+
+bool BTree::bulk_load(std::istream &input, double fill){
+    return this->bulk_load(std::istream_iterator<int>(input), std::istream_iterator<int>(), fill);
+}
+
+bool BTree::compact(int order, double fill){
+    if(!this->storage->is_open())
+        return false;
+
+    std::unique_lock<std::shared_mutex> tree_lock(this->tree_latch);
+    this->checkpoint();
+
+    if(DEBUG == true)
+        std::cout << "Compacting BTree" << std::endl;
+
+    // The keys are packed on a new tree by the bulk loader, whose pages
+    // are then copied in order to the file that replaces this one
+    std::string packed_path = this->fpath+".pack";
+    std::string compact_path = this->fpath+".compact";
+    bool written = false;
+    {
+        BTree tmp(packed_path, this->cache_size);
+        tmp.init(this->t, this->page_size, this->layout, this->value_size, this->packed);
+        BTreeBulkLoader loader(&tmp, fill);
+        if(loader.valid() && this->copy_keys(loader) && loader.finish())
+            written = tmp.write_ordered(compact_path, order);
+    }
+    std::remove(packed_path.c_str());
+
+    // The old file is closed before it is replaced
+    this->pool->reset();
+    this->storage->close();
+    if(!written || std::rename(compact_path.c_str(), this->fpath.c_str()) != 0){
+        if(DEBUG == true)
+            std::cout << "Compaction failed, the tree is unchanged" << std::endl;
+        std::remove(compact_path.c_str());
+        this->storage->open(false);
+        return false;
+    }
+
+    // Nothing in the log applies to the new pages
+    this->storage->open(false);
+    if(this->wal != nullptr)
+        this->wal->reset();
+    this->node_count = 0;
+    this->load_info_header();
+    return true;
+}
+
+void BTree::enable_filter(int bits_per_key){
+    std::unique_lock<std::shared_mutex> tree_lock(this->tree_latch);
+    if(!this->storage->is_open())
+        return;
+
+    if(DEBUG == true)
+        std::cout << "Building key filter" << std::endl;
+
+    delete this->filter;
+    this->filter = new BloomFilter(this->fpath+".bloom", bits_per_key);
+    this->build_filter();
+    this->checkpoint();
+}
+
+void BTree::disable_filter(){
+    std::unique_lock<std::shared_mutex> tree_lock(this->tree_latch);
+    if(this->filter != nullptr){
+        this->filter->erase();
+        delete this->filter;
+        this->filter = nullptr;
+    }
+}
+
+void BTree::build_filter(){
+    // The pages are read in file order. Free pages have no keys, and B+
+    // inner nodes only copies of keys of the leaves
+    std::vector<int> keys;
+    for(int ptr = 0; ptr < this->node_count; ptr++){
+        NodeView x = this->pin_node(ptr);
+        if(!x.valid())
+            continue;
+        if(x.is_leaf() || this->layout != BPLUS_LAYOUT)
+            for(int i = 0; i < x.get_n(); i++)
+                keys.push_back(x.key(i));
+        this->unpin_node(ptr, false);
+    }
+
+    this->filter->reset((long)keys.size()*BLOOM_GROWTH);
+    for(int key : keys)
+        this->filter->add(key);
+}
+
+bool BTree::copy_keys(BTreeBulkLoader &loader){
+    // B+ leaves are walked along their chain, with their values
+    if(this->layout == BPLUS_LAYOUT){
+        int ptr = this->root;
+        NodeView x = this->pin_node(ptr);
+        while(x.valid() && !x.is_leaf()){
+            int next_ptr = x.child(0);
+            this->unpin_node(ptr, false);
+            ptr = next_ptr;
+            x = this->pin_node(ptr);
+        }
+
+        while(x.valid()){
+            for(int i = 0; i < x.get_n(); i++){
+                if(!loader.add(x.key(i), this->value_size > 0 ? x.value(i) : nullptr)){
+                    this->unpin_node(ptr, false);
+                    return false;
+                }
+            }
+
+            int next_ptr = x.get_next();
+            this->unpin_node(ptr, false);
+            if(next_ptr == -1)
+                return true;
+            ptr = next_ptr;
+            x = this->pin_node(ptr);
+        }
+        return false;
+    }
+
+    BTreeCursor cursor(this);
+    for(bool more = cursor.seek_first(); more; more = cursor.next())
+        if(!loader.add(cursor.key()))
+            return false;
+    return true;
+}
+
+bool BTree::write_ordered(const std::string &path, int order){
+    // The bulk loader wrote the nodes, the header may still be cached
+    this->checkpoint();
+
+    // The new place of every page
+    std::vector<int> pages;
+    if(order == VEB_ORDER){
+        int levels = 0;
+        int ptr = this->root;
+        while(ptr != -1){
+            NodeView x = this->pin_node(ptr, false);
+            if(!x.valid())
+                return false;
+            int next_ptr = x.is_leaf() ? -1 : x.child(0);
+            this->unpin_node(ptr, false);
+            ptr = next_ptr;
+            levels++;
+        }
+        this->veb_order(this->root, levels, pages);
+    }else{
+        pages.push_back(this->root);
+        for(size_t j = 0; j < pages.size(); j++)
+            this->nodes_below(pages[j], 1, pages);
+    }
+
+    std::vector<int> place(this->node_count, -1);
+    for(size_t j = 0; j < pages.size(); j++)
+        place[pages[j]] = j;
+
+    Storage* out = make_storage(FSTREAM_STORAGE, path, 0);
+    if(!out->open(true)){
+        delete out;
+        return false;
+    }
+    char* page = alloc_aligned(this->page_size);
+
+    // The header points to the new root, there are no free pages
+    int root_place = 0;
+    int no_free[2] = {0, -1};
+    this->storage->read(0, page, this->page_size);
+    memcpy(page, &root_place, sizeof(int));
+    memcpy(&page[sizeof(int)*4], no_free, sizeof(no_free));
+    out->write(0, page, this->page_size);
+
+    for(size_t j = 0; j < pages.size(); j++){
+        this->storage->read(this->node_offset(pages[j]), page, this->page_size);
+
+        // Children and leaf links follow their pages
+        NodeView x(page, this->max_keys);
+        if(!x.is_leaf()){
+            for(int i = 0; i <= x.get_n(); i++)
+                x.set_child(i, place[x.child(i)]);
+        }else if(this->packed){
+            PackedHeader h;
+            memcpy(&h, &page[NODE_KEYS_OFFSET], sizeof(PackedHeader));
+            h.prev = (h.prev == -1) ? -1 : place[h.prev];
+            h.next = (h.next == -1) ? -1 : place[h.next];
+            memcpy(&page[NODE_KEYS_OFFSET], &h, sizeof(PackedHeader));
+        }else if(this->layout == BPLUS_LAYOUT){
+            NodeView leaf(page, this->leaf_max_keys, this->value_size);
+            int prev_ptr = leaf.get_prev();
+            int next_ptr = leaf.get_next();
+            leaf.set_prev(prev_ptr == -1 ? -1 : place[prev_ptr]);
+            leaf.set_next(next_ptr == -1 ? -1 : place[next_ptr]);
+        }
+        out->write(this->node_offset(j), page, this->page_size);
+    }
+
+    out->sync();
+    out->close();
+    delete out;
+    free(page);
+
+    if(DEBUG == true)
+        std::cout << "Wrote " << pages.size() << " nodes in order to " << path << std::endl;
+    return true;
+}
+
+void BTree::veb_order(int ptr, int levels, std::vector<int> &order){
+    if(levels <= 1){
+        order.push_back(ptr);
+        return;
+    }
+
+    // The top half of the levels first, then every subtree under it
+    int top = levels/2;
+    this->veb_order(ptr, top, order);
+
+    std::vector<int> below;
+    this->nodes_below(ptr, top, below);
+    for(int child : below)
+        this->veb_order(child, levels-top, order);
+}
+
+void BTree::nodes_below(int ptr, int depth, std::vector<int> &nodes){
+    if(depth == 0){
+        nodes.push_back(ptr);
+        return;
+    }
+
+    NodeView x = this->pin_node(ptr, false);
+    if(!x.valid())
+        return;
+    if(x.is_leaf()){
+        this->unpin_node(ptr, false);
+        return;
+    }
+    std::vector<int> children(x.children(), x.children()+x.get_n()+1);
+    this->unpin_node(ptr, false);
+
+    for(int child : children)
+        this->nodes_below(child, depth-1, nodes);
+}
+
+// BTreeBulkLoader definitions
+BTreeBulkLoader::BTreeBulkLoader(BTree* _tree, double fill){
+    this->tree = _tree;
+    this->started = false;
+    this->last = 0;
+    this->page = nullptr;
+    this->pending = nullptr;
+    this->encoded = nullptr;
+    this->pending_ptr = -1;
+    this->leaf_width = 0;
+    this->plus = (_tree->layout == BPLUS_LAYOUT);
+
+    // Nodes must keep at least (t-1)/2 keys, like the ones split by insert
+    int t = _tree->t;
+    this->cap = (int)(fill*t);
+    if(this->cap < (t-1)/2)
+        this->cap = (t-1)/2;
+    if(this->cap > t)
+        this->cap = t;
+
+    // B+ leaves split in halves, so they keep at least leaf_t/2 keys
+    int lt = _tree->leaf_t;
+    this->leaf_cap = this->cap;
+    if(this->plus){
+        this->leaf_cap = (int)(fill*lt);
+        if(this->leaf_cap < lt/2)
+            this->leaf_cap = lt/2;
+        if(this->leaf_cap > lt)
+            this->leaf_cap = lt;
+    }
+
+    // Packed leaves are filled by bytes instead
+    int size = _tree->page_size;
+    this->leaf_bytes = (int)(fill*size);
+    if(this->leaf_bytes < size/2)
+        this->leaf_bytes = size/2;
+    if(this->leaf_bytes > size)
+        this->leaf_bytes = size;
+
+    if(t < 3 || !_tree->storage->is_open())
+        return;
+
+    // Start from an empty file, the old pages and their log are dropped
+    if(_tree->wal != nullptr)
+        _tree->wal->reset();
+    if(_tree->filter != nullptr)
+        _tree->filter->reset(0);
+    else
+        std::remove((_tree->fpath+".bloom").c_str());
+    _tree->storage->open(true);
+    _tree->pool->reset();
+    _tree->op_pages.clear();
+    _tree->node_count = 0;
+    _tree->free_count = 0;
+    _tree->free_head = -1;
+    _tree->generation = BTree::new_generation();
+
+    // Packed leaves are built decoded, on buffers of their decoded size
+    this->buffer_size = _tree->page_size;
+    if(_tree->packed){
+        this->buffer_size = std::max(this->buffer_size, _tree->scratch_size());
+        this->encoded = alloc_aligned(_tree->page_size);
+    }
+
+    this->page = alloc_aligned(this->buffer_size);
+    if(this->plus)
+        this->pending = alloc_aligned(this->buffer_size);
+    this->levels.resize(1);
+}
+
+BTreeBulkLoader::~BTreeBulkLoader(){
+    free(this->page);
+    free(this->pending);
+    free(this->encoded);
+}
+
+bool BTreeBulkLoader::valid(){
+    return this->page != nullptr;
+}
+
+bool BTreeBulkLoader::add(int key, const char* value){
+    if(this->started && key < this->last)
+        return false;
+
+    // The value waits with its key on the pending leaf
+    int size = this->tree->value_size;
+    if(this->plus && size > 0){
+        std::vector<char> &values = this->levels[0].values;
+        if(value != nullptr)
+            values.insert(values.end(), value, value+size);
+        else
+            values.insert(values.end(), size, 0);
+    }
+
+    this->started = true;
+    this->last = key;
+    this->add_key(0, key);
+    return true;
+}
+
+void BTreeBulkLoader::add_key(int h, int key){
+    Level &level = this->levels[h];
+    level.keys.push_back(key);
+
+    // A packed leaf is written once the next key does not fit, and that
+    // key is copied up as separator
+    if(h == 0 && this->tree->packed){
+        int n = level.keys.size();
+        if(n > 1)
+            this->leaf_width = std::max(this->leaf_width, pack_width((uint32_t)key-(uint32_t)level.keys[n-2]));
+        if(n > this->leaf_cap ||
+           this->tree->packed_size(n, level.keys[0], key, this->leaf_width) > this->leaf_bytes){
+            int ptr = this->write_node(0, 0, n-1);
+            level.keys.erase(level.keys.begin(), level.keys.begin()+n-1);
+            level.values.erase(level.values.begin(), level.values.begin()+(size_t)this->tree->value_size*(n-1));
+            this->leaf_width = 0;
+
+            if(this->levels.size() == 1)
+                this->levels.resize(2);
+            this->add_child(1, ptr);
+            this->add_key(1, key);
+        }
+        return;
+    }
+
+    // A B+ leaf keeps its keys, the first key of the next leaf is copied
+    // up as separator
+    if(h == 0 && this->plus){
+        if((int)level.keys.size() == 2*this->leaf_cap){
+            int ptr = this->write_node(0, 0, this->leaf_cap);
+            int separator = level.keys[this->leaf_cap];
+            level.keys.erase(level.keys.begin(), level.keys.begin()+this->leaf_cap);
+            level.values.erase(level.values.begin(), level.values.begin()+(size_t)this->tree->value_size*this->leaf_cap);
+
+            if(this->levels.size() == 1)
+                this->levels.resize(2);
+            this->add_child(1, ptr);
+            this->add_key(1, separator);
+        }
+        return;
+    }
+
+    // Write a full node only when a whole node can still follow it
+    if((int)level.keys.size() == 2*this->cap+1){
+        int ptr = this->write_node(h, 0, this->cap);
+        int separator = level.keys[this->cap];
+
+        level.keys.erase(level.keys.begin(), level.keys.begin()+this->cap+1);
+        if(h > 0)
+            level.children.erase(level.children.begin(), level.children.begin()+this->cap+1);
+
+        if(h+1 == (int)this->levels.size())
+            this->levels.resize(h+2);
+        this->add_child(h+1, ptr);
+        this->add_key(h+1, separator);
+    }
+}
+
+void BTreeBulkLoader::add_child(int h, int ptr){
+    this->levels[h].children.push_back(ptr);
+}
+
+bool BTreeBulkLoader::finish(){
+    BTree* tree = this->tree;
+
+    for(int h = 0; h < (int)this->levels.size(); h++){
+        bool top = (h+1 == (int)this->levels.size());
+        bool copy = (h == 0 && this->plus);
+        int n = this->levels[h].keys.size();
+
+        // A top level with a single child is not needed
+        if(top && h > 0 && n == 0){
+            tree->root = this->levels[h].children[0];
+            break;
+        }
+
+        if(n <= (copy ? tree->leaf_t : tree->t)){
+            // The rest fits in one node
+            int ptr = this->write_node(h, 0, n);
+            if(top){
+                tree->root = ptr;
+                break;
+            }
+            this->add_child(h+1, ptr);
+        }else{
+            // Split the rest in two nodes, both at least half full. A B+
+            // separator is also the first key of the right leaf
+            int a = copy ? n/2 : (n-1)/2;
+            int left = this->write_node(h, 0, a);
+            int right = copy ? this->write_node(h, a, n-a) : this->write_node(h, a+1, n-a-1);
+            int separator = this->levels[h].keys[a];
+
+            if(top)
+                this->levels.resize(h+2);
+            this->add_child(h+1, left);
+            this->add_key(h+1, separator);
+            this->add_child(h+1, right);
+        }
+    }
+
+    // The last leaf ends the chain
+    if(this->pending_ptr != -1)
+        this->write_pending(-1);
+
+    // The header is written once, when the tree is complete. The pages
+    // bypass the log, so a logged tree is synced here
+    tree->store_info_header(tree->root, tree->t);
+    tree->commit_operation();
+
+    // The filter is filled from the new pages before it is stored
+    if(tree->filter != nullptr)
+        tree->build_filter();
+    tree->checkpoint();
+
+    if(DEBUG == true)
+        std::cout << "Bulk loaded " << tree->node_count << " nodes, root is " << tree->root << std::endl;
+
+    return true;
+}
+
+int BTreeBulkLoader::write_node(int h, int first_key, int n){
+    BTree* tree = this->tree;
+    Level &level = this->levels[h];
+    int ptr = tree->node_count++;
+
+    bool copy = (h == 0 && this->plus);
+    memset(this->page, 0, this->buffer_size);
+    NodeView view(this->page, tree->page_keys(h == 0), copy ? tree->value_size : 0);
+    view.set_t(tree->t);
+    view.set_n(n);
+    view.set_leaf(h == 0);
+    if(n > 0)
+        memcpy(view.keys(), level.keys.data()+first_key, sizeof(int)*n);
+    if(h > 0)
+        memcpy(view.children(), level.children.data()+first_key, sizeof(int)*(n+1));
+    if(copy && n > 0 && tree->value_size > 0)
+        memcpy(view.value(0), &level.values[(size_t)tree->value_size*first_key], (size_t)tree->value_size*n);
+
+    // A B+ leaf waits for the next one to know its link
+    if(copy){
+        view.set_prev(this->pending_ptr);
+        if(this->pending_ptr != -1)
+            this->write_pending(ptr);
+        std::swap(this->page, this->pending);
+        this->pending_ptr = ptr;
+        return ptr;
+    }
+
+    // Pages are appended in order, bypassing the pool
+    tree->storage->write(tree->node_offset(ptr), this->page, tree->page_size);
+
+    return ptr;
+}
+
+void BTreeBulkLoader::write_pending(int next){
+    BTree* tree = this->tree;
+
+    NodeView view(this->pending, tree->leaf_max_keys, tree->value_size);
+    view.set_next(next);
+    if(tree->packed){
+        tree->pack_leaf(view, this->encoded);
+        tree->storage->write(tree->node_offset(this->pending_ptr), this->encoded, tree->page_size);
+        return;
+    }
+    tree->storage->write(tree->node_offset(this->pending_ptr), this->pending, tree->page_size);
+}
+
+void BTree::traverse(){
+    BTreeCursor cursor(this);
+    for (bool more = cursor.seek_first(); more; more = cursor.next())
+        std::cout << " " << cursor.key();
+}
+
+BTreeCursor::BTreeCursor(BTree* _tree){
+    this->tree = _tree;
+    this->current = 0;
+    this->lo = INT_MIN;
+    this->hi = INT_MAX;
+}
+
+bool BTreeCursor::seek(int key){
+    this->path.clear();
+    if(!this->tree->storage->is_open())
+        return false;
+
+    int ptr = this->tree->root;
+    while(true){
+        NodeView x = this->tree->pin_node(ptr);
+        if(!x.valid())
+            return false;
+
+        // Equal keys can also be on the child before a match, so the
+        // search always goes down to a leaf
+        int n = x.get_n();
+        int i = x.find_key(key);
+        bool leaf = x.is_leaf();
+        int child = leaf ? -1 : x.child(i);
+        this->tree->unpin_node(ptr, false);
+
+        this->path.push_back({ptr, i, i, i});
+        if(leaf){
+            // Past the last key of the leaf, the next key is an ancestor
+            if(i == n)
+                return this->climb_next();
+            return this->load_current();
+        }
+
+        this->read_ahead(this->path.back());
+        ptr = child;
+    }
+}
+
+bool BTreeCursor::seek_for_prev(int key){
+    this->path.clear();
+    if(!this->tree->storage->is_open())
+        return false;
+
+    int ptr = this->tree->root;
+    while(true){
+        NodeView x = this->tree->pin_node(ptr);
+        if(!x.valid())
+            return false;
+
+        // Every key before i is lower than or equal to key
+        int i = upper_bound_keys(x.keys(), x.get_n(), key);
+        bool leaf = x.is_leaf();
+        int child = leaf ? -1 : x.child(i);
+        this->tree->unpin_node(ptr, false);
+
+        if(leaf){
+            this->path.push_back({ptr, i-1, i-1, i-1});
+            // Before the first key of the leaf, the key is an ancestor
+            if(i == 0)
+                return this->climb_prev();
+            return this->load_current();
+        }
+
+        this->path.push_back({ptr, i, i, i});
+        this->read_behind(this->path.back());
+        ptr = child;
+    }
+}
+
+bool BTreeCursor::seek_first(){
+    this->path.clear();
+    if(this->lo != INT_MIN)
+        return this->seek(this->lo);
+    if(!this->tree->storage->is_open())
+        return false;
+    return this->descend_first(this->tree->root);
+}
+
+bool BTreeCursor::seek_last(){
+    this->path.clear();
+    if(this->hi != INT_MAX)
+        return this->seek_for_prev(this->hi);
+    if(!this->tree->storage->is_open())
+        return false;
+    return this->descend_last(this->tree->root);
+}
+
+bool BTreeCursor::range(int _lo, int _hi){
+    this->lo = _lo;
+    this->hi = _hi;
+    return this->seek(_lo);
+}
+
+bool BTreeCursor::valid(){
+    return !this->path.empty() && this->current >= this->lo && this->current <= this->hi;
+}
+
+int BTreeCursor::key(){
+    return this->current;
+}
+
+bool BTreeCursor::next(){
+    if(this->path.empty())
+        return false;
+
+    Step &step = this->path.back();
+    NodeView x = this->tree->pin_node(step.ptr, false);
+    if(!x.valid()){
+        this->path.clear();
+        return false;
+    }
+
+    // The next key of an inner node is the first key of its next child
+    if(!x.is_leaf()){
+        step.idx++;
+        int child = x.child(step.idx);
+        this->tree->unpin_node(step.ptr, false);
+        this->read_ahead(step);
+        return this->descend_first(child);
+    }
+
+    if(step.idx+1 < x.get_n()){
+        step.idx++;
+        this->current = this->tree->node_key(x, step.idx);
+        this->tree->unpin_node(step.ptr, false);
+        return this->valid();
+    }
+
+    this->tree->unpin_node(step.ptr, false);
+    return this->climb_next();
+}
+
+bool BTreeCursor::prev(){
+    if(this->path.empty())
+        return false;
+
+    Step &step = this->path.back();
+    NodeView x = this->tree->pin_node(step.ptr, false);
+    if(!x.valid()){
+        this->path.clear();
+        return false;
+    }
+
+    // The previous key of an inner node is the last key of the child
+    // before it, which has the same index as the key
+    if(!x.is_leaf()){
+        int child = x.child(step.idx);
+        this->tree->unpin_node(step.ptr, false);
+        this->read_behind(step);
+        return this->descend_last(child);
+    }
+
+    if(step.idx > 0){
+        step.idx--;
+        this->current = this->tree->node_key(x, step.idx);
+        this->tree->unpin_node(step.ptr, false);
+        return this->valid();
+    }
+
+    this->tree->unpin_node(step.ptr, false);
+    return this->climb_prev();
+}
+
+int BTreeCursor::next_batch(int* buffer, int capacity){
+    int count = 0;
+
+    while(count < capacity && this->valid()){
+        Step &step = this->path.back();
+        NodeView x = this->tree->pin_node(step.ptr);
+
+        // Keys of a leaf are copied as one run, up to the end of the range
+        if(x.valid() && x.is_leaf()){
+            int end = upper_bound_keys(x.keys(), x.get_n(), this->hi);
+            int m = std::min(end-step.idx, capacity-count);
+            memcpy(&buffer[count], &x.keys()[step.idx], sizeof(int)*m);
+            count += m;
+            step.idx += m-1;
+            this->tree->unpin_node(step.ptr, false);
+        }
+        else{
+            if(x.valid())
+                this->tree->unpin_node(step.ptr, false);
+            buffer[count++] = this->current;
+        }
+        this->next();
+    }
+    return count;
+}
+
+int BTreeCursor::prev_batch(int* buffer, int capacity){
+    int count = 0;
+
+    while(count < capacity && this->valid()){
+        Step &step = this->path.back();
+        NodeView x = this->tree->pin_node(step.ptr);
+
+        // Keys of a leaf are copied as one run, down to the range start
+        if(x.valid() && x.is_leaf()){
+            int start = lower_bound_keys(x.keys(), step.idx+1, this->lo);
+            int m = std::min(step.idx+1-start, capacity-count);
+            for(int i = 0; i < m; i++)
+                buffer[count++] = x.key(step.idx-i);
+            step.idx -= m-1;
+            this->tree->unpin_node(step.ptr, false);
+        }
+        else{
+            if(x.valid())
+                this->tree->unpin_node(step.ptr, false);
+            buffer[count++] = this->current;
+        }
+        this->prev();
+    }
+    return count;
+}
+
+bool BTreeCursor::descend_first(int ptr){
+    while(true){
+        NodeView x = this->tree->pin_node(ptr);
+        if(!x.valid()){
+            this->path.clear();
+            return false;
+        }
+
+        bool leaf = x.is_leaf();
+        int n = x.get_n();
+        int child = leaf ? -1 : x.child(0);
+        this->tree->unpin_node(ptr, false);
+
+        this->path.push_back({ptr, 0, 0, 0});
+        if(leaf)
+            return (n > 0) ? this->load_current() : this->climb_next();
+
+        this->read_ahead(this->path.back());
+        ptr = child;
+    }
+}
+
+bool BTreeCursor::descend_last(int ptr){
+    while(true){
+        NodeView x = this->tree->pin_node(ptr);
+        if(!x.valid()){
+            this->path.clear();
+            return false;
+        }
+
+        bool leaf = x.is_leaf();
+        int n = x.get_n();
+        int child = leaf ? -1 : x.child(n);
+        this->tree->unpin_node(ptr, false);
+
+        if(leaf){
+            this->path.push_back({ptr, n-1, n-1, n-1});
+            return (n > 0) ? this->load_current() : this->climb_prev();
+        }
+
+        this->path.push_back({ptr, n, n, n});
+        this->read_behind(this->path.back());
+        ptr = child;
+    }
+}
+
+bool BTreeCursor::climb_next(){
+    // B+ inner keys are only separators
+    if(this->tree->layout == BPLUS_LAYOUT)
+        return this->next_leaf();
+
+    this->path.pop_back();
+
+    while(!this->path.empty()){
+        Step &step = this->path.back();
+        NodeView x = this->tree->pin_node(step.ptr);
+        int n = x.valid() ? x.get_n() : 0;
+        if(x.valid())
+            this->tree->unpin_node(step.ptr, false);
+
+        // The key after child idx has the same index
+        if(step.idx < n)
+            return this->load_current();
+        this->path.pop_back();
+    }
+    return false;
+}
+
+bool BTreeCursor::climb_prev(){
+    if(this->tree->layout == BPLUS_LAYOUT)
+        return this->prev_leaf();
+
+    this->path.pop_back();
+
+    while(!this->path.empty()){
+        Step &step = this->path.back();
+
+        // The key before child idx is at idx-1
+        if(step.idx > 0){
+            step.idx--;
+            return this->load_current();
+        }
+        this->path.pop_back();
+    }
+    return false;
+}
+
+bool BTreeCursor::next_leaf(){
+    while(true){
+        Step &step = this->path.back();
+        NodeView x = this->tree->pin_node(step.ptr);
+        int link = x.valid() ? x.get_next() : -1;
+        if(x.valid())
+            this->tree->unpin_node(step.ptr, false);
+
+        this->path.pop_back();
+        if(link == -1){
+            this->path.clear();
+            return false;
+        }
+        this->advance_parents();
+
+        NodeView y = this->tree->pin_node(link);
+        if(!y.valid()){
+            this->path.clear();
+            return false;
+        }
+        int n = y.get_n();
+        this->tree->unpin_node(link, false);
+
+        // Empty leaves are skipped
+        this->path.push_back({link, 0, 0, 0});
+        if(n > 0)
+            return this->load_current();
+    }
+}
+
+bool BTreeCursor::prev_leaf(){
+    while(true){
+        Step &step = this->path.back();
+        NodeView x = this->tree->pin_node(step.ptr);
+        int link = x.valid() ? x.get_prev() : -1;
+        if(x.valid())
+            this->tree->unpin_node(step.ptr, false);
+
+        this->path.pop_back();
+        if(link == -1){
+            this->path.clear();
+            return false;
+        }
+        this->retreat_parents();
+
+        NodeView y = this->tree->pin_node(link);
+        if(!y.valid()){
+            this->path.clear();
+            return false;
+        }
+        int n = y.get_n();
+        this->tree->unpin_node(link, false);
+
+        this->path.push_back({link, n-1, n-1, n-1});
+        if(n > 0)
+            return this->load_current();
+    }
+}
+
+void BTreeCursor::advance_parents(){
+    size_t depth = this->path.size();
+
+    // Climb to the first step with a child left
+    while(!this->path.empty()){
+        Step &step = this->path.back();
+        NodeView x = this->tree->pin_node(step.ptr);
+        int n = x.valid() ? x.get_n() : 0;
+        if(x.valid())
+            this->tree->unpin_node(step.ptr, false);
+
+        if(step.idx < n){
+            step.idx++;
+            this->read_ahead(step);
+            break;
+        }
+        this->path.pop_back();
+    }
+
+    // Go back down to the parents of the leaves
+    while(!this->path.empty() && this->path.size() < depth){
+        Step &step = this->path.back();
+        NodeView x = this->tree->pin_node(step.ptr);
+        if(!x.valid()){
+            this->path.clear();
+            return;
+        }
+        int child = x.child(step.idx);
+        this->tree->unpin_node(step.ptr, false);
+
+        this->path.push_back({child, 0, 0, 0});
+        this->read_ahead(this->path.back());
+    }
+}
+
+void BTreeCursor::retreat_parents(){
+    size_t depth = this->path.size();
+
+    while(!this->path.empty()){
+        Step &step = this->path.back();
+        if(step.idx > 0){
+            step.idx--;
+            this->read_behind(step);
+            break;
+        }
+        this->path.pop_back();
+    }
+
+    while(!this->path.empty() && this->path.size() < depth){
+        Step &step = this->path.back();
+        NodeView x = this->tree->pin_node(step.ptr);
+        if(!x.valid()){
+            this->path.clear();
+            return;
+        }
+        int child = x.child(step.idx);
+        this->tree->unpin_node(step.ptr, false);
+
+        NodeView y = this->tree->pin_node(child);
+        if(!y.valid()){
+            this->path.clear();
+            return;
+        }
+        int n = y.get_n();
+        this->tree->unpin_node(child, false);
+
+        this->path.push_back({child, n, n, n});
+        this->read_behind(this->path.back());
+    }
+}
+
+bool BTreeCursor::load_current(){
+    Step &step = this->path.back();
+    NodeView x = this->tree->pin_node(step.ptr, false);
+    if(!x.valid()){
+        this->path.clear();
+        return false;
+    }
+
+    this->current = this->tree->node_key(x, step.idx);
+    this->tree->unpin_node(step.ptr, false);
+    return this->valid();
+}
+
+void BTreeCursor::read_ahead(Step &step){
+    // Hints are sent a window at a time, once half of it was consumed
+    if(step.ahead-step.idx > CURSOR_READAHEAD/2)
+        return;
+
+    NodeView x = this->tree->pin_node(step.ptr);
+    if(!x.valid())
+        return;
+
+    int last = std::min(step.idx+CURSOR_READAHEAD, x.get_n());
+    std::vector<int> pages;
+    for(int i = std::max(step.ahead, step.idx)+1; i <= last; i++)
+        pages.push_back(x.child(i));
+    this->tree->unpin_node(step.ptr, false);
+
+    step.ahead = last;
+    this->tree->pool->prefetch(pages);
+}
+
+void BTreeCursor::read_behind(Step &step){
+    if(step.idx-step.behind > CURSOR_READAHEAD/2)
+        return;
+
+    NodeView x = this->tree->pin_node(step.ptr);
+    if(!x.valid())
+        return;
+
+    int first = std::max(step.idx-CURSOR_READAHEAD, 0);
+    std::vector<int> pages;
+    for(int i = std::min(step.behind, step.idx)-1; i >= first; i--)
+        pages.push_back(x.child(i));
+    this->tree->unpin_node(step.ptr, false);
+
+    step.behind = first;
+    this->tree->pool->prefetch(pages);
+}
+
+// BTreeAsync definitions
+BTreeAsync::BTreeAsync(BTree* _tree, int depth){
+    this->tree = _tree;
+    this->io = make_async_io(_tree->storage, depth);
+    this->pending = 0;
+}
+
+BTreeAsync::~BTreeAsync(){
+    this->wait_all();
+    delete this->io;
+}
+
+void BTreeAsync::search(int key, std::function<void(int)> done){
+    this->start(new Operation{false, key, this->tree->root, done});
+}
+
+std::future<int> BTreeAsync::search(int key){
+    std::shared_ptr<std::promise<int>> promise = std::make_shared<std::promise<int>>();
+    this->search(key, [promise](int ptr){ promise->set_value(ptr); });
+    return promise->get_future();
+}
+
+void BTreeAsync::insert(int key, std::function<void()> done){
+    this->start(new Operation{true, key, this->tree->root, [done](int){ if(done) done(); }});
+}
+
+std::future<void> BTreeAsync::insert(int key){
+    std::shared_ptr<std::promise<void>> promise = std::make_shared<std::promise<void>>();
+    this->insert(key, [promise](){ promise->set_value(); });
+    return promise->get_future();
+}
+
+int BTreeAsync::poll(bool wait){
+    this->io->poll(wait && this->pending > 0);
+    return this->pending;
+}
+
+void BTreeAsync::wait_all(){
+    while(this->poll(true) > 0){}
+}
+
+const char* BTreeAsync::backend(){
+    return this->io->name();
+}
+
+void BTreeAsync::start(Operation* op){
+    this->pending++;
+    this->advance(op, false);
+}
+
+void BTreeAsync::advance(Operation* op, bool loaded){
+    while(op->ptr != -1){
+        // The operation goes on when the missing page arrives
+        if(!loaded && !this->tree->pool->resident(op->ptr)){
+            this->fetch(op);
+            return;
+        }
+        loaded = false;
+
+        // Only the routing of a single page is latched, the operation
+        // runs again from the root once its path is in the pool
+        std::shared_lock<std::shared_mutex> tree_lock(this->tree->tree_latch);
+        LatchScope scope(this->tree->latches, this->tree->latch_set(), LATCH_SHARED);
+        NodeView x = this->tree->pin_node(op->ptr);
+        if(!x.valid())
+            break;
+        int next_ptr = this->route(op, x);
+        this->tree->unpin_node(op->ptr, false);
+        op->ptr = next_ptr;
+    }
+
+    this->finish(op);
+}
+
+int BTreeAsync::route(Operation* op, NodeView &x){
+    int n = x.get_n();
+    if(n == 0)
+        return -1;
+
+    // Inserts go right of equal keys, like BTree::insert
+    if(op->insert)
+        return x.is_leaf() ? -1 : x.child(upper_bound_keys(x.keys(), n, op->key));
+
+    // Searches follow BTree::search
+    int i = x.find_key(op->key);
+    if(this->tree->layout == BPLUS_LAYOUT){
+        if(!x.is_leaf())
+            return x.child(i);
+        return i == n ? x.get_next() : -1;
+    }
+    if(x.is_leaf() || (i < n && x.key(i) == op->key))
+        return -1;
+    return x.child(i);
+}
+
+void BTreeAsync::fetch(Operation* op){
+    int page = op->ptr;
+    std::vector<Operation*> &ops = this->waiting[page];
+    ops.push_back(op);
+    if(ops.size() > 1)
+        return;
+
+    BTree* tree = this->tree;
+    char* data = alloc_aligned(tree->page_size);
+    long writes = tree->pool->get_writes();
+
+    this->io->read(tree->node_offset(page), data, tree->page_size, [this, tree, page, data, writes](int result){
+        // A page written back during the read may be newer on the file,
+        // then the operations read it again through the pool
+        if(result >= 0 && tree->pool->get_writes() == writes){
+            memset(data+result, 0, tree->page_size-result);
+            tree->pool->install(page, data);
+        }
+        free(data);
+
+        std::vector<Operation*> ops;
+        ops.swap(this->waiting[page]);
+        this->waiting.erase(page);
+        for(Operation* op : ops)
+            this->advance(op, true);
+    });
+}
+
+void BTreeAsync::finish(Operation* op){
+    int result = -1;
+    if(op->insert){
+        this->tree->insert(op->key);
+    }else{
+        result = this->tree->find(op->key);
+    }
+
+    this->pending--;
+    op->done(result);
+    delete op;
 }
@@ -0,0 +1,147 @@
+/* Page latches used by the file BTree.
+
+   Every node page has a reader/writer latch, created the first time the
+   page is latched. Searches take the latches shared and inserts take
+   them exclusive, going down the tree with lock coupling: the latch of a
+   child is taken before the latch of its parent is released.
+
+   A thread keeps its latches of a tree in a LatchSet, with the mode its
+   current operation latches pages in. Latching a page the thread already
+   holds only counts it, so an operation can pin the same page twice. */
+
+#ifndef B_TREE_LATCH_HH
+#define B_TREE_LATCH_HH
+
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Modes pages are latched in
+enum LatchMode
+{
+    LATCH_NONE,         // Pages are not latched, the caller owns the tree
+    LATCH_SHARED,       // Pages are latched for reading
+    LATCH_EXCLUSIVE     // Pages are latched for writing
+};
+
+// The latches a thread holds on the pages of a tree
+struct LatchSet
+{
+    int mode = LATCH_NONE;                      // LatchMode of the current operation
+    std::vector<std::pair<int, int>> held;      // (page, count) of the held latches
+};
+
+// The latches of the pages of a tree
+class PageLatches
+{
+    std::mutex mutex;                                                       // Guards the table
+    std::unordered_map<int, std::unique_ptr<std::shared_mutex>> latches;   // Latch of every page
+
+public:
+    // A function to latch page in the mode of set, waiting for the
+    // threads that hold it in a conflicting mode
+    void lock(LatchSet &set, int page);
+
+    // A function to release a latch of set on page. Pages that are not
+    // latched by set are ignored
+    void unlock(LatchSet &set, int page);
+
+    // A function to release every latch of set
+    void unlock_all(LatchSet &set);
+
+private:
+    // A function that returns the latch of page, creating it if needed
+    std::shared_mutex& latch(int page);
+};
+
+// A scope where a thread latches the pages of a tree in a given mode.
+// The latches still held at its end are released, unless the scope is
+// nested in another one
+class LatchScope
+{
+    PageLatches &latches;   // Latches of the tree
+    LatchSet &set;          // Latches of the thread
+    int previous;           // Mode of the enclosing scope
+
+public:
+    LatchScope(PageLatches &_latches, LatchSet &_set, int mode);    // Constructor
+
+    ~LatchScope();
+
+    LatchScope(const LatchScope&) = delete;
+    LatchScope& operator=(const LatchScope&) = delete;
+};
+
+// PageLatches definitions
+void PageLatches::lock(LatchSet &set, int page){
+    if(set.mode == LATCH_NONE)
+        return;
+
+    for(std::pair<int, int> &entry : set.held){
+        if(entry.first == page){
+            entry.second++;
+            return;
+        }
+    }
+
+    std::shared_mutex &l = this->latch(page);
+    if(set.mode == LATCH_EXCLUSIVE)
+        l.lock();
+    else
+        l.lock_shared();
+    set.held.push_back({page, 1});
+}
+
+void PageLatches::unlock(LatchSet &set, int page){
+    for(size_t i = 0; i < set.held.size(); i++){
+        if(set.held[i].first != page)
+            continue;
+
+        if(--set.held[i].second > 0)
+            return;
+
+        std::shared_mutex &l = this->latch(page);
+        if(set.mode == LATCH_EXCLUSIVE)
+            l.unlock();
+        else
+            l.unlock_shared();
+        set.held.erase(set.held.begin()+i);
+        return;
+    }
+}
+
+void PageLatches::unlock_all(LatchSet &set){
+    while(!set.held.empty()){
+        set.held.back().second = 1;
+        this->unlock(set, set.held.back().first);
+    }
+}
+
+std::shared_mutex& PageLatches::latch(int page){
+    // Latches are never removed, so the reference stays valid
+    std::lock_guard<std::mutex> lock(this->mutex);
+    std::unique_ptr<std::shared_mutex> &l = this->latches[page];
+    if(!l)
+        l.reset(new std::shared_mutex());
+    return *l;
+}
+
+// LatchScope definitions
+LatchScope::LatchScope(PageLatches &_latches, LatchSet &_set, int mode)
+    : latches(_latches), set(_set){
+    this->previous = _set.mode;
+    if(this->previous == LATCH_NONE)
+        _set.mode = mode;
+}
+
+LatchScope::~LatchScope(){
+    if(this->previous == LATCH_NONE){
+        this->latches.unlock_all(this->set);
+        this->set.mode = LATCH_NONE;
+    }
+}
+
+#endif
@@ -0,0 +1,205 @@
+/* An LSM style front end for the file BTree.
+
+   Writes go to a memtable, an in-memory BTree of b_tree_original.hh that
+   maps every key written to whether it was removed. Once the memtable
+   holds limit keys it is frozen, a new one takes the writes, and a
+   background thread merges the frozen one into the file tree in a single
+   ordered pass: the keys added are checked with one search_many and the
+   new ones go in with one insert_batch, then the removed keys are taken
+   out. A writer only waits for the disk when a memtable fills while the
+   previous one is still being merged.
+
+   A search looks at the active memtable, then at the frozen one, and
+   only then at the file tree, so the newest write of a key decides.
+
+   Keys are a set, like on the other write-optimized trees: inserting a
+   present key and removing a missing one change nothing. The file tree
+   must not be written by anything else while the front end is open. */
+
+#ifndef B_TREE_MEMTABLE_HH
+#define B_TREE_MEMTABLE_HH
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include "b_tree_file.hh"
+#include "b_tree_original.hh"
+
+// Minimum degree of the memtable
+#define MEMTABLE_DEGREE 32
+
+// Default number of keys of a memtable before it is frozen
+#define MEMTABLE_DEFAULT_LIMIT (1 << 16)
+
+// A file BTree behind memtables
+class MemtableBTree
+{
+    // Keys written, with true for the removed ones
+    typedef memory::BTree<int, MEMTABLE_DEGREE, bool> Memtable;
+
+    BTree* disk;                        // File tree the memtables are merged into
+    long limit;                         // Keys of a memtable before it is frozen
+    std::shared_ptr<Memtable> active;   // Memtable taking the writes
+    long active_keys;                   // Keys of the active memtable
+    std::shared_ptr<Memtable> frozen;   // Memtable being merged, nullptr if none
+    bool stopping;                      // Is true when the merge thread must end
+    std::shared_mutex latch;            // Shared by searches, exclusive for writes and swaps
+    std::condition_variable_any changed;    // Signaled when a memtable is frozen or merged
+    std::thread merger;                 // Merges the frozen memtables
+
+public:
+
+    // Constructor. The file tree must be open and stay alive while the
+    // front end is
+    MemtableBTree(BTree* _disk, long _limit = MEMTABLE_DEFAULT_LIMIT);
+
+    ~MemtableBTree();   // Destructor, merges every memtable left
+
+    MemtableBTree(const MemtableBTree&) = delete;
+    MemtableBTree& operator=(const MemtableBTree&) = delete;
+
+    // Functions to insert and remove key. They only change the active
+    // memtable, unless it fills while the previous one is being merged.
+    // Many threads can write at once
+    void insert(int key);
+    void remove(int key);
+
+    // A function to search key on the memtables and then on the file
+    // tree. Returns true if it is present. Many threads can search at
+    // once, along with the writers
+    bool search(int key);
+
+    // A function to merge every memtable into the file tree, and wait
+    // until it is done
+    void flush();
+
+private:
+    // A function to write key to the active memtable, freezing it once
+    // it is full
+    void put(int key, bool removed);
+
+    // A function to freeze the active memtable, waiting for the previous
+    // one to be merged first. The latch must be held
+    void freeze(std::unique_lock<std::shared_mutex> &lock);
+
+    // A function run by the merge thread
+    void merge_loop();
+
+    // A function to merge table into the file tree in key order
+    void merge(Memtable &table);
+};
+
+MemtableBTree::MemtableBTree(BTree* _disk, long _limit){
+    this->disk = _disk;
+    this->limit = (_limit < 1) ? 1 : _limit;
+    this->active = std::make_shared<Memtable>();
+    this->active_keys = 0;
+    this->stopping = false;
+    this->merger = std::thread(&MemtableBTree::merge_loop, this);
+}
+
+MemtableBTree::~MemtableBTree(){
+    this->flush();
+    {
+        std::lock_guard<std::shared_mutex> lock(this->latch);
+        this->stopping = true;
+    }
+    this->changed.notify_all();
+    this->merger.join();
+}
+
+void MemtableBTree::insert(int key){
+    this->put(key, false);
+}
+
+void MemtableBTree::remove(int key){
+    this->put(key, true);
+}
+
+void MemtableBTree::put(int key, bool removed){
+    std::unique_lock<std::shared_mutex> lock(this->latch);
+    if(this->active->put(key, removed))
+        this->active_keys++;
+    if(this->active_keys >= this->limit)
+        this->freeze(lock);
+}
+
+void MemtableBTree::freeze(std::unique_lock<std::shared_mutex> &lock){
+    // Only one memtable is merged at a time, writers stall behind it
+    this->changed.wait(lock, [this]{ return this->frozen == nullptr; });
+
+    this->frozen = this->active;
+    this->active = std::make_shared<Memtable>();
+    this->active_keys = 0;
+    this->changed.notify_all();
+}
+
+bool MemtableBTree::search(int key){
+    bool removed;
+    std::shared_ptr<Memtable> table;
+    {
+        std::shared_lock<std::shared_mutex> lock(this->latch);
+        if(this->active->get(key, removed))
+            return !removed;
+        table = this->frozen;
+    }
+
+    // The frozen memtable doesn't change, and it is only released after
+    // it is on the file tree
+    if(table != nullptr && table->get(key, removed))
+        return !removed;
+    return this->disk->find(key) != -1;
+}
+
+void MemtableBTree::flush(){
+    std::unique_lock<std::shared_mutex> lock(this->latch);
+    if(this->active_keys > 0)
+        this->freeze(lock);
+    this->changed.wait(lock, [this]{ return this->frozen == nullptr; });
+}
+
+void MemtableBTree::merge_loop(){
+    std::unique_lock<std::shared_mutex> lock(this->latch);
+    while(true){
+        this->changed.wait(lock, [this]{ return this->frozen != nullptr || this->stopping; });
+        if(this->frozen == nullptr)
+            return;
+
+        // Writers and searches go on while the memtable is merged
+        std::shared_ptr<Memtable> table = this->frozen;
+        lock.unlock();
+        this->merge(*table);
+        lock.lock();
+
+        this->frozen = nullptr;
+        this->changed.notify_all();
+    }
+}
+
+void MemtableBTree::merge(Memtable &table){
+    std::vector<int> added;
+    std::vector<int> removed;
+    table.for_each([&](const int &key, bool &gone){
+        (gone ? removed : added).push_back(key);
+    });
+
+    // Keys already on the file are not added again
+    if(!added.empty()){
+        std::vector<int> results;
+        this->disk->search_many(added, results);
+        std::vector<int> fresh;
+        for(size_t i = 0; i < added.size(); i++)
+            if(results[i] == -1)
+                fresh.push_back(added[i]);
+        this->disk->insert_batch(fresh);
+    }
+
+    for(int key : removed)
+        this->disk->remove(key);
+}
+
+#endif
@@ -0,0 +1,841 @@
+/* A concurrent in-memory BTree.
+
+   The tree follows the pointer based BTree of b_tree_original.hh: nodes
+   hold up to 2t-1 keys, inserts split full nodes on the way down, and
+   removes fill nodes with t-1 keys before entering them. Threads are
+   synchronized with optimistic lock coupling.
+
+   Every node has a version word with a lock bit and an obsolete bit.
+   Searches take no locks at all: they read a node, check that its
+   version didn't change meanwhile, and start over from the root when it
+   did. A child is only entered after its parent is validated again, so
+   a search never follows a pointer that was already replaced.
+
+   Writers go down the same way. They only lock a node once they are
+   about to change it, by turning the version they read into a lock, and
+   start over if it changed meanwhile. An insert locks the leaf it adds
+   to, or a full node and its parent to split them. A remove locks the
+   leaf it takes the key from, or a node with t-1 keys, its parent and
+   its siblings to fill it, or the inner node holding the key and the
+   leaf of its predecessor. Writers that fix a node start over after it,
+   and the nodes they locked but didn't change are unlocked with their
+   old version, so the searches that read them go on.
+
+   A node merged away may still be read by searches that reached it
+   before, so it is retired to an epoch manager and only deleted once
+   every operation that started before its removal is over. */
+
+#ifndef B_TREE_OLC_HH
+#define B_TREE_OLC_HH
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Number of operations that can be inside an epoch at the same time
+#ifndef OLC_EPOCH_SLOTS
+#define OLC_EPOCH_SLOTS 256
+#endif
+
+// Number of retired nodes that triggers a reclamation
+#ifndef OLC_RETIRE_BATCH
+#define OLC_RETIRE_BATCH 64
+#endif
+
+// Bits of the version word, the rest of it counts the changes
+#define OLC_OBSOLETE 1
+#define OLC_LOCKED 2
+
+// A function to back off while a node is locked
+inline void olc_pause(int &spins){
+    if(++spins % 64 == 0)
+        std::this_thread::yield();
+}
+
+// A concurrent BTree node. Fields are atomics so that optimistic reads
+// racing with a writer are well defined, they are read and written with
+// relaxed order and ordered by the version word
+class ConcurrentBTreeNode
+{
+    std::atomic<uint64_t> version;              // Change counter, lock and obsolete bits
+    std::atomic<int> *keys;                     // An array of keys
+    std::atomic<ConcurrentBTreeNode*> *C;       // An array of child pointers
+    std::atomic<int> n;                         // Current number of keys
+    int t;                                      // Minimum degree
+    bool leaf;                                  // Is true when node is leaf, never changes
+
+public:
+    ConcurrentBTreeNode(int _t, bool _leaf);    // Constructor
+
+    ~ConcurrentBTreeNode();
+
+    ConcurrentBTreeNode(const ConcurrentBTreeNode&) = delete;
+    ConcurrentBTreeNode& operator=(const ConcurrentBTreeNode&) = delete;
+
+    // A function to start an optimistic read. Waits while the node is
+    // locked, returns false if the node was removed from the tree
+    bool read_lock(uint64_t &v);
+
+    // A function to check that the node didn't change since read_lock
+    bool validate(uint64_t v);
+
+    // A function to lock the node for writing. Returns false if the
+    // node was removed from the tree
+    bool lock();
+
+    // A function to lock the node for writing if it didn't change since
+    // read_lock returned v. Never waits
+    bool upgrade(uint64_t v);
+
+    // Functions to unlock the node, publishing the changes. A node
+    // unlocked as obsolete stays locked for writers and makes readers
+    // start over
+    void unlock();
+    void unlock_obsolete();
+
+    // A function to unlock a node that wasn't changed, leaving the
+    // version readers validate against as it was
+    void unlock_unchanged();
+
+    // Access to the fields
+    int get_n() { return this->n.load(std::memory_order_relaxed); }
+    void set_n(int _n) { this->n.store(_n, std::memory_order_relaxed); }
+    int key(int i) { return this->keys[i].load(std::memory_order_relaxed); }
+    void set_key(int i, int k) { this->keys[i].store(k, std::memory_order_relaxed); }
+    ConcurrentBTreeNode* child(int i) { return this->C[i].load(std::memory_order_relaxed); }
+    void set_child(int i, ConcurrentBTreeNode* c) { this->C[i].store(c, std::memory_order_relaxed); }
+
+    // A function that returns the index of the first of the n first keys
+    // greater than or equal to k
+    int find_key(int k, int n);
+
+    // A function that returns the index of the first of the n first keys
+    // greater than k
+    int upper_key(int k, int n);
+
+    // A function to traverse all nodes in a subtree rooted with this node
+    void traverse();
+
+    friend class ConcurrentBTree;
+};
+
+// An epoch based reclamation of the nodes removed from a tree. Every
+// operation publishes the epoch it started in, and a node retired at
+// some epoch is deleted once every published epoch is newer
+class EpochManager
+{
+    // A published epoch, 0 when the slot is free. Slots are padded to a
+    // cache line so threads don't share them
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> epoch;
+    };
+
+    std::atomic<uint64_t> global;                                       // Current epoch
+    Slot slots[OLC_EPOCH_SLOTS];                                        // Epochs of the operations
+    std::mutex mutex;                                                   // Guards retired
+    std::vector<std::pair<uint64_t, ConcurrentBTreeNode*>> retired;     // Nodes and their epochs
+
+public:
+    EpochManager();                 // Constructor
+
+    ~EpochManager();                // Destructor, deletes every retired node
+
+    // A function to publish the epoch of an operation. Returns its slot
+    int enter();
+
+    // A function to end the operation of a slot
+    void exit(int slot);
+
+    // A function to retire a node that is no longer reachable
+    void retire(ConcurrentBTreeNode* node);
+
+private:
+    // A function to move to a new epoch and delete the retired nodes
+    // that no operation can reach. Called with the mutex held
+    void reclaim();
+};
+
+// A scope where the nodes seen by the calling thread are not deleted
+class EpochGuard
+{
+    EpochManager &epochs;   // Manager of the tree
+    int slot;               // Slot of the operation
+
+public:
+    EpochGuard(EpochManager &_epochs) : epochs(_epochs) { this->slot = _epochs.enter(); }
+
+    ~EpochGuard() { this->epochs.exit(this->slot); }
+
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+// A concurrent BTree. search, insert and remove can be called by any
+// number of threads at once
+class ConcurrentBTree
+{
+    std::atomic<ConcurrentBTreeNode*> root;     // Root node, an empty leaf when the tree is empty
+    int t;                                      // Minimum degree
+    EpochManager epochs;                        // Reclamation of the merged nodes
+
+public:
+    ConcurrentBTree(int _t);        // Constructor (Initializes tree as empty)
+
+    ~ConcurrentBTree();             // Destructor
+
+    // A function to print every key in order. It must not run along
+    // with writers
+    void traverse();
+
+    // A function to search a key in this tree. Nodes can be merged away
+    // as soon as the search returns, so only the presence is reported
+    bool search(int k);
+
+    // The main function that inserts a new key in this BTree
+    void insert(int k);
+
+    // The main function that removes a key from this BTree. Returns
+    // false if k is not present
+    bool remove(int k);
+
+private:
+    // A function to read the root optimistically. Returns nullptr if it
+    // must be read again
+    ConcurrentBTreeNode* read_root(uint64_t &v);
+
+    // A function to search once from the root. Returns 1 if k was found,
+    // 0 if it wasn't and -1 if the search must start over
+    int try_search(int k);
+
+    // A function to insert once from the root. Returns false if the
+    // insert must start over, which it does after every split
+    bool try_insert(int k);
+
+    // A function to split the full child y of the locked node p. i is
+    // the index of y in the child array of p, and y must be locked
+    void splitChild(ConcurrentBTreeNode* p, int i, ConcurrentBTreeNode* y);
+
+    // A function to remove once from the root. Returns 1 if k was
+    // removed, 0 if it is not present and -1 if the remove must start
+    // over, which it does after every node it fills
+    int try_remove(int k);
+
+    // A function to fill the child y of p at idx, which has t-1 keys,
+    // from its siblings. p and y were read at versions pv and yv, nothing
+    // is done if they changed since
+    void fill(ConcurrentBTreeNode* p, uint64_t pv, int idx, ConcurrentBTreeNode* y, uint64_t yv);
+
+    // Functions to move a key from the locked sibling w of the locked
+    // child y of x at idx
+    void borrowFromPrev(ConcurrentBTreeNode* x, int idx, ConcurrentBTreeNode* w, ConcurrentBTreeNode* y);
+    void borrowFromNext(ConcurrentBTreeNode* x, int idx, ConcurrentBTreeNode* y, ConcurrentBTreeNode* w);
+
+    // A function to merge the locked child z of x at idx+1 into the
+    // locked child y at idx. z is retired
+    void merge(ConcurrentBTreeNode* x, int idx, ConcurrentBTreeNode* y, ConcurrentBTreeNode* z);
+
+    // A function to unlock the changed node x. A root left without keys
+    // is replaced by its only child and retired
+    void release(ConcurrentBTreeNode* x);
+
+    // A function to delete the subtree rooted with node
+    void destroy(ConcurrentBTreeNode* node);
+};
+
+// ConcurrentBTreeNode definitions
+ConcurrentBTreeNode::ConcurrentBTreeNode(int _t, bool _leaf){
+    this->t = _t;
+    this->leaf = _leaf;
+    this->version.store(0, std::memory_order_relaxed);
+    this->n.store(0, std::memory_order_relaxed);
+
+    // Allocate memory for maximum number of possible keys and child
+    // pointers
+    this->keys = new std::atomic<int>[2*_t-1];
+    this->C = new std::atomic<ConcurrentBTreeNode*>[2*_t];
+    for(int i = 0; i < 2*_t-1; i++)
+        this->keys[i].store(0, std::memory_order_relaxed);
+    for(int i = 0; i < 2*_t; i++)
+        this->C[i].store(nullptr, std::memory_order_relaxed);
+}
+
+ConcurrentBTreeNode::~ConcurrentBTreeNode(){
+    delete[] this->keys;
+    delete[] this->C;
+}
+
+bool ConcurrentBTreeNode::read_lock(uint64_t &v){
+    int spins = 0;
+    v = this->version.load(std::memory_order_acquire);
+    while(v & OLC_LOCKED){
+        olc_pause(spins);
+        v = this->version.load(std::memory_order_acquire);
+    }
+    return (v & OLC_OBSOLETE) == 0;
+}
+
+bool ConcurrentBTreeNode::validate(uint64_t v){
+    // The reads of the fields must not move after the check
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return this->version.load(std::memory_order_relaxed) == v;
+}
+
+bool ConcurrentBTreeNode::lock(){
+    int spins = 0;
+    uint64_t v = this->version.load(std::memory_order_relaxed);
+    while(true){
+        if(v & OLC_OBSOLETE)
+            return false;
+        if(v & OLC_LOCKED){
+            olc_pause(spins);
+            v = this->version.load(std::memory_order_relaxed);
+            continue;
+        }
+        if(this->version.compare_exchange_weak(v, v+OLC_LOCKED, std::memory_order_acquire))
+            break;
+    }
+
+    // A reader that sees a change must also see the lock
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+}
+
+bool ConcurrentBTreeNode::upgrade(uint64_t v){
+    if(!this->version.compare_exchange_strong(v, v+OLC_LOCKED, std::memory_order_acquire))
+        return false;
+
+    // A reader that sees a change must also see the lock
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+}
+
+void ConcurrentBTreeNode::unlock(){
+    // Clears the lock bit and counts the change
+    this->version.fetch_add(OLC_LOCKED, std::memory_order_release);
+}
+
+void ConcurrentBTreeNode::unlock_obsolete(){
+    this->version.fetch_add(OLC_LOCKED+OLC_OBSOLETE, std::memory_order_release);
+}
+
+void ConcurrentBTreeNode::unlock_unchanged(){
+    // Readers wait while the lock bit is set, so none of them read the
+    // node under the lock, and the old version is still right for them
+    this->version.fetch_sub(OLC_LOCKED, std::memory_order_release);
+}
+
+int ConcurrentBTreeNode::find_key(int k, int n){
+    int lo = 0, hi = n;
+    while(lo < hi){
+        int mid = (lo+hi)/2;
+        if(this->key(mid) < k)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int ConcurrentBTreeNode::upper_key(int k, int n){
+    int lo = 0, hi = n;
+    while(lo < hi){
+        int mid = (lo+hi)/2;
+        if(this->key(mid) <= k)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void ConcurrentBTreeNode::traverse(){
+    // There are n keys and n+1 children, travers through n keys
+    // and first n children
+    int i, n = this->get_n();
+    for (i = 0; i < n; i++){
+        if (!this->leaf)
+            this->child(i)->traverse();
+        std::cout << " " << this->key(i);
+    }
+
+    // Print the subtree rooted with last child
+    if (!this->leaf)
+        this->child(i)->traverse();
+}
+
+// EpochManager definitions
+EpochManager::EpochManager(){
+    this->global.store(1);
+    for(Slot &slot : this->slots)
+        slot.epoch.store(0);
+}
+
+EpochManager::~EpochManager(){
+    for(std::pair<uint64_t, ConcurrentBTreeNode*> &r : this->retired)
+        delete r.second;
+}
+
+int EpochManager::enter(){
+    // Threads keep coming back to the slot they used last
+    static thread_local int hint =
+        std::hash<std::thread::id>()(std::this_thread::get_id()) % OLC_EPOCH_SLOTS;
+
+    for(int i = 0; ; i++){
+        int s = (hint+i) % OLC_EPOCH_SLOTS;
+        uint64_t expected = 0;
+        if(this->slots[s].epoch.compare_exchange_strong(expected, this->global.load())){
+            hint = s;
+            return s;
+        }
+        if(i % OLC_EPOCH_SLOTS == OLC_EPOCH_SLOTS-1)
+            std::this_thread::yield();
+    }
+}
+
+void EpochManager::exit(int slot){
+    this->slots[slot].epoch.store(0, std::memory_order_release);
+}
+
+void EpochManager::retire(ConcurrentBTreeNode* node){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->retired.push_back({this->global.load(), node});
+    if(this->retired.size() >= OLC_RETIRE_BATCH)
+        this->reclaim();
+}
+
+void EpochManager::reclaim(){
+    // Operations that start from now on can't reach the retired nodes
+    this->global.fetch_add(1);
+
+    uint64_t oldest = UINT64_MAX;
+    for(Slot &slot : this->slots){
+        uint64_t e = slot.epoch.load();
+        if(e != 0 && e < oldest)
+            oldest = e;
+    }
+
+    // A node retired before the oldest running operation started is gone
+    size_t kept = 0;
+    for(size_t i = 0; i < this->retired.size(); i++){
+        if(this->retired[i].first < oldest)
+            delete this->retired[i].second;
+        else
+            this->retired[kept++] = this->retired[i];
+    }
+    this->retired.resize(kept);
+}
+
+// ConcurrentBTree definitions
+ConcurrentBTree::ConcurrentBTree(int _t){
+    this->t = _t;
+    this->root.store(new ConcurrentBTreeNode(_t, true));
+}
+
+ConcurrentBTree::~ConcurrentBTree(){
+    this->destroy(this->root.load());
+}
+
+void ConcurrentBTree::destroy(ConcurrentBTreeNode* node){
+    if(!node->leaf)
+        for(int i = 0; i <= node->get_n(); i++)
+            this->destroy(node->child(i));
+    delete node;
+}
+
+void ConcurrentBTree::traverse(){
+    this->root.load()->traverse();
+}
+
+bool ConcurrentBTree::search(int k){
+    EpochGuard guard(this->epochs);
+    while(true){
+        int found = this->try_search(k);
+        if(found >= 0)
+            return found == 1;
+    }
+}
+
+ConcurrentBTreeNode* ConcurrentBTree::read_root(uint64_t &v){
+    // The root only changes while it is locked, so it is still the root
+    // as long as its version holds
+    ConcurrentBTreeNode* x = this->root.load(std::memory_order_acquire);
+    if(!x->read_lock(v) || this->root.load(std::memory_order_acquire) != x)
+        return nullptr;
+    return x;
+}
+
+int ConcurrentBTree::try_search(int k){
+    uint64_t v;
+    ConcurrentBTreeNode* x = this->read_root(v);
+    if(x == nullptr)
+        return -1;
+
+    int max_keys = 2*this->t-1;
+    while(true){
+        // A count read during a change is only bounded, the validation
+        // discards whatever it leads to
+        int n = x->get_n();
+        if(n < 0 || n > max_keys)
+            return -1;
+
+        // Find the first key greater than or equal to k
+        int i = x->find_key(k, n);
+        bool found = (i < n && x->key(i) == k);
+        if(found || x->leaf)
+            return x->validate(v) ? found : -1;
+
+        // The child is only entered if the parent still points to it
+        ConcurrentBTreeNode* y = x->child(i);
+        if(!x->validate(v))
+            return -1;
+
+        uint64_t yv;
+        if(!y->read_lock(yv) || !x->validate(v))
+            return -1;
+        x = y;
+        v = yv;
+    }
+}
+
+void ConcurrentBTree::insert(int k){
+    EpochGuard guard(this->epochs);
+    while(!this->try_insert(k));
+}
+
+bool ConcurrentBTree::try_insert(int k){
+    uint64_t v;
+    ConcurrentBTreeNode* x = this->read_root(v);
+    if(x == nullptr)
+        return false;
+
+    // Parent of x, its version and the index of x in it
+    ConcurrentBTreeNode* p = nullptr;
+    uint64_t pv = 0;
+    int pi = 0;
+
+    int max_keys = 2*this->t-1;
+    while(true){
+        int n = x->get_n();
+        if(n < 0 || n > max_keys)
+            return false;
+
+        // Full nodes are split on the way down, so the parent of a split
+        // always has room. Only the two nodes are locked
+        if(n == max_keys){
+            if(p != nullptr && !p->upgrade(pv))
+                return false;
+            if(!x->upgrade(v)){
+                if(p != nullptr)
+                    p->unlock_unchanged();
+                return false;
+            }
+
+            if(p == nullptr){
+                // The root grows a level. The new root is only reachable
+                // once it is complete
+                ConcurrentBTreeNode* s = new ConcurrentBTreeNode(this->t, false);
+                s->set_child(0, x);
+                this->splitChild(s, 0, x);
+                this->root.store(s, std::memory_order_release);
+            }else{
+                this->splitChild(p, pi, x);
+                p->unlock();
+            }
+            x->unlock();
+            return false;
+        }
+
+        // Move all greater keys to one place ahead and insert the new key
+        if(x->leaf){
+            if(!x->upgrade(v))
+                return false;
+            int i = x->upper_key(k, n);
+            for(int j = n-1; j >= i; j--)
+                x->set_key(j+1, x->key(j));
+            x->set_key(i, k);
+            x->set_n(n+1);
+            x->unlock();
+            return true;
+        }
+
+        // Find the child which is going to have the new key, after every
+        // key lower or equal to k
+        int i = x->upper_key(k, n);
+        ConcurrentBTreeNode* y = x->child(i);
+        if(!x->validate(v))
+            return false;
+
+        uint64_t yv;
+        if(!y->read_lock(yv) || !x->validate(v))
+            return false;
+        p = x;
+        pv = v;
+        pi = i;
+        x = y;
+        v = yv;
+    }
+}
+
+void ConcurrentBTree::splitChild(ConcurrentBTreeNode* p, int i, ConcurrentBTreeNode* y){
+    int t = this->t;
+
+    // Create a new node which is going to store (t-1) keys of y. Nobody
+    // can reach it before p is unlocked
+    ConcurrentBTreeNode* z = new ConcurrentBTreeNode(t, y->leaf);
+    z->set_n(t-1);
+
+    // Copy the last (t-1) keys and the last t children of y to z
+    for(int j = 0; j < t-1; j++)
+        z->set_key(j, y->key(j+t));
+    if(!y->leaf)
+        for(int j = 0; j < t; j++)
+            z->set_child(j, y->child(j+t));
+
+    // Reduce the number of keys in y
+    y->set_n(t-1);
+
+    // Link the new child to p, after y, and move the middle key of y up
+    int n = p->get_n();
+    for(int j = n; j >= i+1; j--)
+        p->set_child(j+1, p->child(j));
+    p->set_child(i+1, z);
+    for(int j = n-1; j >= i; j--)
+        p->set_key(j+1, p->key(j));
+    p->set_key(i, y->key(t-1));
+    p->set_n(n+1);
+}
+
+bool ConcurrentBTree::remove(int k){
+    EpochGuard guard(this->epochs);
+    while(true){
+        int removed = this->try_remove(k);
+        if(removed >= 0)
+            return removed == 1;
+    }
+}
+
+int ConcurrentBTree::try_remove(int k){
+    int t = this->t;
+    uint64_t v;
+    ConcurrentBTreeNode* x = this->read_root(v);
+    if(x == nullptr)
+        return -1;
+
+    // Parent of x, its version and the index of x in it
+    ConcurrentBTreeNode* p = nullptr;
+    uint64_t pv = 0;
+    int pi = 0;
+
+    // Inner node holding k, its version and the index of k. Once it is
+    // found the descent follows the largest keys under it, down to the
+    // leaf of the predecessor of k
+    ConcurrentBTreeNode* owner = nullptr;
+    uint64_t ov = 0;
+    int oi = 0;
+
+    int max_keys = 2*t-1;
+    while(true){
+        int n = x->get_n();
+        if(n < 0 || n > max_keys)
+            return -1;
+
+        // Every node entered below the root keeps at least t keys, so a
+        // leaf can give one away. One with t-1 is filled first
+        if(p != nullptr && n < t){
+            this->fill(p, pv, pi, x, v);
+            return -1;
+        }
+
+        int i;
+        if(owner == nullptr){
+            i = x->find_key(k, n);
+            bool here = (i < n && x->key(i) == k);
+
+            // If the key is on this leaf, remove it
+            if(x->leaf){
+                if(!here)
+                    return x->validate(v) ? 0 : -1;
+                if(!x->upgrade(v))
+                    return -1;
+                for(int j = i+1; j < n; j++)
+                    x->set_key(j-1, x->key(j));
+                x->set_n(n-1);
+                x->unlock();
+                return 1;
+            }
+
+            // The key of an inner node is replaced by its predecessor
+            if(here){
+                owner = x;
+                ov = v;
+                oi = i;
+            }
+        }else{
+            // The predecessor is the last key of the leaf. Neither node
+            // changed since they were read, so it still is
+            if(x->leaf){
+                if(!owner->upgrade(ov))
+                    return -1;
+                if(!x->upgrade(v)){
+                    owner->unlock_unchanged();
+                    return -1;
+                }
+                owner->set_key(oi, x->key(n-1));
+                x->set_n(n-1);
+                x->unlock();
+                owner->unlock();
+                return 1;
+            }
+            i = n;
+        }
+
+        // The child is only entered if the parent still points to it
+        ConcurrentBTreeNode* y = x->child(i);
+        if(!x->validate(v))
+            return -1;
+
+        uint64_t yv;
+        if(!y->read_lock(yv) || !x->validate(v))
+            return -1;
+        p = x;
+        pv = v;
+        pi = i;
+        x = y;
+        v = yv;
+    }
+}
+
+void ConcurrentBTree::fill(ConcurrentBTreeNode* p, uint64_t pv, int idx, ConcurrentBTreeNode* y, uint64_t yv){
+    if(!p->upgrade(pv))
+        return;
+    if(!y->upgrade(yv)){
+        p->unlock_unchanged();
+        return;
+    }
+
+    // Siblings are only locked by writers that hold p or by a remove
+    // from a leaf, which holds nothing else, so waiting for them can't
+    // deadlock
+    int n = p->get_n();
+    ConcurrentBTreeNode* w = nullptr;
+    if(idx != 0){
+        // If the previous child has more than t-1 keys, borrow a key from it
+        w = p->child(idx-1);
+        w->lock();
+        if(w->get_n() >= this->t){
+            this->borrowFromPrev(p, idx, w, y);
+            w->unlock();
+            y->unlock();
+            p->unlock();
+            return;
+        }
+    }
+
+    if(idx != n){
+        // Otherwise borrow from the next child, or merge with it
+        ConcurrentBTreeNode* z = p->child(idx+1);
+        z->lock();
+        if(z->get_n() >= this->t){
+            this->borrowFromNext(p, idx, y, z);
+            z->unlock();
+        }else{
+            this->merge(p, idx, y, z);
+        }
+        if(w != nullptr)
+            w->unlock_unchanged();
+        y->unlock();
+    }else{
+        // The last child is merged into its previous sibling
+        this->merge(p, idx-1, w, y);
+        w->unlock();
+    }
+    this->release(p);
+}
+
+void ConcurrentBTree::borrowFromPrev(ConcurrentBTreeNode* x, int idx, ConcurrentBTreeNode* w, ConcurrentBTreeNode* y){
+    int yn = y->get_n();
+    int wn = w->get_n();
+
+    // The last key of w goes up to x and the key of x goes down as the
+    // first key of y, with the last child of w
+    for(int i = yn-1; i >= 0; i--)
+        y->set_key(i+1, y->key(i));
+    if(!y->leaf){
+        for(int i = yn; i >= 0; i--)
+            y->set_child(i+1, y->child(i));
+        y->set_child(0, w->child(wn));
+    }
+    y->set_key(0, x->key(idx-1));
+    x->set_key(idx-1, w->key(wn-1));
+
+    y->set_n(yn+1);
+    w->set_n(wn-1);
+}
+
+void ConcurrentBTree::borrowFromNext(ConcurrentBTreeNode* x, int idx, ConcurrentBTreeNode* y, ConcurrentBTreeNode* w){
+    int yn = y->get_n();
+    int wn = w->get_n();
+
+    // The key of x goes down as the last key of y, with the first child
+    // of w, and the first key of w goes up to x
+    y->set_key(yn, x->key(idx));
+    if(!y->leaf)
+        y->set_child(yn+1, w->child(0));
+    x->set_key(idx, w->key(0));
+
+    for(int i = 1; i < wn; i++)
+        w->set_key(i-1, w->key(i));
+    if(!w->leaf)
+        for(int i = 1; i <= wn; i++)
+            w->set_child(i-1, w->child(i));
+
+    y->set_n(yn+1);
+    w->set_n(wn-1);
+}
+
+void ConcurrentBTree::merge(ConcurrentBTreeNode* x, int idx, ConcurrentBTreeNode* y, ConcurrentBTreeNode* z){
+    int t = this->t;
+    int n = x->get_n();
+    int zn = z->get_n();
+
+    // Pull the key of x down into y, followed by the keys and the
+    // children of z
+    y->set_key(t-1, x->key(idx));
+    for(int i = 0; i < zn; i++)
+        y->set_key(i+t, z->key(i));
+    if(!y->leaf)
+        for(int i = 0; i <= zn; i++)
+            y->set_child(i+t, z->child(i));
+
+    // Close the gap left on x
+    for(int i = idx+1; i < n; i++)
+        x->set_key(i-1, x->key(i));
+    for(int i = idx+2; i <= n; i++)
+        x->set_child(i-1, x->child(i));
+
+    y->set_n(y->get_n()+zn+1);
+    x->set_n(n-1);
+
+    // Searches still on z start over, it is deleted once they are done
+    z->unlock_obsolete();
+    this->epochs.retire(z);
+}
+
+void ConcurrentBTree::release(ConcurrentBTreeNode* x){
+    // The root only changes while it is locked, so the check is stable
+    if(x->get_n() == 0 && this->root.load(std::memory_order_relaxed) == x){
+        this->root.store(x->child(0), std::memory_order_release);
+        x->unlock_obsolete();
+        this->epochs.retire(x);
+        return;
+    }
+    x->unlock();
+}
+
+#endif
@@ -30,45 +30,155 @@
   Reference: CLRS3 - Chapter 18 - (499-502)
   It is advised to read the material in CLRS before taking a look at the code. */
 
+/* Node layout: the tree is a template over the key type and the minimum
+   degree, so the key and child arrays are sized at compile time and kept
+   inline, aligned to a cache line, in a single allocation per node. Leaves
+   are BTreeNode objects, which only have keys, and internal nodes are
+   BTreeInternal objects, which add the child pointers. Nodes take their
+   memory from an allocator owned by the tree, a NodeArena unless another
+   one is given (see b_tree_arena.hh).
+
+   Keys are ordered by Compare, which must be default constructible, and
+   every key carries a Value, stored next to the keys in the same node.
+   Trees of keys alone use NoValue, which takes no room.
+
+   The tree lives in namespace memory, so it can be used along with the
+   file BTree of b_tree_file.hh, which has the same name. */
+
+#ifndef B_TREE_ORIGINAL_HH
+#define B_TREE_ORIGINAL_HH
+
+#include <algorithm>
+#include <functional>
 #include <iostream>
+#include <type_traits>
+#include "b_tree_arena.hh"
+#include "b_tree_simd.hh"
 using namespace std;
 
-// A BTree node
-class BTreeNode
+namespace memory
+{
+
+// A function that returns the index of the first key greater than or
+// equal to k in a sorted array of n keys
+template <typename Key, typename Compare>
+static inline int lower_bound_node(const Key* keys, int n, const Key &k, Compare comp)
+{
+    return (int)(std::lower_bound(keys, keys+n, k, comp) - keys);
+}
+
+// int keys in their natural order use the SIMD kernels
+static inline int lower_bound_node(const int* keys, int n, int k, std::less<int>)
+{
+    return lower_bound_keys(keys, n, k);
+}
+
+// A function that returns the index of the first key greater than k in
+// a sorted array of n keys
+template <typename Key, typename Compare>
+static inline int upper_bound_node(const Key* keys, int n, const Key &k, Compare comp)
+{
+    return (int)(std::upper_bound(keys, keys+n, k, comp) - keys);
+}
+
+static inline int upper_bound_node(const int* keys, int n, int k, std::less<int>)
 {
-    int *keys;  // An array of keys
-    int t;      // Minimum degree (defines the range for number of keys)
-    BTreeNode **C; // An array of child pointers
+    return upper_bound_keys(keys, n, k);
+}
+
+// The value of a tree that only has keys
+struct NoValue {};
+
+// The values of a node, one per key slot
+template <typename Value, int N>
+struct NodeValues
+{
+    Value values[N];
+
+    Value &operator[](int i) { return values[i]; }
+};
+
+// A tree without values keeps no array, every slot is the same empty value
+template <int N>
+struct NodeValues<NoValue, N>
+{
+    NoValue &operator[](int) { static NoValue none; return none; }
+};
+
+template <typename Key, int Degree, typename Value = NoValue, typename Compare = std::less<Key>,
+          typename Allocator = NodeArena> class BTree;
+template <typename Key, int Degree, typename Value = NoValue, typename Compare = std::less<Key>,
+          typename Allocator = NodeArena> class BTreeInternal;
+
+// A BTree node. Leaves are allocated as this type
+template <typename Key, int Degree, typename Value = NoValue, typename Compare = std::less<Key>,
+          typename Allocator = NodeArena>
+class alignas(NODE_ALIGNMENT) BTreeNode
+{
+protected:
+    Key keys[2*Degree-1];  // An array of keys
     int n;     // Current number of keys
     bool leaf; // Is true when node is leaf. Otherwise false
- 
+    NodeValues<Value, 2*Degree-1> values;  // The value of every key
+
+    BTreeNode(bool _leaf);   // Constructor
+
 public:
- 
-    BTreeNode(int _t, bool _leaf);   // Constructor
- 
+
+    static_assert(Degree >= 2, "a BTree needs a minimum degree of at least 2");
+
+    // A function to allocate a node of the right type from alloc
+    static BTreeNode *create(Allocator &alloc, bool leaf);
+
+    // A function to free a node allocated by create
+    static void destroy(Allocator &alloc, BTreeNode *node);
+
+    // A function to free every node in the subtree rooted with node
+    static void destroyTree(Allocator &alloc, BTreeNode *node);
+
+    BTreeNode(const BTreeNode&) = delete;
+    BTreeNode& operator=(const BTreeNode&) = delete;
+
+    // A function that returns the i-th child pointer. The node must not
+    // be a leaf
+    BTreeNode *&child(int i);
+
     // A function to traverse all nodes in a subtree rooted with this node
     void traverse();
+
+    // A function to call visit with every key of the subtree rooted with
+    // this node and its value, in order
+    template <typename Visit>
+    void for_each(Visit &visit);
  
     // A function to search a key in subtree rooted with this node.
-    BTreeNode *search(int k);   // returns NULL if k is not present.
+    BTreeNode *search(const Key &k);   // returns NULL if k is not present.
+
+    // A function that returns the value of key k in the subtree rooted
+    // with this node, or NULL if k is not present
+    Value *lookup(const Key &k);
+
+    // Functions to compare keys in the order of the tree
+    static bool less(const Key &a, const Key &b) { return Compare()(a, b); }
+    static bool equal(const Key &a, const Key &b) { return !less(a, b) && !less(b, a); }
  
     // A function that returns the index of the first key that is greater
     // or equal to k
-    int findKey(int k);
+    int findKey(const Key &k);
  
     // A utility function to insert a new key in the subtree rooted with
     // this node. The assumption is, the node must be non-full when this
     // function is called
-    void insertNonFull(int k);
+    void insertNonFull(Allocator &alloc, const Key &k, const Value &value);
  
     // A utility function to split the child y of this node. i is index
     // of y in child array C[].  The Child y must be full when this
     // function is called
-    void splitChild(int i, BTreeNode *y);
+    void splitChild(Allocator &alloc, int i, BTreeNode *y);
  
     // A wrapper function to remove the key k in subtree rooted with
     // this node.
-    void remove(int k);
+    void remove(Allocator &alloc, const Key &k);
  
     // A function to remove the key present in idx-th position in
     // this node which is a leaf
@@ -76,19 +186,19 @@ public:
  
     // A function to remove the key present in idx-th position in
     // this node which is a non-leaf node
-    void removeFromNonLeaf(int idx);
+    void removeFromNonLeaf(Allocator &alloc, int idx);
  
     // A function to get the predecessor of the key- where the key
-    // is present in the idx-th position in the node
-    int getPred(int idx);
+    // is present in the idx-th position in the node, and its value
+    Key getPred(int idx, Value &value);
  
     // A function to get the successor of the key- where the key
-    // is present in the idx-th position in the node
-    int getSucc(int idx);
+    // is present in the idx-th position in the node, and its value
+    Key getSucc(int idx, Value &value);
  
     // A function to fill up the child node present in the idx-th
     // position in the C[] array if that child has less than t-1 keys
-    void fill(int idx);
+    void fill(Allocator &alloc, int idx);
  
     // A function to borrow a key from the C[idx-1]-th node and place
     // it in C[idx]th node
@@ -100,77 +210,184 @@ public:
  
     // A function to merge idx-th child of the node with (idx+1)th child of
     // the node
-    void merge(int idx);
+    void merge(Allocator &alloc, int idx);
  
     // Make BTree friend of this so that we can access private members of
     // this class in BTree functions
-    friend class BTree;
+    friend class BTree<Key, Degree, Value, Compare, Allocator>;
+};
+
+// An internal BTree node, a node with child pointers
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+class alignas(NODE_ALIGNMENT) BTreeInternal : public BTreeNode<Key, Degree, Value, Compare, Allocator>
+{
+    BTreeNode<Key, Degree, Value, Compare, Allocator> *C[2*Degree]; // An array of child pointers
+
+    BTreeInternal() : BTreeNode<Key, Degree, Value, Compare, Allocator>(false) {}   // Constructor
+
+    friend class BTreeNode<Key, Degree, Value, Compare, Allocator>;
 };
  
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
 class BTree
 {
-    BTreeNode *root; // Pointer to root node
-    int t;  // Minimum degree
+    typedef BTreeNode<Key, Degree, Value, Compare, Allocator> Node;
+
+    Node *root; // Pointer to root node
+    static const int t = Degree;  // Minimum degree
+    Allocator alloc;  // Memory of the nodes
 public:
  
     // Constructor (Initializes tree as empty)
-    BTree(int _t)
+    BTree()
     {
         root = NULL;
-        t = _t;
     }
+
+    // Destructor, frees every node. When the allocator releases its
+    // nodes by itself, they are only visited if keys or values need
+    // destruction
+    ~BTree()
+    {
+        if (root != NULL &&
+            (!Allocator::owns_nodes || !std::is_trivially_destructible<Key>::value ||
+             !std::is_trivially_destructible<Value>::value))
+            Node::destroyTree(alloc, root);
+    }
+
+    BTree(const BTree&) = delete;
+    BTree& operator=(const BTree&) = delete;
  
     void traverse()
     {
         if (root != NULL) root->traverse();
     }
+
+    // A function to call visit(key, value) with every key, in order
+    template <typename Visit>
+    void for_each(Visit visit)
+    {
+        if (root != NULL) root->for_each(visit);
+    }
  
     // function to search a key in this tree
-    BTreeNode* search(int k)
+    Node* search(const Key &k)
     {
         return (root == NULL)? NULL : root->search(k);
     }
+
+    // A function to get the value of key k. Returns false if k is not
+    // present
+    bool get(const Key &k, Value &value)
+    {
+        Value *found = (root == NULL)? NULL : root->lookup(k);
+        if (found == NULL)
+            return false;
+        value = *found;
+        return true;
+    }
+
+    // A function to set the value of key k, adding k if it is not
+    // present. Returns true if k was added
+    bool put(const Key &k, const Value &value)
+    {
+        return upsert(k, value, [&value](Value &old) { old = value; });
+    }
+
+    // A function to change the value of key k in place with update, or
+    // to add k with value if it is not present. Returns true if k was
+    // added
+    template <typename Update>
+    bool upsert(const Key &k, const Value &value, Update update)
+    {
+        Value *found = (root == NULL)? NULL : root->lookup(k);
+        if (found != NULL)
+        {
+            update(*found);
+            return false;
+        }
+        insert(k, value);
+        return true;
+    }
  
-    // The main function that inserts a new key in this B-Tree
-    void insert(int k);
+    // The main function that inserts a new key in this B-Tree. Equal
+    // keys are kept side by side
+    void insert(const Key &k, const Value &value = Value());
  
     // The main function that removes a new key in thie B-Tree
-    void remove(int k);
+    void remove(const Key &k);
  
 };
  
-BTreeNode::BTreeNode(int t1, bool leaf1)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+BTreeNode<Key, Degree, Value, Compare, Allocator>::BTreeNode(bool leaf1)
 {
-    // Copy the given minimum degree and leaf property
-    t = t1;
+    // Copy the leaf property
     leaf = leaf1;
  
-    // Allocate memory for maximum number of possible keys
-    // and child pointers
-    keys = new int[2*t-1];
-    C = new BTreeNode *[2*t];
- 
     // Initialize the number of keys as 0
     n = 0;
 }
+
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+BTreeNode<Key, Degree, Value, Compare, Allocator> *BTreeNode<Key, Degree, Value, Compare, Allocator>::create(Allocator &alloc, bool leaf)
+{
+    // Only internal nodes carry the child pointers
+    if (leaf)
+        return new (alloc.allocate(sizeof(BTreeNode))) BTreeNode(true);
+    typedef BTreeInternal<Key, Degree, Value, Compare, Allocator> Internal;
+    return new (alloc.allocate(sizeof(Internal))) Internal();
+}
+
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+void BTreeNode<Key, Degree, Value, Compare, Allocator>::destroy(Allocator &alloc, BTreeNode *node)
+{
+    typedef BTreeInternal<Key, Degree, Value, Compare, Allocator> Internal;
+    if (node->leaf)
+    {
+        node->~BTreeNode();
+        alloc.deallocate(node, sizeof(BTreeNode));
+    }
+    else
+    {
+        Internal *internal = static_cast<Internal*>(node);
+        internal->~Internal();
+        alloc.deallocate(internal, sizeof(Internal));
+    }
+}
+
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+void BTreeNode<Key, Degree, Value, Compare, Allocator>::destroyTree(Allocator &alloc, BTreeNode *node)
+{
+    if (!node->leaf)
+        for (int i = 0; i <= node->n; i++)
+            destroyTree(alloc, node->child(i));
+    destroy(alloc, node);
+}
+
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+BTreeNode<Key, Degree, Value, Compare, Allocator> *&BTreeNode<Key, Degree, Value, Compare, Allocator>::child(int i)
+{
+    return static_cast<BTreeInternal<Key, Degree, Value, Compare, Allocator>*>(this)->C[i];
+}
  
 // A utility function that returns the index of the first key that is
 // greater than or equal to k
-int BTreeNode::findKey(int k)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+int BTreeNode<Key, Degree, Value, Compare, Allocator>::findKey(const Key &k)
 {
-    int idx=0;
-    while (idx<n && keys[idx] < k)
-        ++idx;
-    return idx;
+    return lower_bound_node(keys, n, k, Compare());
 }
  
 // A function to remove the key k from the sub-tree rooted with this node
-void BTreeNode::remove(int k)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+void BTreeNode<Key, Degree, Value, Compare, Allocator>::remove(Allocator &alloc, const Key &k)
 {
+    const int t = Degree;
     int idx = findKey(k);
  
     // The key to be removed is present in this node
-    if (idx < n && keys[idx] == k)
+    if (idx < n && equal(keys[idx], k))
     {
  
         // If the node is a leaf node - removeFromLeaf is called
@@ -178,7 +395,7 @@ void BTreeNode::remove(int k)
         if (leaf)
             removeFromLeaf(idx);
         else
-            removeFromNonLeaf(idx);
+            removeFromNonLeaf(alloc, idx);
     }
     else
     {
@@ -197,27 +414,31 @@ void BTreeNode::remove(int k)
  
         // If the child where the key is supposed to exist has less that t keys,
         // we fill that child
-        if (C[idx]->n < t)
-            fill(idx);
+        if (child(idx)->n < t)
+            fill(alloc, idx);
  
         // If the last child has been merged, it must have merged with the previous
         // child and so we recurse on the (idx-1)th child. Else, we recurse on the
         // (idx)th child which now has atleast t keys
         if (flag && idx > n)
-            C[idx-1]->remove(k);
+            child(idx-1)->remove(alloc, k);
         else
-            C[idx]->remove(k);
+            child(idx)->remove(alloc, k);
     }
     return;
 }
  
 // A function to remove the idx-th key from this node - which is a leaf node
-void BTreeNode::removeFromLeaf (int idx)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+void BTreeNode<Key, Degree, Value, Compare, Allocator>::removeFromLeaf (int idx)
 {
  
     // Move all the keys after the idx-th pos one place backward
     for (int i=idx+1; i<n; ++i)
+    {
         keys[i-1] = keys[i];
+        values[i-1] = values[i];
+    }
  
     // Reduce the count of keys
     n--;
@@ -226,20 +447,21 @@ void BTreeNode::removeFromLeaf (int idx)
 }
  
 // A function to remove the idx-th key from this node - which is a non-leaf node
-void BTreeNode::removeFromNonLeaf(int idx)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+void BTreeNode<Key, Degree, Value, Compare, Allocator>::removeFromNonLeaf(Allocator &alloc, int idx)
 {
- 
-    int k = keys[idx];
+    const int t = Degree;
+    Key k = keys[idx];
  
     // If the child that precedes k (C[idx]) has atleast t keys,
     // find the predecessor 'pred' of k in the subtree rooted at
     // C[idx]. Replace k by pred. Recursively delete pred
     // in C[idx]
-    if (C[idx]->n >= t)
+    if (child(idx)->n >= t)
     {
-        int pred = getPred(idx);
+        Key pred = getPred(idx, values[idx]);
         keys[idx] = pred;
-        C[idx]->remove(pred);
+        child(idx)->remove(alloc, pred);
     }
  
     // If the child C[idx] has less that t keys, examine C[idx+1].
@@ -247,11 +469,11 @@ void BTreeNode::removeFromNonLeaf(int idx)
     // the subtree rooted at C[idx+1]
     // Replace k by succ
     // Recursively delete succ in C[idx+1]
-    else if  (C[idx+1]->n >= t)
+    else if  (child(idx+1)->n >= t)
     {
-        int succ = getSucc(idx);
+        Key succ = getSucc(idx, values[idx]);
         keys[idx] = succ;
-        C[idx+1]->remove(succ);
+        child(idx+1)->remove(alloc, succ);
     }
  
     // If both C[idx] and C[idx+1] has less that t keys,merge k and all of C[idx+1]
@@ -260,48 +482,54 @@ void BTreeNode::removeFromNonLeaf(int idx)
     // Free C[idx+1] and recursively delete k from C[idx]
     else
     {
-        merge(idx);
-        C[idx]->remove(k);
+        merge(alloc, idx);
+        child(idx)->remove(alloc, k);
     }
     return;
 }
  
 // A function to get predecessor of keys[idx]
-int BTreeNode::getPred(int idx)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+Key BTreeNode<Key, Degree, Value, Compare, Allocator>::getPred(int idx, Value &value)
 {
     // Keep moving to the right most node until we reach a leaf
-    BTreeNode *cur=C[idx];
+    BTreeNode *cur=child(idx);
     while (!cur->leaf)
-        cur = cur->C[cur->n];
+        cur = cur->child(cur->n);
  
     // Return the last key of the leaf
+    value = cur->values[cur->n-1];
     return cur->keys[cur->n-1];
 }
  
-int BTreeNode::getSucc(int idx)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+Key BTreeNode<Key, Degree, Value, Compare, Allocator>::getSucc(int idx, Value &value)
 {
  
     // Keep moving the left most node starting from C[idx+1] until we reach a leaf
-    BTreeNode *cur = C[idx+1];
+    BTreeNode *cur = child(idx+1);
     while (!cur->leaf)
-        cur = cur->C[0];
+        cur = cur->child(0);
  
     // Return the first key of the leaf
+    value = cur->values[0];
     return cur->keys[0];
 }
  
 // A function to fill child C[idx] which has less than t-1 keys
-void BTreeNode::fill(int idx)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+void BTreeNode<Key, Degree, Value, Compare, Allocator>::fill(Allocator &alloc, int idx)
 {
+    const int t = Degree;
  
     // If the previous child(C[idx-1]) has more than t-1 keys, borrow a key
     // from that child
-    if (idx!=0 && C[idx-1]->n>=t)
+    if (idx!=0 && child(idx-1)->n>=t)
         borrowFromPrev(idx);
  
     // If the next child(C[idx+1]) has more than t-1 keys, borrow a key
     // from that child
-    else if (idx!=n && C[idx+1]->n>=t)
+    else if (idx!=n && child(idx+1)->n>=t)
         borrowFromNext(idx);
  
     // Merge C[idx] with its sibling
@@ -310,48 +538,55 @@ void BTreeNode::fill(int idx)
     else
     {
         if (idx != n)
-            merge(idx);
+            merge(alloc, idx);
         else
-            merge(idx-1);
+            merge(alloc, idx-1);
     }
     return;
 }
  
 // A function to borrow a key from C[idx-1] and insert it
 // into C[idx]
-void BTreeNode::borrowFromPrev(int idx)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+void BTreeNode<Key, Degree, Value, Compare, Allocator>::borrowFromPrev(int idx)
 {
  
-    BTreeNode *child=C[idx];
-    BTreeNode *sibling=C[idx-1];
+    BTreeNode *c=child(idx);
+    BTreeNode *sibling=child(idx-1);
  
     // The last key from C[idx-1] goes up to the parent and key[idx-1]
     // from parent is inserted as the first key in C[idx]. Thus, the  loses
     // sibling one key and child gains one key
  
     // Moving all key in C[idx] one step ahead
-    for (int i=child->n-1; i>=0; --i)
-        child->keys[i+1] = child->keys[i];
+    for (int i=c->n-1; i>=0; --i)
+    {
+        c->keys[i+1] = c->keys[i];
+        c->values[i+1] = c->values[i];
+    }
  
     // If C[idx] is not a leaf, move all its child pointers one step ahead
-    if (!child->leaf)
+    if (!c->leaf)
     {
-        for(int i=child->n; i>=0; --i)
-            child->C[i+1] = child->C[i];
+        for(int i=c->n; i>=0; --i)
+            c->child(i+1) = c->child(i);
     }
  
     // Setting child's first key equal to keys[idx-1] from the current node
-    child->keys[0] = keys[idx-1];
+    c->keys[0] = keys[idx-1];
+    c->values[0] = values[idx-1];
  
-    // Moving sibling's last child as C[idx]'s first child
-    if (!leaf)
-        child->C[0] = sibling->C[sibling->n];
+    // Moving sibling's last child as C[idx]'s first child. Siblings are
+    // on the same level, so only internal children have one
+    if (!c->leaf)
+        c->child(0) = sibling->child(sibling->n);
  
     // Moving the key from the sibling to the parent
     // This reduces the number of keys in the sibling
     keys[idx-1] = sibling->keys[sibling->n-1];
+    values[idx-1] = sibling->values[sibling->n-1];
  
-    child->n += 1;
+    c->n += 1;
     sibling->n -= 1;
  
     return;
@@ -359,37 +594,43 @@ void BTreeNode::borrowFromPrev(int idx)
  
 // A function to borrow a key from the C[idx+1] and place
 // it in C[idx]
-void BTreeNode::borrowFromNext(int idx)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+void BTreeNode<Key, Degree, Value, Compare, Allocator>::borrowFromNext(int idx)
 {
  
-    BTreeNode *child=C[idx];
-    BTreeNode *sibling=C[idx+1];
+    BTreeNode *c=child(idx);
+    BTreeNode *sibling=child(idx+1);
  
     // keys[idx] is inserted as the last key in C[idx]
-    child->keys[(child->n)] = keys[idx];
+    c->keys[(c->n)] = keys[idx];
+    c->values[(c->n)] = values[idx];
  
     // Sibling's first child is inserted as the last child
     // into C[idx]
-    if (!(child->leaf))
-        child->C[(child->n)+1] = sibling->C[0];
+    if (!(c->leaf))
+        c->child((c->n)+1) = sibling->child(0);
  
     //The first key from sibling is inserted into keys[idx]
     keys[idx] = sibling->keys[0];
+    values[idx] = sibling->values[0];
  
     // Moving all keys in sibling one step behind
     for (int i=1; i<sibling->n; ++i)
+    {
         sibling->keys[i-1] = sibling->keys[i];
+        sibling->values[i-1] = sibling->values[i];
+    }
  
     // Moving the child pointers one step behind
     if (!sibling->leaf)
     {
         for(int i=1; i<=sibling->n; ++i)
-            sibling->C[i-1] = sibling->C[i];
+            sibling->child(i-1) = sibling->child(i);
     }
  
     // Increasing and decreasing the key count of C[idx] and C[idx+1]
     // respectively
-    child->n += 1;
+    c->n += 1;
     sibling->n -= 1;
  
     return;
@@ -397,54 +638,65 @@ void BTreeNode::borrowFromNext(int idx)
  
 // A function to merge C[idx] with C[idx+1]
 // C[idx+1] is freed after merging
-void BTreeNode::merge(int idx)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+void BTreeNode<Key, Degree, Value, Compare, Allocator>::merge(Allocator &alloc, int idx)
 {
-    BTreeNode *child = C[idx];
-    BTreeNode *sibling = C[idx+1];
+    const int t = Degree;
+    BTreeNode *c = child(idx);
+    BTreeNode *sibling = child(idx+1);
  
     // Pulling a key from the current node and inserting it into (t-1)th
     // position of C[idx]
-    child->keys[t-1] = keys[idx];
+    c->keys[t-1] = keys[idx];
+    c->values[t-1] = values[idx];
  
     // Copying the keys from C[idx+1] to C[idx] at the end
     for (int i=0; i<sibling->n; ++i)
-        child->keys[i+t] = sibling->keys[i];
+    {
+        c->keys[i+t] = sibling->keys[i];
+        c->values[i+t] = sibling->values[i];
+    }
  
     // Copying the child pointers from C[idx+1] to C[idx]
-    if (!child->leaf)
+    if (!c->leaf)
     {
         for(int i=0; i<=sibling->n; ++i)
-            child->C[i+t] = sibling->C[i];
+            c->child(i+t) = sibling->child(i);
     }
  
     // Moving all keys after idx in the current node one step before -
     // to fill the gap created by moving keys[idx] to C[idx]
     for (int i=idx+1; i<n; ++i)
+    {
         keys[i-1] = keys[i];
+        values[i-1] = values[i];
+    }
  
     // Moving the child pointers after (idx+1) in the current node one
     // step before
     for (int i=idx+2; i<=n; ++i)
-        C[i-1] = C[i];
+        child(i-1) = child(i);
  
     // Updating the key count of child and the current node
-    child->n += sibling->n+1;
+    c->n += sibling->n+1;
     n--;
  
-    // Freeing the memory occupied by sibling
-    delete(sibling);
+    // Giving the memory occupied by sibling back to the allocator
+    destroy(alloc, sibling);
     return;
 }
  
 // The main function that inserts a new key in this B-Tree
-void BTree::insert(int k)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+void BTree<Key, Degree, Value, Compare, Allocator>::insert(const Key &k, const Value &value)
 {
     // If tree is empty
     if (root == NULL)
     {
         // Allocate memory for root
-        root = new BTreeNode(t, true);
+        root = Node::create(alloc, true);
         root->keys[0] = k;  // Insert key
+        root->values[0] = value;
         root->n = 1;  // Update number of keys in root
     }
     else // If tree is not empty
@@ -453,93 +705,99 @@ void BTree::insert(int k)
         if (root->n == 2*t-1)
         {
             // Allocate memory for new root
-            BTreeNode *s = new BTreeNode(t, false);
+            Node *s = Node::create(alloc, false);
  
             // Make old root as child of new root
-            s->C[0] = root;
+            s->child(0) = root;
  
             // Split the old root and move 1 key to the new root
-            s->splitChild(0, root);
+            s->splitChild(alloc, 0, root);
  
             // New root has two children now.  Decide which of the
             // two children is going to have new key
             int i = 0;
-            if (s->keys[0] < k)
+            if (Node::less(s->keys[0], k))
                 i++;
-            s->C[i]->insertNonFull(k);
+            s->child(i)->insertNonFull(alloc, k, value);
  
             // Change root
             root = s;
         }
         else  // If root is not full, call insertNonFull for root
-            root->insertNonFull(k);
+            root->insertNonFull(alloc, k, value);
     }
 }
  
 // A utility function to insert a new key in this node
 // The assumption is, the node must be non-full when this
 // function is called
-void BTreeNode::insertNonFull(int k)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+void BTreeNode<Key, Degree, Value, Compare, Allocator>::insertNonFull(Allocator &alloc, const Key &k, const Value &value)
 {
-    // Initialize index as index of rightmost element
-    int i = n-1;
+    const int t = Degree;
+
+    // Initialize index as index of rightmost element lower or equal to k
+    int i = upper_bound_node(keys, n, k, Compare())-1;
  
     // If this is a leaf node
     if (leaf == true)
     {
-        // The following loop does two things
-        // a) Finds the location of new key to be inserted
-        // b) Moves all greater keys to one place ahead
-        while (i >= 0 && keys[i] > k)
+        // Move all greater keys to one place ahead
+        for (int j = n-1; j > i; j--)
         {
-            keys[i+1] = keys[i];
-            i--;
+            keys[j+1] = keys[j];
+            values[j+1] = values[j];
         }
  
         // Insert the new key at found location
         keys[i+1] = k;
+        values[i+1] = value;
         n = n+1;
     }
     else // If this node is not leaf
     {
-        // Find the child which is going to have the new key
-        while (i >= 0 && keys[i] > k)
-            i--;
+        // i is already the child which is going to have the new key
  
         // See if the found child is full
-        if (C[i+1]->n == 2*t-1)
+        if (child(i+1)->n == 2*t-1)
         {
             // If the child is full, then split it
-            splitChild(i+1, C[i+1]);
+            splitChild(alloc, i+1, child(i+1));
  
             // After split, the middle key of C[i] goes up and
             // C[i] is splitted into two.  See which of the two
             // is going to have the new key
-            if (keys[i+1] < k)
+            if (less(keys[i+1], k))
                 i++;
         }
-        C[i+1]->insertNonFull(k);
+        child(i+1)->insertNonFull(alloc, k, value);
     }
 }
  
 // A utility function to split the child y of this node
 // Note that y must be full when this function is called
-void BTreeNode::splitChild(int i, BTreeNode *y)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+void BTreeNode<Key, Degree, Value, Compare, Allocator>::splitChild(Allocator &alloc, int i, BTreeNode *y)
 {
+    const int t = Degree;
+
     // Create a new node which is going to store (t-1) keys
     // of y
-    BTreeNode *z = new BTreeNode(y->t, y->leaf);
+    BTreeNode *z = create(alloc, y->leaf);
     z->n = t - 1;
  
     // Copy the last (t-1) keys of y to z
     for (int j = 0; j < t-1; j++)
+    {
         z->keys[j] = y->keys[j+t];
+        z->values[j] = y->values[j+t];
+    }
  
     // Copy the last t children of y to z
     if (y->leaf == false)
     {
         for (int j = 0; j < t; j++)
-            z->C[j] = y->C[j+t];
+            z->child(j) = y->child(j+t);
     }
  
     // Reduce the number of keys in y
@@ -548,25 +806,30 @@ void BTreeNode::splitChild(int i, BTreeNode *y)
     // Since this node is going to have a new child,
     // create space of new child
     for (int j = n; j >= i+1; j--)
-        C[j+1] = C[j];
+        child(j+1) = child(j);
  
     // Link the new child to this node
-    C[i+1] = z;
+    child(i+1) = z;
  
     // A key of y will move to this node. Find location of
     // new key and move all greater keys one space ahead
     for (int j = n-1; j >= i; j--)
+    {
         keys[j+1] = keys[j];
+        values[j+1] = values[j];
+    }
  
     // Copy the middle key of y to this node
     keys[i] = y->keys[t-1];
+    values[i] = y->values[t-1];
  
     // Increment count of keys in this node
     n = n + 1;
 }
  
 // Function to traverse all nodes in a subtree rooted with this node
-void BTreeNode::traverse()
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+void BTreeNode<Key, Degree, Value, Compare, Allocator>::traverse()
 {
     // There are n keys and n+1 children, travers through n keys
     // and first n children
@@ -576,25 +839,42 @@ void BTreeNode::traverse()
         // If this is not leaf, then before printing key[i],
         // traverse the subtree rooted with child C[i].
         if (leaf == false)
-            C[i]->traverse();
+            child(i)->traverse();
         cout << " " << keys[i];
     }
  
     // Print the subtree rooted with last child
     if (leaf == false)
-        C[i]->traverse();
+        child(i)->traverse();
+}
+ 
+// Function to visit all keys in a subtree rooted with this node, in the
+// order of traverse
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+template <typename Visit>
+void BTreeNode<Key, Degree, Value, Compare, Allocator>::for_each(Visit &visit)
+{
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        if (leaf == false)
+            child(i)->for_each(visit);
+        visit(keys[i], values[i]);
+    }
+
+    if (leaf == false)
+        child(i)->for_each(visit);
 }
  
 // Function to search key k in subtree rooted with this node
-BTreeNode *BTreeNode::search(int k)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+BTreeNode<Key, Degree, Value, Compare, Allocator> *BTreeNode<Key, Degree, Value, Compare, Allocator>::search(const Key &k)
 {
     // Find the first key greater than or equal to k
-    int i = 0;
-    while (i < n && k > keys[i])
-        i++;
+    int i = lower_bound_node(keys, n, k, Compare());
  
     // If the found key is equal to k, return this node
-    if (keys[i] == k)
+    if (i < n && equal(keys[i], k))
         return this;
  
     // If key is not found here and this is a leaf node
@@ -602,10 +882,28 @@ BTreeNode *BTreeNode::search(int k)
         return NULL;
  
     // Go to the appropriate child
-    return C[i]->search(k);
+    return child(i)->search(k);
+}
+
+// Function to find the value of key k in subtree rooted with this node
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+Value *BTreeNode<Key, Degree, Value, Compare, Allocator>::lookup(const Key &k)
+{
+    BTreeNode *cur = this;
+    while (true)
+    {
+        // Find the first key greater than or equal to k
+        int i = lower_bound_node(cur->keys, cur->n, k, Compare());
+        if (i < cur->n && equal(cur->keys[i], k))
+            return &cur->values[i];
+        if (cur->leaf)
+            return NULL;
+        cur = cur->child(i);
+    }
 }
  
-void BTree::remove(int k)
+template <typename Key, int Degree, typename Value, typename Compare, typename Allocator>
+void BTree<Key, Degree, Value, Compare, Allocator>::remove(const Key &k)
 {
     if (!root)
     {
@@ -614,20 +912,24 @@ void BTree::remove(int k)
     }
  
     // Call the remove function for root
-    root->remove(k);
+    root->remove(alloc, k);
  
     // If the root node has 0 keys, make its first child as the new root
     //  if it has a child, otherwise set root as NULL
     if (root->n==0)
     {
-        BTreeNode *tmp = root;
+        Node *tmp = root;
         if (root->leaf)
             root = NULL;
         else
-            root = root->C[0];
+            root = root->child(0);
  
         // Free the old root
-        delete tmp;
+        Node::destroy(alloc, tmp);
     }
     return;
 }
+
+} // namespace memory
+
+#endif
@@ -0,0 +1,253 @@
+/* Compressed encodings of the sorted keys of a leaf.
+
+   Frame of reference stores every key as its offset from the first key,
+   and delta encoding stores every key as its distance from the key
+   before it. Either way the numbers are bit-packed with the width of the
+   largest one, so dense keys take a few bits each instead of 32.
+
+   Numbers are packed least significant bit first, so number i is read
+   with an unaligned 64 bit load at bit i*width. Runs of numbers are
+   decoded 8 at a time with AVX2 gathers and shifts, chosen once at
+   runtime like the search kernels, with a scalar loop as fallback.
+
+   Neither encoding has to be decoded to be searched. Offsets from the
+   first key keep the order of the keys, so they are bisected in place.
+   Delta encoding keeps the first key of every PACK_BLOCK_KEYS keys as an
+   anchor, so a search bisects the anchors and decodes a single block. */
+
+#ifndef B_TREE_PACK_HH
+#define B_TREE_PACK_HH
+
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
+#include "b_tree_simd.hh"
+
+// Keys between two anchors of the delta encoding
+#define PACK_BLOCK_KEYS 64
+
+// Bytes after the packed numbers, so the last one can be read with a
+// 64 bit load
+#define PACK_PADDING 8
+
+// Encodings of a packed leaf
+enum PackEncoding
+{
+    PACK_FOR = 1,       // Offsets from the first key
+    PACK_DELTA = 2      // Distances from the previous key, with anchors
+};
+
+// A function that returns the bits needed by the numbers up to v
+static inline int pack_width(uint32_t v){
+    return v == 0 ? 0 : 32-__builtin_clz(v);
+}
+
+// A function that returns the bytes of n numbers of width bits
+static inline int packed_bytes(int n, int width){
+    return (int)(((long)n*width+7)/8) + PACK_PADDING;
+}
+
+// A function to add number i, of width bits, to the zeroed buffer out
+static inline void pack_number(char* out, int i, int width, uint32_t v){
+    long bit = (long)i*width;
+    uint64_t word;
+    memcpy(&word, &out[bit >> 3], sizeof(uint64_t));
+    word |= (uint64_t)v << (bit & 7);
+    memcpy(&out[bit >> 3], &word, sizeof(uint64_t));
+}
+
+// A function to read number i, of width bits
+static inline uint32_t unpack_number(const char* in, int i, int width){
+    long bit = (long)i*width;
+    uint64_t word;
+    memcpy(&word, &in[bit >> 3], sizeof(uint64_t));
+    return (uint32_t)((word >> (bit & 7)) & ((1ULL << width)-1));
+}
+
+// A function that decodes the n numbers from first, adding base to them
+typedef void (*UnpackFunction)(const char* in, int first, int n, int width, uint32_t base, int* out);
+
+// Scalar fallback
+static void unpack_scalar(const char* in, int first, int n, int width, uint32_t base, int* out){
+    for (int i = 0; i < n; i++)
+        out[i] = (int)(base + unpack_number(in, first+i, width));
+}
+
+#ifdef B_TREE_SIMD_X86
+// 8 numbers per step, every lane loads the 64 bits its number starts in
+__attribute__((target("avx2")))
+static void unpack_avx2(const char* in, int first, int n, int width, uint32_t base, int* out){
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i low = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    __m256i mask = _mm256_set1_epi64x((long long)((1ULL << width)-1));
+    __m256i bv = _mm256_set1_epi32((int)base);
+    int i = 0;
+
+    for (; i+8 <= n; i += 8){
+        __m256i bits = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_set1_epi32(first+i), lanes),
+                                          _mm256_set1_epi32(width));
+        __m256i bytes = _mm256_srli_epi32(bits, 3);
+        __m256i shifts = _mm256_and_si256(bits, _mm256_set1_epi32(7));
+
+        __m256i a = _mm256_i32gather_epi64((const long long*)in, _mm256_castsi256_si128(bytes), 1);
+        __m256i b = _mm256_i32gather_epi64((const long long*)in, _mm256_extracti128_si256(bytes, 1), 1);
+        a = _mm256_and_si256(_mm256_srlv_epi64(a, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(shifts))), mask);
+        b = _mm256_and_si256(_mm256_srlv_epi64(b, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(shifts, 1))), mask);
+
+        // The low halves of the 64 bit lanes, in order
+        a = _mm256_permutevar8x32_epi32(a, low);
+        b = _mm256_permutevar8x32_epi32(b, low);
+        __m256i v = _mm256_permute2x128_si256(a, b, 0x20);
+        _mm256_storeu_si256((__m256i*)&out[i], _mm256_add_epi32(v, bv));
+    }
+    unpack_scalar(in, first+i, n-i, width, base, out+i);
+}
+#endif
+
+// A function to pick the best kernel for the running CPU
+static UnpackFunction select_unpack(){
+#ifdef B_TREE_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return unpack_avx2;
+#endif
+    return unpack_scalar;
+}
+
+static UnpackFunction unpack_numbers = select_unpack();
+
+// Frame of reference
+
+// A function that returns the bytes of n keys from first to last
+static inline int for_bytes(int n, int first, int last){
+    return packed_bytes(n, pack_width((uint32_t)last-(uint32_t)first));
+}
+
+// A function to encode n sorted keys on out, the first key is the base
+static inline void pack_for(const int* keys, int n, int width, char* out){
+    memset(out, 0, packed_bytes(n, width));
+    for (int i = 0; i < n; i++)
+        pack_number(out, i, width, (uint32_t)keys[i]-(uint32_t)keys[0]);
+}
+
+// A function to decode n keys
+static inline void unpack_for(const char* in, int n, int width, int base, int* keys){
+    unpack_numbers(in, 0, n, width, (uint32_t)base, keys);
+}
+
+// A function that returns the index of the first key greater than or
+// equal to k, bisecting the offsets in place
+static inline int for_lower_bound(const char* in, int n, int width, int base, int k){
+    if (n == 0 || k <= base)
+        return 0;
+
+    uint32_t target = (uint32_t)k-(uint32_t)base;
+    int first = 0;
+    int len = n;
+    while (len > 0){
+        int half = len/2;
+        if (unpack_number(in, first+half, width) < target){
+            first += half+1;
+            len -= half+1;
+        }else{
+            len = half;
+        }
+    }
+    return first;
+}
+
+// A function that returns the index of the first key greater than k
+static inline int for_upper_bound(const char* in, int n, int width, int base, int k){
+    if (k == INT_MAX)
+        return n;
+    return for_lower_bound(in, n, width, base, k+1);
+}
+
+// Delta encoding
+
+// A function that returns the number of anchors of n keys
+static inline int delta_anchors(int n){
+    return (n+PACK_BLOCK_KEYS-1)/PACK_BLOCK_KEYS;
+}
+
+// A function that returns the bytes of n keys with distances of width bits
+static inline int delta_bytes(int n, int width){
+    return delta_anchors(n)*(int)sizeof(int) + packed_bytes(n, width);
+}
+
+// A function that returns the width of the largest distance of n sorted keys
+static inline int delta_width(const int* keys, int n){
+    uint32_t largest = 0;
+    for (int i = 1; i < n; i++){
+        uint32_t d = (uint32_t)keys[i]-(uint32_t)keys[i-1];
+        largest = d > largest ? d : largest;
+    }
+    return pack_width(largest);
+}
+
+// A function to encode n sorted keys on out: the anchors, then the
+// distances. The first key of a block has its anchor instead
+static inline void pack_delta(const int* keys, int n, int width, char* out){
+    int anchors = delta_anchors(n);
+    char* bits = out+anchors*sizeof(int);
+    memset(bits, 0, packed_bytes(n, width));
+    for (int i = 0; i < n; i++){
+        if (i % PACK_BLOCK_KEYS == 0)
+            memcpy(&out[(i/PACK_BLOCK_KEYS)*sizeof(int)], &keys[i], sizeof(int));
+        else
+            pack_number(bits, i, width, (uint32_t)keys[i]-(uint32_t)keys[i-1]);
+    }
+}
+
+// A function to decode the block b of n keys on keys
+static inline int unpack_delta_block(const char* in, int n, int width, int b, int* keys){
+    int anchors = delta_anchors(n);
+    const char* bits = in+anchors*sizeof(int);
+    int first = b*PACK_BLOCK_KEYS;
+    int len = (n-first < PACK_BLOCK_KEYS) ? n-first : PACK_BLOCK_KEYS;
+
+    // Distances are decoded together, then summed from the anchor
+    unpack_numbers(bits, first, len, width, 0, keys);
+    memcpy(&keys[0], &in[b*sizeof(int)], sizeof(int));
+    for (int i = 1; i < len; i++)
+        keys[i] = (int)((uint32_t)keys[i-1]+(uint32_t)keys[i]);
+    return len;
+}
+
+// A function to decode n keys
+static inline void unpack_delta(const char* in, int n, int width, int* keys){
+    for (int b = 0; b < delta_anchors(n); b++)
+        unpack_delta_block(in, n, width, b, keys+b*PACK_BLOCK_KEYS);
+}
+
+// A function that returns the index of the first key greater than or
+// equal to k. Only the block after the last anchor lower than k is decoded
+static inline int delta_lower_bound(const char* in, int n, int width, int k){
+    int anchors = delta_anchors(n);
+    int a[PACK_BLOCK_KEYS];
+    int c = 0;
+    for (int first = 0; first < anchors; first += PACK_BLOCK_KEYS){
+        int len = (anchors-first < PACK_BLOCK_KEYS) ? anchors-first : PACK_BLOCK_KEYS;
+        memcpy(a, &in[first*sizeof(int)], len*sizeof(int));
+        int lower = lower_bound_keys(a, len, k);
+        c += lower;
+        if (lower < len)
+            break;
+    }
+    if (c == 0)
+        return 0;
+
+    int block[PACK_BLOCK_KEYS];
+    int len = unpack_delta_block(in, n, width, c-1, block);
+    return (c-1)*PACK_BLOCK_KEYS + lower_bound_keys(block, len, k);
+}
+
+// A function that returns the index of the first key greater than k
+static inline int delta_upper_bound(const char* in, int n, int width, int k){
+    if (k == INT_MAX)
+        return n;
+    return delta_lower_bound(in, n, width, k+1);
+}
+
+#endif
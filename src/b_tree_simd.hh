@@ -0,0 +1,107 @@
+/* Key search kernels for the nodes of both BTrees.
+
+   Keys inside a node are sorted, so the position of a key is the number
+   of keys smaller than it. Small ranges are counted with AVX2 or SSE4
+   compares, chosen once at runtime from the CPU features, with a scalar
+   loop as fallback. Large nodes are first narrowed down with a branchless
+   binary search, and only the last few keys are counted. */
+
+#ifndef B_TREE_SIMD_HH
+#define B_TREE_SIMD_HH
+
+#include <climits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define B_TREE_SIMD_X86 1
+#endif
+
+// Ranges up to this size are counted instead of bisected
+#define SIMD_SCAN_KEYS 32
+
+// A function that counts the keys lower than k in a sorted array
+typedef int (*CountLessFunction)(const int* keys, int n, int k);
+
+// Scalar fallback
+static int count_less_scalar(const int* keys, int n, int k){
+    int count = 0;
+    for (int i = 0; i < n; i++)
+        count += (keys[i] < k);
+    return count;
+}
+
+#ifdef B_TREE_SIMD_X86
+// 4 keys per compare
+__attribute__((target("sse4.2")))
+static int count_less_sse4(const int* keys, int n, int k){
+    __m128i kv = _mm_set1_epi32(k);
+    int count = 0;
+    int i = 0;
+
+    for (; i+4 <= n; i += 4){
+        __m128i v = _mm_loadu_si128((const __m128i*)&keys[i]);
+        __m128i lt = _mm_cmpgt_epi32(kv, v);
+        count += _mm_popcnt_u32(_mm_movemask_ps(_mm_castsi128_ps(lt)));
+    }
+    for (; i < n; i++)
+        count += (keys[i] < k);
+    return count;
+}
+
+// 8 keys per compare
+__attribute__((target("avx2,popcnt")))
+static int count_less_avx2(const int* keys, int n, int k){
+    __m256i kv = _mm256_set1_epi32(k);
+    int count = 0;
+    int i = 0;
+
+    for (; i+8 <= n; i += 8){
+        __m256i v = _mm256_loadu_si256((const __m256i*)&keys[i]);
+        __m256i lt = _mm256_cmpgt_epi32(kv, v);
+        count += _mm_popcnt_u32(_mm256_movemask_ps(_mm256_castsi256_ps(lt)));
+    }
+    for (; i < n; i++)
+        count += (keys[i] < k);
+    return count;
+}
+#endif
+
+// A function to pick the best kernel for the running CPU
+static CountLessFunction select_count_less(){
+#ifdef B_TREE_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        return count_less_avx2;
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+        return count_less_sse4;
+#endif
+    return count_less_scalar;
+}
+
+static CountLessFunction count_less = select_count_less();
+
+// A function that returns the index of the first key greater than or
+// equal to k in a sorted array of n keys
+static inline int lower_bound_keys(const int* keys, int n, int k){
+    const int* base = keys;
+    int len = n;
+
+    // Branchless bisection, base[half-1] < k moves to the upper half
+    while (len > SIMD_SCAN_KEYS){
+        int half = len/2;
+        base = (base[half-1] < k) ? base+half : base;
+        len -= half;
+    }
+    return (int)(base-keys) + count_less(base, len, k);
+}
+
+// A function that returns the index of the first key greater than k in a
+// sorted array of n keys
+static inline int upper_bound_keys(const int* keys, int n, int k){
+    // Keys lower or equal to k are the keys lower than k+1
+    if (k == INT_MAX)
+        return n;
+    return lower_bound_keys(keys, n, k+1);
+}
+
+#endif
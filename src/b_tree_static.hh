@@ -0,0 +1,259 @@
+/* An immutable, read-optimized snapshot of the keys of a BTree.
+
+   The keys are laid out as a static B-tree in Eytzinger order (an
+   S-tree): nodes of STATIC_NODE_KEYS keys, one cache line each, stored
+   breadth first with no pointers. The children of node k are the nodes
+   k*(STATIC_NODE_KEYS+1)+i+1, so a lookup computes its next address
+   instead of loading it, and the STATIC_NODE_KEYS+1 nodes it can go to
+   next, a cache line each, are all prefetched before the current one is
+   searched. Every node is searched with the SIMD kernels of
+   b_tree_simd.hh.
+
+   A snapshot is written once from sorted keys, from a file BTree or from
+   an in-memory BTree, and then opened read-only with mmap, so replicas
+   share its pages through the page cache. Equal keys are stored once. */
+
+#ifndef B_TREE_STATIC_HH
+#define B_TREE_STATIC_HH
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "b_tree_file.hh"
+#include "b_tree_original.hh"
+#include "b_tree_simd.hh"
+#include "b_tree_storage.hh"
+
+// Keys of a node, a cache line of ints
+#define STATIC_NODE_KEYS 16
+
+// Size of the header of a snapshot (magic, keys, nodes, node keys, has
+// max). It takes a whole cache line, so the nodes after it are aligned
+#define STATIC_HEADER_SIZE 64
+
+// Marks a snapshot file
+#define STATIC_MAGIC 0x53545245
+
+// Nodes written at once
+#define STATIC_WRITE_NODES 4096
+
+// A static search tree, mapped from a snapshot file
+class StaticBTree
+{
+    int fd;                 // Descriptor of the snapshot, -1 if not open
+    char* map;              // Mapped file
+    long map_size;          // Bytes mapped
+    const int* nodes;       // Keys of the nodes, in Eytzinger order
+    int key_count;          // Number of keys
+    int node_count;         // Number of nodes
+    bool has_max;           // Is true when INT_MAX is a key and not padding
+
+public:
+    StaticBTree(std::string _fpath);    // Constructor, maps the snapshot at _fpath
+
+    ~StaticBTree();                     // Destructor, unmaps the snapshot
+
+    StaticBTree(const StaticBTree&) = delete;
+    StaticBTree& operator=(const StaticBTree&) = delete;
+
+    // A function to check if a valid snapshot is mapped
+    bool is_open();
+
+    // A function that returns the number of keys
+    int size();
+
+    // A function to search key. Returns true if it is present
+    bool search(int key);
+
+    // A function to find the first key greater than or equal to key,
+    // returned on found. Returns false if there is none
+    bool lower_bound(int key, int &found);
+
+    // A function to write a snapshot of keys, in any order, to fpath
+    static bool write(const std::string &fpath, std::vector<int> keys);
+
+    // Functions to write a snapshot of every key of a file BTree, and of
+    // an in-memory BTree of int keys. The file tree must not change while
+    // it is exported
+    static bool export_tree(BTree &tree, const std::string &fpath);
+    template <int Degree, typename Value, typename Allocator>
+    static bool export_tree(memory::BTree<int, Degree, Value, std::less<int>, Allocator> &tree,
+                            const std::string &fpath);
+
+private:
+    // A function that returns the child i of node k
+    static int child(int k, int i) { return k*(STATIC_NODE_KEYS+1)+i+1; }
+
+    // A function to fill the nodes of the subtree rooted at k with the
+    // keys from next, in order. Slots past the last key take INT_MAX
+    static void fill(std::vector<int> &nodes, int k, const std::vector<int> &keys, size_t &next);
+};
+
+StaticBTree::StaticBTree(std::string _fpath){
+    this->map = nullptr;
+    this->map_size = 0;
+    this->nodes = nullptr;
+    this->key_count = 0;
+    this->node_count = 0;
+    this->has_max = false;
+
+    this->fd = ::open(_fpath.c_str(), O_RDONLY);
+    if(this->fd == -1)
+        return;
+
+    struct stat st;
+    if(fstat(this->fd, &st) != 0 || st.st_size < STATIC_HEADER_SIZE){
+        ::close(this->fd);
+        this->fd = -1;
+        return;
+    }
+
+    void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, this->fd, 0);
+    if(m == MAP_FAILED){
+        ::close(this->fd);
+        this->fd = -1;
+        return;
+    }
+    this->map = (char*)m;
+    this->map_size = st.st_size;
+
+    int header[5];
+    memcpy(header, this->map, sizeof(header));
+    long bytes = STATIC_HEADER_SIZE+(long)header[2]*STATIC_NODE_KEYS*sizeof(int);
+    if(header[0] != STATIC_MAGIC || header[3] != STATIC_NODE_KEYS || header[1] < 0 ||
+       header[2] < 0 || bytes > this->map_size){
+        munmap(this->map, this->map_size);
+        ::close(this->fd);
+        this->map = nullptr;
+        this->fd = -1;
+        return;
+    }
+
+    this->key_count = header[1];
+    this->node_count = header[2];
+    this->has_max = (header[4] != 0);
+    this->nodes = (const int*)&this->map[STATIC_HEADER_SIZE];
+
+    // Lookups jump around the whole file
+    madvise(this->map, this->map_size, MADV_RANDOM);
+}
+
+StaticBTree::~StaticBTree(){
+    if(this->map != nullptr)
+        munmap(this->map, this->map_size);
+    if(this->fd != -1)
+        ::close(this->fd);
+}
+
+bool StaticBTree::is_open(){
+    return this->nodes != nullptr;
+}
+
+int StaticBTree::size(){
+    return this->key_count;
+}
+
+bool StaticBTree::search(int key){
+    int found;
+    return this->lower_bound(key, found) && found == key;
+}
+
+bool StaticBTree::lower_bound(int key, int &found){
+    if(this->nodes == nullptr)
+        return false;
+
+    // The last key greater than or equal to key seen on the way down is
+    // the lowest one
+    bool any = false;
+    int k = 0;
+    while(k < this->node_count){
+        const int* node = &this->nodes[(long)k*STATIC_NODE_KEYS];
+
+        // The children are next to each other, a line each, so the load
+        // of whichever one comes next starts while this node is searched
+        int first = child(k, 0);
+        int last = std::min(child(k, STATIC_NODE_KEYS)+1, this->node_count);
+        for(int c = first; c < last; c++)
+            __builtin_prefetch(&this->nodes[(long)c*STATIC_NODE_KEYS]);
+        int i = count_less(node, STATIC_NODE_KEYS, key);
+        if(i < STATIC_NODE_KEYS){
+            found = node[i];
+            any = true;
+        }
+        k = child(k, i);
+    }
+
+    // Padding is INT_MAX, which is only a key when the tree has it
+    return any && (found != INT_MAX || this->has_max);
+}
+
+void StaticBTree::fill(std::vector<int> &nodes, int k, const std::vector<int> &keys, size_t &next){
+    if(k >= (int)(nodes.size()/STATIC_NODE_KEYS))
+        return;
+
+    // In order: every child before the key that follows it
+    for(int i = 0; i < STATIC_NODE_KEYS; i++){
+        fill(nodes, child(k, i), keys, next);
+        nodes[(long)k*STATIC_NODE_KEYS+i] = (next < keys.size()) ? keys[next++] : INT_MAX;
+    }
+    fill(nodes, child(k, STATIC_NODE_KEYS), keys, next);
+}
+
+bool StaticBTree::write(const std::string &fpath, std::vector<int> keys){
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    int count = (keys.size()+STATIC_NODE_KEYS-1)/STATIC_NODE_KEYS;
+    std::vector<int> nodes((long)count*STATIC_NODE_KEYS, INT_MAX);
+    size_t next = 0;
+    fill(nodes, 0, keys, next);
+
+    Storage* out = make_storage(FSTREAM_STORAGE, fpath, 0);
+    if(!out->open(true)){
+        delete out;
+        return false;
+    }
+
+    char header[STATIC_HEADER_SIZE] = {0};
+    int fields[5] = {STATIC_MAGIC, (int)keys.size(), count, STATIC_NODE_KEYS,
+                     (!keys.empty() && keys.back() == INT_MAX) ? 1 : 0};
+    memcpy(header, fields, sizeof(fields));
+    out->write(0, header, STATIC_HEADER_SIZE);
+
+    long node_bytes = STATIC_NODE_KEYS*sizeof(int);
+    for(long k = 0; k < count; k += STATIC_WRITE_NODES){
+        long n = std::min((long)STATIC_WRITE_NODES, count-k);
+        out->write(STATIC_HEADER_SIZE+k*node_bytes, (const char*)&nodes[k*STATIC_NODE_KEYS], n*node_bytes);
+    }
+
+    out->sync();
+    out->close();
+    delete out;
+    return true;
+}
+
+bool StaticBTree::export_tree(BTree &tree, const std::string &fpath){
+    std::vector<int> keys;
+    BTreeCursor cursor(&tree);
+    for(bool more = cursor.seek_first(); more; more = cursor.next())
+        keys.push_back(cursor.key());
+    return StaticBTree::write(fpath, keys);
+}
+
+template <int Degree, typename Value, typename Allocator>
+bool StaticBTree::export_tree(memory::BTree<int, Degree, Value, std::less<int>, Allocator> &tree,
+                              const std::string &fpath){
+    std::vector<int> keys;
+    tree.for_each([&keys](const int &key, Value &){ keys.push_back(key); });
+    return StaticBTree::write(fpath, keys);
+}
+
+#endif
@@ -0,0 +1,608 @@
+/* Storage backends used by the file BTree.
+
+   A Storage gives byte level access to the tree file. FileStorage copies
+   data through a std::fstream, as the tree always did. MmapStorage maps
+   the whole file, grows it in large chunks and can hand out pointers to
+   the mapped bytes, so nodes can be read and written in place without a
+   copy or a system call. The mapping lives inside a reserved range of
+   address space, so growing the file never moves pages that are in use.
+   PosixStorage uses pread/pwrite on a descriptor, optionally opened with
+   O_DIRECT to bypass the kernel page cache.
+
+   Every backend can be used by several threads at once. PosixStorage
+   transfers at explicit offsets and only serializes the writes that go
+   through a bounce buffer, since they rewrite whole blocks shared with
+   other pages. MmapStorage only locks to grow the mapping, and
+   FileStorage serializes its transfers because a std::fstream has a
+   single seek pointer. */
+
+#ifndef B_TREE_STORAGE_HH
+#define B_TREE_STORAGE_HH
+
+#include <fstream>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Storage backends
+enum StorageType
+{
+    FSTREAM_STORAGE,    // Data is copied through a std::fstream
+    MMAP_STORAGE,       // The file is mapped and data is accessed in place
+    POSIX_STORAGE,      // Data is copied with pread/pwrite
+    DIRECT_STORAGE      // pread/pwrite on a file opened with O_DIRECT
+};
+
+// Hints for the mapped storage, they may be combined
+enum MmapHints
+{
+    MMAP_RANDOM = 1,        // madvise(MADV_RANDOM), no kernel readahead
+    MMAP_SEQUENTIAL = 2,    // madvise(MADV_SEQUENTIAL), aggressive readahead
+    MMAP_WILLNEED = 4,      // madvise(MADV_WILLNEED), prefault the file
+    MMAP_HUGEPAGES = 8      // madvise(MADV_HUGEPAGE), back the map with hugepages
+};
+
+// Growth step of the mapped file, in bytes (a multiple of the OS page)
+#ifndef MMAP_CHUNK_SIZE
+#define MMAP_CHUNK_SIZE (16L << 20)
+#endif
+
+// Alignment of buffers, offsets and sizes for O_DIRECT transfers
+#define DIRECT_IO_ALIGNMENT 4096
+
+// Address space reserved for the mapped file, the largest file it can map
+#ifndef MMAP_RESERVE_SIZE
+#define MMAP_RESERVE_SIZE (64L << 30)
+#endif
+
+// A byte addressable file
+class Storage
+{
+public:
+    virtual ~Storage() {}
+
+    // A function to open the file. When truncate is true the file is
+    // created or emptied
+    virtual bool open(bool truncate) = 0;
+
+    // A function to check if the file is open
+    virtual bool is_open() = 0;
+
+    // A function to close the file
+    virtual void close() = 0;
+
+    // A function that returns the number of bytes in use on the file
+    virtual long size() = 0;
+
+    // Functions to copy bytes from/to the file
+    virtual void read(long offset, char* data, int length) = 0;
+    virtual void write(long offset, const char* data, int length) = 0;
+
+    // A function that returns a pointer to the bytes at offset, growing
+    // the file when needed. Returns nullptr if the backend can't access
+    // data in place
+    virtual char* address(long, int) { return nullptr; }
+
+    // A function to check if the backend accesses data in place
+    virtual bool mapped() { return false; }
+
+    // A function to hint that bytes will be read soon, so the kernel can
+    // start reading them in the background
+    virtual void prefetch(long, long) {}
+
+    // A function that returns a descriptor of the file for asynchronous
+    // transfers, or -1 if the backend has none
+    virtual int descriptor() { return -1; }
+
+    // A function to push buffered writes to the operating system
+    virtual void flush() = 0;
+
+    // A function to make every write durable
+    virtual void sync() = 0;
+};
+
+// A file accessed through a std::fstream
+class FileStorage : public Storage
+{
+    std::string fpath;      // File path
+    std::fstream file;      // File stream (input/output, binary)
+    std::mutex mutex;       // Guards the shared seek pointer of the stream
+
+public:
+    FileStorage(std::string _fpath);    // Constructor
+
+    bool open(bool truncate);
+    bool is_open();
+    void close();
+    long size();
+    void read(long offset, char* data, int length);
+    void write(long offset, const char* data, int length);
+    void flush();
+    void sync();
+};
+
+// A memory mapped file
+class MmapStorage : public Storage
+{
+    std::string fpath;      // File path
+    int fd;                 // File descriptor
+    char* map;              // Start of the reserved address range
+    long map_size;          // Mapped bytes, also the physical file size
+    long used;              // Bytes in use, the file is truncated to it on close
+    int hints;              // MmapHints flags
+    std::mutex mutex;       // Guards the growth of the file
+
+public:
+    MmapStorage(std::string _fpath, int _hints = 0);    // Constructor
+
+    ~MmapStorage();
+
+    bool open(bool truncate);
+    bool is_open();
+    void close();
+    long size();
+    void read(long offset, char* data, int length);
+    void write(long offset, const char* data, int length);
+    char* address(long offset, int length);
+    bool mapped();
+    void prefetch(long offset, long length);
+    void flush();
+    void sync();
+
+private:
+    // A function to grow the file and the mapping to at least _size bytes
+    bool grow(long _size);
+
+    // A function to apply the madvise hints to the mapping
+    void advise();
+};
+
+// A file accessed with pread/pwrite
+class PosixStorage : public Storage
+{
+    std::string fpath;      // File path
+    int fd;                 // File descriptor
+    bool direct;            // Is true when O_DIRECT was requested
+    bool direct_active;     // Is true when the file is really open with O_DIRECT
+    std::shared_mutex mutex;    // Taken alone by writes through a bounce buffer
+
+public:
+    PosixStorage(std::string _fpath, bool _direct = false);    // Constructor
+
+    ~PosixStorage();
+
+    bool open(bool truncate);
+    bool is_open();
+    void close();
+    long size();
+    void read(long offset, char* data, int length);
+    void write(long offset, const char* data, int length);
+    void prefetch(long offset, long length);
+    int descriptor();
+    void flush();
+    void sync();
+
+private:
+    // A function to check if a transfer can be done with O_DIRECT as is
+    bool aligned(long offset, const char* data, int length);
+};
+
+// A function to allocate a buffer aligned for direct transfers
+char* alloc_aligned(long size){
+    void* data = nullptr;
+    if(posix_memalign(&data, DIRECT_IO_ALIGNMENT, size) != 0)
+        return nullptr;
+    return (char*)data;
+}
+
+// A function to create the storage backend of a given type
+Storage* make_storage(int type, std::string fpath, int hints){
+    if(type == MMAP_STORAGE)
+        return new MmapStorage(fpath, hints);
+    if(type == POSIX_STORAGE || type == DIRECT_STORAGE)
+        return new PosixStorage(fpath, type == DIRECT_STORAGE);
+    return new FileStorage(fpath);
+}
+
+// FileStorage definitions
+FileStorage::FileStorage(std::string _fpath){
+    this->fpath = _fpath;
+    this->open(false);
+}
+
+bool FileStorage::open(bool truncate){
+    if(this->file.is_open())
+        this->file.close();
+
+    std::ios_base::openmode mode = std::fstream::in | std::fstream::out | std::fstream::binary;
+    if(truncate)
+        mode |= std::fstream::trunc;
+
+    this->file.open(this->fpath, mode);
+    return this->file.is_open();
+}
+
+bool FileStorage::is_open(){
+    return this->file.is_open();
+}
+
+void FileStorage::close(){
+    if(this->file.is_open())
+        this->file.close();
+}
+
+long FileStorage::size(){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->file.clear();
+    this->file.seekg(0, this->file.end);
+    return this->file.tellg();
+}
+
+void FileStorage::read(long offset, char* data, int length){
+    memset(data, 0, length);
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->file.clear();
+    this->file.seekg(offset, this->file.beg);
+    this->file.read(data, length);
+
+    // Reading past the end of the file sets the error flags
+    this->file.clear();
+}
+
+void FileStorage::write(long offset, const char* data, int length){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->file.clear();
+    this->file.seekp(offset, this->file.beg);
+    this->file.write(data, length);
+}
+
+void FileStorage::flush(){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->file.flush();
+}
+
+void FileStorage::sync(){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->file.flush();
+
+    // std::fstream has no fsync, go through a second descriptor
+    int sync_fd = ::open(this->fpath.c_str(), O_RDONLY);
+    if(sync_fd != -1){
+        fsync(sync_fd);
+        ::close(sync_fd);
+    }
+}
+
+// MmapStorage definitions
+MmapStorage::MmapStorage(std::string _fpath, int _hints){
+    this->fpath = _fpath;
+    this->fd = -1;
+    this->map = nullptr;
+    this->map_size = 0;
+    this->used = 0;
+    this->hints = _hints;
+    this->open(false);
+}
+
+MmapStorage::~MmapStorage(){
+    this->close();
+}
+
+bool MmapStorage::open(bool truncate){
+    this->close();
+
+    int flags = O_RDWR;
+    if(truncate)
+        flags |= O_CREAT | O_TRUNC;
+
+    this->fd = ::open(this->fpath.c_str(), flags, 0644);
+    if(this->fd == -1)
+        return false;
+
+    // Reserve the address range, the file is mapped over it as it grows
+    void* range = mmap(nullptr, MMAP_RESERVE_SIZE, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(range == MAP_FAILED){
+        ::close(this->fd);
+        this->fd = -1;
+        return false;
+    }
+    this->map = (char*)range;
+
+    struct stat st;
+    fstat(this->fd, &st);
+    this->used = st.st_size;
+
+    // Map at least one chunk, so small trees never remap
+    long _size = ((this->used/MMAP_CHUNK_SIZE)+1)*MMAP_CHUNK_SIZE;
+    if(!this->grow(_size)){
+        munmap(this->map, MMAP_RESERVE_SIZE);
+        ::close(this->fd);
+        this->fd = -1;
+        this->map = nullptr;
+        return false;
+    }
+
+    // A file that wasn't closed keeps the unused part of its last chunk.
+    // It is all zeroes, which reads past the end return anyway, so it
+    // isn't counted and goes with the next close
+    while(this->used >= 8 && this->used%8 == 0){
+        uint64_t word;
+        memcpy(&word, &this->map[this->used-8], sizeof(word));
+        if(word != 0)
+            break;
+        this->used -= 8;
+    }
+    while(this->used > 0 && this->map[this->used-1] == 0)
+        this->used--;
+    return true;
+}
+
+bool MmapStorage::is_open(){
+    return this->fd != -1;
+}
+
+void MmapStorage::close(){
+    if(this->fd == -1)
+        return;
+
+    if(this->map != nullptr){
+        msync(this->map, this->map_size, MS_SYNC);
+        munmap(this->map, MMAP_RESERVE_SIZE);
+    }
+
+    // Drop the unused part of the last chunk
+    if(ftruncate(this->fd, this->used) == 0)
+        fsync(this->fd);
+    ::close(this->fd);
+
+    this->fd = -1;
+    this->map = nullptr;
+    this->map_size = 0;
+    this->used = 0;
+}
+
+long MmapStorage::size(){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->used;
+}
+
+void MmapStorage::read(long offset, char* data, int length){
+    memset(data, 0, length);
+
+    long _used = this->size();
+    if(offset >= _used)
+        return;
+    if(offset+length > _used)
+        length = _used-offset;
+
+    memcpy(data, &this->map[offset], length);
+}
+
+void MmapStorage::write(long offset, const char* data, int length){
+    char* dest = this->address(offset, length);
+    if(dest != nullptr)
+        memcpy(dest, data, length);
+}
+
+char* MmapStorage::address(long offset, int length){
+    if(this->fd == -1)
+        return nullptr;
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if(offset+length > this->map_size){
+        // Grow by whole chunks to keep remaps rare
+        long _size = ((offset+length+MMAP_CHUNK_SIZE-1)/MMAP_CHUNK_SIZE)*MMAP_CHUNK_SIZE;
+        if(!this->grow(_size))
+            return nullptr;
+    }
+
+    if(offset+length > this->used)
+        this->used = offset+length;
+
+    return &this->map[offset];
+}
+
+bool MmapStorage::mapped(){
+    return true;
+}
+
+void MmapStorage::prefetch(long offset, long length){
+    long _used = this->size();
+    if(this->map == nullptr || offset >= _used)
+        return;
+
+    // madvise works on whole OS pages
+    long start = offset-offset%sysconf(_SC_PAGESIZE);
+    if(offset+length > _used)
+        length = _used-offset;
+    madvise(&this->map[start], offset+length-start, MADV_WILLNEED);
+}
+
+void MmapStorage::flush(){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if(this->map != nullptr)
+        msync(this->map, this->map_size, MS_ASYNC);
+}
+
+void MmapStorage::sync(){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if(this->map != nullptr)
+        msync(this->map, this->map_size, MS_SYNC);
+}
+
+bool MmapStorage::grow(long _size){
+    if(_size > MMAP_RESERVE_SIZE)
+        return false;
+    if(ftruncate(this->fd, _size) != 0)
+        return false;
+
+    // Map only the new part of the file, right after the mapped one
+    void* chunk = mmap(&this->map[this->map_size], _size-this->map_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_FIXED, this->fd, this->map_size);
+    if(chunk == MAP_FAILED)
+        return false;
+
+    this->map_size = _size;
+    this->advise();
+    return true;
+}
+
+void MmapStorage::advise(){
+    if(this->hints & MMAP_RANDOM)
+        madvise(this->map, this->map_size, MADV_RANDOM);
+    if(this->hints & MMAP_SEQUENTIAL)
+        madvise(this->map, this->map_size, MADV_SEQUENTIAL);
+    if(this->hints & MMAP_WILLNEED)
+        madvise(this->map, this->map_size, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+    if(this->hints & MMAP_HUGEPAGES)
+        madvise(this->map, this->map_size, MADV_HUGEPAGE);
+#endif
+}
+
+// PosixStorage definitions
+PosixStorage::PosixStorage(std::string _fpath, bool _direct){
+    this->fpath = _fpath;
+    this->fd = -1;
+    this->direct = _direct;
+    this->direct_active = false;
+    this->open(false);
+}
+
+PosixStorage::~PosixStorage(){
+    this->close();
+}
+
+bool PosixStorage::open(bool truncate){
+    this->close();
+
+    int flags = O_RDWR;
+    if(truncate)
+        flags |= O_CREAT | O_TRUNC;
+
+    // Some file systems (tmpfs, ...) refuse O_DIRECT, fall back to
+    // buffered I/O on them
+    if(this->direct){
+        this->fd = ::open(this->fpath.c_str(), flags | O_DIRECT, 0644);
+        this->direct_active = (this->fd != -1);
+    }
+    if(this->fd == -1)
+        this->fd = ::open(this->fpath.c_str(), flags, 0644);
+
+    return this->fd != -1;
+}
+
+bool PosixStorage::is_open(){
+    return this->fd != -1;
+}
+
+void PosixStorage::close(){
+    if(this->fd != -1)
+        ::close(this->fd);
+    this->fd = -1;
+    this->direct_active = false;
+}
+
+long PosixStorage::size(){
+    struct stat st;
+    if(this->fd == -1 || fstat(this->fd, &st) != 0)
+        return 0;
+    return st.st_size;
+}
+
+void PosixStorage::read(long offset, char* data, int length){
+    memset(data, 0, length);
+    if(this->fd == -1)
+        return;
+
+    if(this->aligned(offset, data, length)){
+        if(pread(this->fd, data, length, offset) < 0)
+            memset(data, 0, length);
+        return;
+    }
+
+    // Read the aligned blocks around the data into a bounce buffer
+    long start = offset-offset%DIRECT_IO_ALIGNMENT;
+    long end = ((offset+length+DIRECT_IO_ALIGNMENT-1)/DIRECT_IO_ALIGNMENT)*DIRECT_IO_ALIGNMENT;
+    char* bounce = alloc_aligned(end-start);
+    if(bounce == nullptr)
+        return;
+
+    memset(bounce, 0, end-start);
+    if(pread(this->fd, bounce, end-start, start) >= 0)
+        memcpy(data, &bounce[offset-start], length);
+    free(bounce);
+}
+
+void PosixStorage::write(long offset, const char* data, int length){
+    if(this->fd == -1)
+        return;
+
+    if(this->aligned(offset, data, length)){
+        std::shared_lock<std::shared_mutex> lock(this->mutex);
+        ssize_t written = pwrite(this->fd, data, length, offset);
+        (void)written;
+        return;
+    }
+
+    // Read, modify and write back the aligned blocks around the data.
+    // Pages smaller than a block share it, so no other write may run
+    // until it is back, and the size can't change meanwhile
+    std::unique_lock<std::shared_mutex> lock(this->mutex);
+    long start = offset-offset%DIRECT_IO_ALIGNMENT;
+    long end = ((offset+length+DIRECT_IO_ALIGNMENT-1)/DIRECT_IO_ALIGNMENT)*DIRECT_IO_ALIGNMENT;
+    char* bounce = alloc_aligned(end-start);
+    if(bounce == nullptr)
+        return;
+
+    long _size = this->size();
+    memset(bounce, 0, end-start);
+    if(pread(this->fd, bounce, end-start, start) >= 0){
+        memcpy(&bounce[offset-start], data, length);
+
+        // Don't leave the padding of the last block on the file
+        if(pwrite(this->fd, bounce, end-start, start) == end-start && offset+length > _size){
+            int truncated = ftruncate(this->fd, offset+length);
+            (void)truncated;
+        }
+    }
+    free(bounce);
+}
+
+void PosixStorage::prefetch(long offset, long length){
+    // The page cache is bypassed with O_DIRECT, there is nothing to fill
+    if(this->fd != -1 && !this->direct_active)
+        posix_fadvise(this->fd, offset, length, POSIX_FADV_WILLNEED);
+}
+
+int PosixStorage::descriptor(){
+    return this->fd;
+}
+
+void PosixStorage::flush(){
+    // Every write already went to the kernel
+}
+
+void PosixStorage::sync(){
+    if(this->fd != -1)
+        fdatasync(this->fd);
+}
+
+bool PosixStorage::aligned(long offset, const char* data, int length){
+    if(!this->direct_active)
+        return true;
+    return offset%DIRECT_IO_ALIGNMENT == 0 && length%DIRECT_IO_ALIGNMENT == 0 &&
+           ((unsigned long)data)%DIRECT_IO_ALIGNMENT == 0;
+}
+
+#endif
@@ -0,0 +1,737 @@
+/* A file BTree of variable-length string keys.
+
+   The file BTree of b_tree_file.hh keeps an array of int keys on every
+   page. This tree keeps byte strings, ordered like std::string, on
+   slotted pages: a directory of (offset, length) slots grows from the
+   start of the page in key order, and the key bytes are stored from the
+   end of the page towards it.
+
+   Every key of a page starts with the prefix of the page, which is stored
+   once and left out of the slots. A search compares the key with the
+   prefix once per page, and then only the suffixes after it.
+
+   The tree is a B+ tree: keys are on the leaves, which are linked in key
+   order, and inner pages only hold separators. Pages split when a key
+   doesn't fit, in two halves of about the same size in bytes. When a
+   leaf splits, its separator is truncated to the shortest prefix of the
+   first key of the new leaf that is still greater than the last key of
+   the old one, so inner pages hold short separators and keep a large
+   fanout even with long keys.
+
+   Removes don't merge pages, an empty leaf stays on its chain. The tree
+   has one user at a time. */
+
+#ifndef B_TREE_STRING_HH
+#define B_TREE_STRING_HH
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "b_tree_buffer.hh"
+#include "b_tree_storage.hh"
+
+// Page geometry, the same as the one of the file BTree
+#ifndef DEFAULT_PAGE_SIZE
+#define DEFAULT_PAGE_SIZE 4096
+#endif
+#ifndef MIN_PAGE_SIZE
+#define MIN_PAGE_SIZE 512
+#endif
+#ifndef MAX_PAGE_SIZE
+#define MAX_PAGE_SIZE 65536
+#endif
+#ifndef DEFAULT_CACHE_SIZE
+#define DEFAULT_CACHE_SIZE (1 << 20)
+#endif
+
+// Size of the info header of a string tree (root, page size, pages). The
+// header takes the whole first page of the file
+#define STRING_HEADER_SIZE (sizeof(int)*3)
+
+// Layout of a string page: (leaf, n, heap, prefix length, link, prefix,
+// slots). Key bytes go from heap to the end of the page. link is the next
+// leaf of a leaf, or the first child of an inner page, whose other
+// children are stored after the bytes of the keys before them
+#define SPAGE_LEAF_OFFSET 0
+#define SPAGE_N_OFFSET (sizeof(int))
+#define SPAGE_HEAP_OFFSET (sizeof(int)*2)
+#define SPAGE_PREFIX_LENGTH_OFFSET (sizeof(int)*3)
+#define SPAGE_LINK_OFFSET (sizeof(int)*4)
+#define SPAGE_PREFIX_OFFSET (sizeof(int)*5)
+
+// Size of a slot, the offset and length of a suffix
+#define SPAGE_SLOT_SIZE (sizeof(uint16_t)*2)
+
+// Longest key of a page. A key with its slot and child takes at most a
+// quarter of the page, so a page that overflows always splits in two
+// pages that fit
+#define STRING_MAX_KEY(page_size) \
+    ((int)(((page_size)-SPAGE_PREFIX_OFFSET)/4-SPAGE_SLOT_SIZE-sizeof(int)))
+
+// A function that returns the length of the common prefix of a and b
+inline size_t string_lcp(const std::string &a, const std::string &b){
+    size_t n = std::min(a.size(), b.size());
+    size_t i = 0;
+    while(i < n && a[i] == b[i])
+        i++;
+    return i;
+}
+
+// A view of a slotted page, read and written in place
+class StringPage
+{
+    char *data;         // Page data
+    int page_size;      // Size of the page
+
+public:
+    StringPage(char *_data = nullptr, int _page_size = 0) : data(_data), page_size(_page_size) {}
+
+    // A function to check if the view points to a page
+    bool valid() { return this->data != nullptr; }
+
+    // Access to the header fields
+    bool is_leaf() { return this->field(SPAGE_LEAF_OFFSET) != 0; }
+    int get_n() { return this->field(SPAGE_N_OFFSET); }
+    int get_link() { return this->field(SPAGE_LINK_OFFSET); }
+    void set_link(int ptr) { this->set_field(SPAGE_LINK_OFFSET, ptr); }
+    int prefix_length() { return this->field(SPAGE_PREFIX_LENGTH_OFFSET); }
+    const char* prefix() { return &this->data[SPAGE_PREFIX_OFFSET]; }
+
+    // Access to the suffix of key i, the bytes after the prefix
+    const char* suffix(int i) { return &this->data[this->slot_field(i, 0)]; }
+    int suffix_length(int i) { return this->slot_field(i, 1); }
+
+    // A function that returns key i
+    std::string key(int i);
+
+    // A function to check if key i is k
+    bool matches(int i, const std::string &k);
+
+    // Access to child i of an inner page, the child after key i-1
+    int child(int i);
+
+    // Functions that return the index of the first key greater than or
+    // equal to k, and greater than k
+    int lower_bound(const std::string &k) { return this->search(k, false); }
+    int upper_bound(const std::string &k) { return this->search(k, true); }
+
+    // A function to insert k at index i, with child ptr after it on an
+    // inner page. The page is rewritten when k doesn't share its prefix
+    // or only fits in the space left by removed keys. Returns false if k
+    // doesn't fit
+    bool insert(int i, const std::string &k, int ptr);
+
+    // A function to remove key i, with the child after it on an inner
+    // page. Its bytes are left unused until the page is rewritten
+    void remove(int i);
+
+    // A function to read every key, and every child of an inner page
+    void read(std::vector<std::string> &keys, std::vector<int> &children);
+
+    // A function to rewrite the page with the n keys, with their common
+    // prefix. An inner page takes the children after every key, link is
+    // its first child or the next leaf
+    void write(bool leaf, int link, const std::string *keys, const int *children, int n);
+
+    // A function that returns the bytes a page needs for the n keys
+    static long size(bool leaf, const std::string *keys, int n);
+
+private:
+    // Access to the int fields of the header
+    int field(size_t offset);
+    void set_field(size_t offset, int value);
+
+    // Access to the slot fields, 0 for the offset and 1 for the length
+    int slot_field(int i, int j);
+    char* slot(int i) { return &this->data[SPAGE_PREFIX_OFFSET+this->prefix_length()+SPAGE_SLOT_SIZE*i]; }
+
+    // A function to binary search k, returns lower_bound or upper_bound
+    int search(const std::string &k, bool upper);
+};
+
+// A file BTree of string keys
+class StringBTree
+{
+    int root;               // Root file position
+    int page_size;          // Size of every page of the file
+    int node_count;         // Number of pages on the file
+    std::string fpath;      // File path
+    Storage* storage;       // File backend
+    long cache_size;        // Memory budget of the buffer pool, in bytes
+    BufferPool* pool;       // Page cache between the tree and the file
+
+public:
+
+    // Constructor. _storage is a StorageType and _hints are the MmapHints
+    // used by the mapped storage
+    StringBTree(std::string _fpath, long _cache_size = DEFAULT_CACHE_SIZE,
+                int _storage = FSTREAM_STORAGE, int _hints = 0);
+
+    ~StringBTree();                 // Destructor, writes cached pages back
+
+    StringBTree(const StringBTree&) = delete;
+    StringBTree& operator=(const StringBTree&) = delete;
+
+    // A function to write every cached page back to the file
+    void flush();
+
+    // A function to load the tree info from the file header
+    void load_info_header();
+
+    // A function to initialize the tree and the file. The page size must
+    // be a power of two between MIN_PAGE_SIZE and MAX_PAGE_SIZE
+    void init(int _page_size = DEFAULT_PAGE_SIZE);
+
+    // Access to the page geometry
+    int get_page_size();
+    int get_max_key();
+
+    // A function to search key. Returns true if it is present
+    bool search(const std::string &key);
+
+    // A function to insert key. Returns false if it is already present or
+    // longer than get_max_key()
+    bool insert(const std::string &key);
+
+    // A function to remove key. Returns false if it is not present
+    bool remove(const std::string &key);
+
+    // A function to print every key in order
+    void traverse();
+
+private:
+    // A function to write the tree info to the file header
+    void store_info_header();
+
+    // A function to set the page geometry and rebuild the pool for it
+    void set_page_size(int _page_size);
+
+    // Functions to pin a page of the pool and to release it
+    StringPage pin_page(int ptr);
+    void unpin_page(int ptr, bool dirty);
+
+    // A function to add an empty page to the file, stored at ptr. The
+    // page is returned pinned
+    StringPage new_page(bool leaf, int &ptr);
+
+    // A function to go down to the leaf of key. The inner pages and the
+    // child taken on each are pushed on path when it is not nullptr.
+    // Returns the file pointer of the leaf
+    int find_leaf(const std::string &key, std::vector<std::pair<int, int>> *path);
+
+    // A function to split the pinned leaf x at ptr, that has no room for
+    // key at index i. The keys after the middle go to a new leaf, returned
+    // on right with the truncated separator. x is unpinned
+    void splitLeaf(int ptr, StringPage x, int i, const std::string &key,
+                   std::string &separator, int &right);
+
+    // A function to split the pinned inner page x at ptr, that has no room
+    // for separator at index i with child right after it. The middle key
+    // moves up, and is returned on separator with the new page on right.
+    // x is unpinned
+    void splitInner(int ptr, StringPage x, int i, std::string &separator, int &right);
+
+    // A function to choose where the n keys are split. With promote, the
+    // key at the returned index moves up and is not on either page
+    static int split_point(bool leaf, const std::string *keys, int n, bool promote);
+};
+
+// StringPage definitions
+int StringPage::field(size_t offset){
+    int value;
+    memcpy(&value, &this->data[offset], sizeof(int));
+    return value;
+}
+
+void StringPage::set_field(size_t offset, int value){
+    memcpy(&this->data[offset], &value, sizeof(int));
+}
+
+int StringPage::slot_field(int i, int j){
+    uint16_t value;
+    memcpy(&value, this->slot(i)+sizeof(uint16_t)*j, sizeof(uint16_t));
+    return value;
+}
+
+std::string StringPage::key(int i){
+    std::string k(this->prefix(), this->prefix_length());
+    k.append(this->suffix(i), this->suffix_length(i));
+    return k;
+}
+
+bool StringPage::matches(int i, const std::string &k){
+    size_t p = this->prefix_length();
+    size_t m = this->suffix_length(i);
+    return k.size() == p+m && memcmp(k.data(), this->prefix(), p) == 0 &&
+           memcmp(k.data()+p, this->suffix(i), m) == 0;
+}
+
+int StringPage::child(int i){
+    if(i == 0)
+        return this->get_link();
+
+    int ptr;
+    memcpy(&ptr, this->suffix(i-1)+this->suffix_length(i-1), sizeof(int));
+    return ptr;
+}
+
+int StringPage::search(const std::string &k, bool upper){
+    int n = this->get_n();
+    size_t p = this->prefix_length();
+
+    // Keys that don't share the prefix go before or after every key
+    int c = memcmp(k.data(), this->prefix(), std::min(p, k.size()));
+    if(c < 0 || (c == 0 && k.size() < p))
+        return 0;
+    if(c > 0)
+        return n;
+
+    const char* rest = k.data()+p;
+    size_t rest_length = k.size()-p;
+    int lo = 0, hi = n;
+    while(lo < hi){
+        int mid = (lo+hi)/2;
+        size_t m = this->suffix_length(mid);
+        int r = memcmp(this->suffix(mid), rest, std::min(m, rest_length));
+        if(r == 0)
+            r = (m < rest_length) ? -1 : (m > rest_length ? 1 : 0);
+        if(r < 0 || (upper && r == 0))
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+bool StringPage::insert(int i, const std::string &k, int ptr){
+    int n = this->get_n();
+    bool leaf = this->is_leaf();
+    size_t p = this->prefix_length();
+    int heap = this->field(SPAGE_HEAP_OFFSET);
+    int directory_end = SPAGE_PREFIX_OFFSET+p+SPAGE_SLOT_SIZE*n;
+
+    // The key goes in place when it shares the prefix and fits before
+    // the lowest key
+    if(k.size() >= p && memcmp(k.data(), this->prefix(), p) == 0){
+        int m = k.size()-p;
+        int cell = m+(leaf ? 0 : sizeof(int));
+        if(heap-directory_end >= cell+(int)SPAGE_SLOT_SIZE){
+            heap -= cell;
+            memcpy(&this->data[heap], k.data()+p, m);
+            if(!leaf)
+                memcpy(&this->data[heap+m], &ptr, sizeof(int));
+
+            memmove(this->slot(i+1), this->slot(i), SPAGE_SLOT_SIZE*(n-i));
+            uint16_t entry[2] = {(uint16_t)heap, (uint16_t)m};
+            memcpy(this->slot(i), entry, SPAGE_SLOT_SIZE);
+
+            this->set_field(SPAGE_HEAP_OFFSET, heap);
+            this->set_field(SPAGE_N_OFFSET, n+1);
+            return true;
+        }
+    }
+
+    // Otherwise the page is rewritten with the key, if they all fit
+    std::vector<std::string> keys;
+    std::vector<int> children;
+    this->read(keys, children);
+    keys.insert(keys.begin()+i, k);
+    if(!leaf)
+        children.insert(children.begin()+i+1, ptr);
+    if(StringPage::size(leaf, keys.data(), n+1) > this->page_size)
+        return false;
+
+    int link = this->get_link();
+    this->write(leaf, link, keys.data(), leaf ? nullptr : children.data()+1, n+1);
+    return true;
+}
+
+void StringPage::remove(int i){
+    int n = this->get_n();
+    memmove(this->slot(i), this->slot(i+1), SPAGE_SLOT_SIZE*(n-i-1));
+    this->set_field(SPAGE_N_OFFSET, n-1);
+
+    // An empty page starts over
+    if(n == 1){
+        this->set_field(SPAGE_HEAP_OFFSET, this->page_size);
+        this->set_field(SPAGE_PREFIX_LENGTH_OFFSET, 0);
+    }
+}
+
+void StringPage::read(std::vector<std::string> &keys, std::vector<int> &children){
+    int n = this->get_n();
+    keys.clear();
+    children.clear();
+    keys.reserve(n+1);
+    for(int i = 0; i < n; i++)
+        keys.push_back(this->key(i));
+
+    if(!this->is_leaf()){
+        children.reserve(n+2);
+        for(int i = 0; i <= n; i++)
+            children.push_back(this->child(i));
+    }
+}
+
+void StringPage::write(bool leaf, int link, const std::string *keys, const int *children, int n){
+    size_t p = (n > 0) ? string_lcp(keys[0], keys[n-1]) : 0;
+
+    this->set_field(SPAGE_LEAF_OFFSET, leaf ? 1 : 0);
+    this->set_field(SPAGE_N_OFFSET, n);
+    this->set_field(SPAGE_PREFIX_LENGTH_OFFSET, p);
+    this->set_link(link);
+    if(n > 0)
+        memcpy(&this->data[SPAGE_PREFIX_OFFSET], keys[0].data(), p);
+
+    // Keys are stored from the end of the page, the first one last
+    int heap = this->page_size;
+    for(int i = 0; i < n; i++){
+        int m = keys[i].size()-p;
+        heap -= m+(leaf ? 0 : sizeof(int));
+        memcpy(&this->data[heap], keys[i].data()+p, m);
+        if(!leaf)
+            memcpy(&this->data[heap+m], &children[i], sizeof(int));
+
+        uint16_t entry[2] = {(uint16_t)heap, (uint16_t)m};
+        memcpy(this->slot(i), entry, SPAGE_SLOT_SIZE);
+    }
+    this->set_field(SPAGE_HEAP_OFFSET, heap);
+}
+
+long StringPage::size(bool leaf, const std::string *keys, int n){
+    size_t p = (n > 0) ? string_lcp(keys[0], keys[n-1]) : 0;
+    long bytes = SPAGE_PREFIX_OFFSET+p+(long)(SPAGE_SLOT_SIZE+(leaf ? 0 : sizeof(int)))*n;
+    for(int i = 0; i < n; i++)
+        bytes += keys[i].size()-p;
+    return bytes;
+}
+
+// StringBTree definitions
+StringBTree::StringBTree(std::string _fpath, long _cache_size, int _storage, int _hints){
+    this->root = 0;
+    this->page_size = 0;
+    this->node_count = 0;
+    this->fpath = _fpath;
+    this->storage = make_storage(_storage, _fpath, _hints);
+    this->cache_size = _cache_size;
+    this->pool = nullptr;
+
+    this->set_page_size(DEFAULT_PAGE_SIZE);
+}
+
+StringBTree::~StringBTree(){
+    this->flush();
+    delete this->pool;
+    delete this->storage;
+}
+
+void StringBTree::flush(){
+    if(this->storage->is_open())
+        this->pool->flush_all();
+}
+
+void StringBTree::set_page_size(int _page_size){
+    // Cached pages are written back under the old geometry
+    delete this->pool;
+
+    // The header takes the first page
+    this->page_size = _page_size;
+    this->pool = new BufferPool(this->storage, _page_size, _page_size, this->cache_size);
+}
+
+void StringBTree::load_info_header(){
+    if(this->storage->is_open()){
+        char buffer[STRING_HEADER_SIZE];
+
+        // The header page may only be in the pool
+        this->pool->flush_page(-1);
+        this->storage->read(0, buffer, STRING_HEADER_SIZE);
+
+        int _root, _page_size, _node_count;
+        memcpy(&_root, buffer, sizeof(int));
+        memcpy(&_page_size, &buffer[sizeof(int)], sizeof(int));
+        memcpy(&_node_count, &buffer[sizeof(int)*2], sizeof(int));
+
+        if(_page_size < MIN_PAGE_SIZE || _page_size > MAX_PAGE_SIZE || (_page_size & (_page_size-1)) != 0)
+            return;
+
+        if(_page_size != this->page_size)
+            this->set_page_size(_page_size);
+        this->root = _root;
+        this->node_count = _node_count;
+    }
+}
+
+void StringBTree::store_info_header(){
+    if(this->storage->is_open()){
+        char* buffer = this->pool->fetch_page(-1);
+        if(buffer == nullptr)
+            return;
+
+        memcpy(buffer, &this->root, sizeof(int));
+        memcpy(&buffer[sizeof(int)], &this->page_size, sizeof(int));
+        memcpy(&buffer[sizeof(int)*2], &this->node_count, sizeof(int));
+        this->pool->unpin_page(-1, true);
+    }
+}
+
+void StringBTree::init(int _page_size){
+    // The page size must be a power of two inside the limits
+    if(_page_size < MIN_PAGE_SIZE || _page_size > MAX_PAGE_SIZE || (_page_size & (_page_size-1)) != 0)
+        return;
+
+    // (Re)creates the file, so init also works when it does not exist yet
+    this->storage->open(true);
+
+    if(this->storage->is_open()){
+        // Cached pages belong to the old file
+        this->pool->reset();
+        this->set_page_size(_page_size);
+        this->node_count = 0;
+
+        // initializes with an empty leaf as root
+        this->root = 0;
+        int ptr;
+        StringPage r = this->new_page(true, ptr);
+        if(r.valid())
+            this->unpin_page(ptr, true);
+    }
+}
+
+int StringBTree::get_page_size(){
+    return this->page_size;
+}
+
+int StringBTree::get_max_key(){
+    return STRING_MAX_KEY(this->page_size);
+}
+
+StringPage StringBTree::pin_page(int ptr){
+    return StringPage(this->pool->fetch_page(ptr), this->page_size);
+}
+
+void StringBTree::unpin_page(int ptr, bool dirty){
+    this->pool->unpin_page(ptr, dirty);
+}
+
+StringPage StringBTree::new_page(bool leaf, int &ptr){
+    ptr = this->node_count++;
+    this->store_info_header();
+
+    StringPage x(this->pool->new_page(ptr), this->page_size);
+    if(x.valid())
+        x.write(leaf, -1, nullptr, nullptr, 0);
+    return x;
+}
+
+int StringBTree::find_leaf(const std::string &key, std::vector<std::pair<int, int>> *path){
+    int ptr = this->root;
+    while(true){
+        StringPage x = this->pin_page(ptr);
+        if(!x.valid())
+            return -1;
+        if(x.is_leaf()){
+            this->unpin_page(ptr, false);
+            return ptr;
+        }
+
+        // Keys equal to a separator are on its right
+        int i = x.upper_bound(key);
+        int next = x.child(i);
+        this->unpin_page(ptr, false);
+        if(path != nullptr)
+            path->push_back({ptr, i});
+        ptr = next;
+    }
+}
+
+bool StringBTree::search(const std::string &key){
+    if(!this->storage->is_open())
+        return false;
+
+    int ptr = this->find_leaf(key, nullptr);
+    if(ptr == -1)
+        return false;
+    StringPage x = this->pin_page(ptr);
+    if(!x.valid())
+        return false;
+
+    int i = x.lower_bound(key);
+    bool found = (i < x.get_n() && x.matches(i, key));
+    this->unpin_page(ptr, false);
+    return found;
+}
+
+bool StringBTree::insert(const std::string &key){
+    if(!this->storage->is_open() || (int)key.size() > this->get_max_key())
+        return false;
+
+    std::vector<std::pair<int, int>> path;
+    int ptr = this->find_leaf(key, &path);
+    if(ptr == -1)
+        return false;
+    StringPage x = this->pin_page(ptr);
+    if(!x.valid())
+        return false;
+
+    int i = x.lower_bound(key);
+    if(i < x.get_n() && x.matches(i, key)){
+        this->unpin_page(ptr, false);
+        return false;
+    }
+    if(x.insert(i, key, -1)){
+        this->unpin_page(ptr, true);
+        return true;
+    }
+
+    // The leaf is full. Its separator goes up the path, splitting the
+    // inner pages that are full too
+    std::string separator;
+    int right;
+    this->splitLeaf(ptr, x, i, key, separator, right);
+    while(!path.empty()){
+        int parent = path.back().first;
+        int idx = path.back().second;
+        path.pop_back();
+
+        StringPage p = this->pin_page(parent);
+        if(!p.valid())
+            return false;
+        if(p.insert(idx, separator, right)){
+            this->unpin_page(parent, true);
+            return true;
+        }
+        this->splitInner(parent, p, idx, separator, right);
+    }
+
+    // The root split, the tree grows a level
+    int root_ptr;
+    StringPage r = this->new_page(false, root_ptr);
+    if(!r.valid())
+        return false;
+    r.write(false, this->root, &separator, &right, 1);
+    this->unpin_page(root_ptr, true);
+    this->root = root_ptr;
+    this->store_info_header();
+    return true;
+}
+
+int StringBTree::split_point(bool leaf, const std::string *keys, int n, bool promote){
+    // The split that leaves the fullest page with the fewest bytes
+    int best = 1;
+    long best_size = -1;
+    for(int m = 1; m < (promote ? n-1 : n); m++){
+        long left = StringPage::size(leaf, keys, m);
+        long right = promote ? StringPage::size(leaf, keys+m+1, n-m-1)
+                             : StringPage::size(leaf, keys+m, n-m);
+        long size = std::max(left, right);
+        if(best_size == -1 || size < best_size){
+            best = m;
+            best_size = size;
+        }
+    }
+    return best;
+}
+
+void StringBTree::splitLeaf(int ptr, StringPage x, int i, const std::string &key,
+                            std::string &separator, int &right){
+    std::vector<std::string> keys;
+    std::vector<int> children;
+    x.read(keys, children);
+    keys.insert(keys.begin()+i, key);
+    int n = keys.size();
+    int m = StringBTree::split_point(true, keys.data(), n, false);
+
+    // The new leaf is linked after x
+    StringPage z = this->new_page(true, right);
+    if(!z.valid()){
+        this->unpin_page(ptr, false);
+        return;
+    }
+    z.write(true, x.get_link(), keys.data()+m, nullptr, n-m);
+    x.write(true, right, keys.data(), nullptr, m);
+    this->unpin_page(right, true);
+    this->unpin_page(ptr, true);
+
+    // The shortest separator between the two leaves
+    size_t length = string_lcp(keys[m-1], keys[m])+1;
+    separator = keys[m].substr(0, length);
+}
+
+void StringBTree::splitInner(int ptr, StringPage x, int i, std::string &separator, int &right){
+    std::vector<std::string> keys;
+    std::vector<int> children;
+    x.read(keys, children);
+    keys.insert(keys.begin()+i, separator);
+    children.insert(children.begin()+i+1, right);
+    int n = keys.size();
+    int m = StringBTree::split_point(false, keys.data(), n, true);
+
+    // Key m moves up, the children after it go to the new page
+    StringPage z = this->new_page(false, right);
+    if(!z.valid()){
+        this->unpin_page(ptr, false);
+        return;
+    }
+    z.write(false, children[m+1], keys.data()+m+1, children.data()+m+2, n-m-1);
+    x.write(false, children[0], keys.data(), children.data()+1, m);
+    this->unpin_page(right, true);
+    this->unpin_page(ptr, true);
+
+    separator = keys[m];
+}
+
+bool StringBTree::remove(const std::string &key){
+    if(!this->storage->is_open())
+        return false;
+
+    int ptr = this->find_leaf(key, nullptr);
+    if(ptr == -1)
+        return false;
+    StringPage x = this->pin_page(ptr);
+    if(!x.valid())
+        return false;
+
+    int i = x.lower_bound(key);
+    bool found = (i < x.get_n() && x.matches(i, key));
+    if(found)
+        x.remove(i);
+    this->unpin_page(ptr, found);
+    return found;
+}
+
+void StringBTree::traverse(){
+    if(!this->storage->is_open())
+        return;
+
+    // Down to the first leaf, then along the chain
+    int ptr = this->root;
+    while(ptr != -1){
+        StringPage x = this->pin_page(ptr);
+        if(!x.valid())
+            return;
+        bool leaf = x.is_leaf();
+        int next = leaf ? ptr : x.child(0);
+        this->unpin_page(ptr, false);
+        if(leaf)
+            break;
+        ptr = next;
+    }
+    while(ptr != -1){
+        StringPage x = this->pin_page(ptr);
+        if(!x.valid())
+            return;
+        for(int i = 0; i < x.get_n(); i++)
+            std::cout << " " << x.key(i);
+        int next = x.get_link();
+        this->unpin_page(ptr, false);
+        ptr = next;
+    }
+}
+
+#endif
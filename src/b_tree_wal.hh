@@ -0,0 +1,359 @@
+/* Write-ahead log used by the file BTree.
+
+   Every operation that changes the tree is logged as the images of the
+   pages it modified, followed by a commit record, before any of those
+   pages may reach the tree file. After a crash the committed images are
+   written again over the tree file, so an operation is either applied as
+   a whole or not at all. Records carry a CRC32, and a torn tail of the log
+   is dropped with the operation it belonged to.
+
+   Commits use group commit. Records are appended to a memory buffer, and
+   the first thread that needs them on disk becomes the leader: it writes
+   every record appended so far and syncs the log once for all the threads
+   waiting on it. Threads that arrive while the leader is busy wait for
+   the next round, which is then shared by all of them.
+
+   LSNs count every byte ever appended to the log, and keep growing when
+   the log is emptied, so an LSN handed out before is always covered. */
+
+#ifndef B_TREE_WAL_HH
+#define B_TREE_WAL_HH
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "b_tree_storage.hh"
+
+// Marks the start of every log record
+#define WAL_MAGIC 0x4c415742u
+
+// Log size that triggers a checkpoint of the tree, in bytes
+#ifndef WAL_CHECKPOINT_SIZE
+#define WAL_CHECKPOINT_SIZE (64L << 20)
+#endif
+
+// Time a group commit leader waits for more commits, in microseconds
+#ifndef WAL_GROUP_DELAY
+#define WAL_GROUP_DELAY 0
+#endif
+
+// Log record types
+enum LogRecordType
+{
+    WAL_PAGE = 1,       // Image of bytes of the tree file
+    WAL_COMMIT = 2      // End of an operation
+};
+
+// Header of a log record, followed by length bytes of data
+struct LogRecord
+{
+    uint32_t magic;     // WAL_MAGIC
+    uint32_t type;      // LogRecordType
+    int64_t offset;     // Offset of the data on the tree file
+    uint32_t length;    // Number of data bytes after the header
+    uint32_t checksum;  // CRC32 of the header, with checksum 0, and the data
+};
+
+// A write-ahead log of page images with group commit
+class WriteAheadLog
+{
+    std::string fpath;              // Log file path
+    int fd;                         // Log file descriptor
+    int group_delay;                // Time a leader waits for more commits, in microseconds
+
+    std::mutex mutex;               // Protects everything below
+    std::condition_variable synced; // Signaled after every log sync
+    std::vector<char> buffer;       // Records appended but not written yet
+    long base;                      // LSN of the start of the log file
+    long appended;                  // LSN of the end of the buffer (of the last commit)
+    long written;                   // LSN of the end of the log file
+    long durable;                   // LSN up to which the log is known to be on disk
+    bool flushing;                  // Is true while a leader writes the log
+
+public:
+    WriteAheadLog(std::string _fpath, int _group_delay = 0);   // Constructor
+
+    ~WriteAheadLog();
+
+    // A function to open the log file, creating it if needed
+    bool open();
+
+    // A function to check if the log is open
+    bool is_open();
+
+    // Functions to log an operation: add the images of the bytes it
+    // changed to records, then commit them. Records are built by each
+    // caller and reach the log together. commit returns the LSN of the
+    // operation, which is durable once sync returns for it
+    void add(std::vector<char> &records, long offset, const char* data, int length);
+    long commit(std::vector<char> &records);
+
+    // A function to wait until the log is on disk up to lsn. Concurrent
+    // callers share a single write and sync of the log. Returns false if
+    // the log could not be written
+    bool sync(long lsn);
+
+    // A function that returns the LSN up to which the log is on disk
+    long durable_lsn();
+
+    // A function that returns the size of the log, in bytes
+    long size();
+
+    // A function to write the committed images over the tree file, then
+    // empty the log. Returns the number of operations applied
+    int recover(Storage* storage);
+
+    // A function to empty the log, once the tree file holds every change.
+    // LSNs go on from where they were
+    void reset();
+
+private:
+    // A function to append a record to records
+    void append(std::vector<char> &records, int type, long offset, const char* data, int length);
+};
+
+// Lookup table of the CRC32 polynomial
+struct Crc32Table
+{
+    uint32_t entries[256];
+
+    Crc32Table(){
+        for(uint32_t i = 0; i < 256; i++){
+            uint32_t c = i;
+            for(int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : (c >> 1);
+            this->entries[i] = c;
+        }
+    }
+};
+
+// A function that returns the CRC32 of data, continuing from crc
+static uint32_t crc32(uint32_t crc, const char* data, long length){
+    static const Crc32Table table;
+
+    crc = ~crc;
+    for(long i = 0; i < length; i++)
+        crc = table.entries[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+WriteAheadLog::WriteAheadLog(std::string _fpath, int _group_delay){
+    this->fpath = _fpath;
+    this->fd = -1;
+    this->group_delay = _group_delay;
+    this->base = 0;
+    this->appended = 0;
+    this->written = 0;
+    this->durable = 0;
+    this->flushing = false;
+    this->open();
+}
+
+WriteAheadLog::~WriteAheadLog(){
+    if(this->fd != -1){
+        this->sync(this->appended);
+        ::close(this->fd);
+    }
+}
+
+bool WriteAheadLog::open(){
+    if(this->fd != -1)
+        return true;
+
+    this->fd = ::open(this->fpath.c_str(), O_RDWR | O_CREAT, 0644);
+    if(this->fd == -1)
+        return false;
+
+    // Records left on the file are only read by recover
+    struct stat st;
+    long size = (fstat(this->fd, &st) == 0) ? st.st_size : 0;
+    this->base = 0;
+    this->appended = size;
+    this->written = size;
+    this->durable = size;
+    return true;
+}
+
+bool WriteAheadLog::is_open(){
+    return this->fd != -1;
+}
+
+void WriteAheadLog::add(std::vector<char> &records, long offset, const char* data, int length){
+    this->append(records, WAL_PAGE, offset, data, length);
+}
+
+long WriteAheadLog::commit(std::vector<char> &records){
+    this->append(records, WAL_COMMIT, 0, nullptr, 0);
+
+    // The records of an operation reach the buffer together
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->buffer.insert(this->buffer.end(), records.begin(), records.end());
+    this->appended += records.size();
+    records.clear();
+    return this->appended;
+}
+
+bool WriteAheadLog::sync(long lsn){
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while(this->durable < lsn){
+        // Somebody else is writing, its sync may cover lsn
+        if(this->flushing){
+            this->synced.wait(lock);
+            continue;
+        }
+
+        // Become the leader, give other commits a chance to join
+        this->flushing = true;
+        if(this->group_delay > 0){
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::microseconds(this->group_delay));
+            lock.lock();
+        }
+
+        std::vector<char> data;
+        data.swap(this->buffer);
+        long offset = this->written-this->base;
+        long target = this->appended;
+        lock.unlock();
+
+        // Write and sync without the lock, so commits keep appending
+        long done = 0;
+        while(done < (long)data.size()){
+            ssize_t n = pwrite(this->fd, data.data()+done, data.size()-done, offset+done);
+            if(n <= 0)
+                break;
+            done += n;
+        }
+        bool ok = (done == (long)data.size()) && fdatasync(this->fd) == 0;
+
+        lock.lock();
+        this->written = this->base+offset+done;
+        if(ok){
+            this->durable = target;
+        }else{
+            // Keep what was not written for the next leader
+            this->buffer.insert(this->buffer.begin(), data.begin()+done, data.end());
+        }
+        this->flushing = false;
+        this->synced.notify_all();
+
+        if(!ok)
+            return false;
+    }
+    return true;
+}
+
+long WriteAheadLog::durable_lsn(){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->durable;
+}
+
+long WriteAheadLog::size(){
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->appended-this->base;
+}
+
+int WriteAheadLog::recover(Storage* storage){
+    if(this->fd == -1)
+        return 0;
+
+    struct stat st;
+    long size = (fstat(this->fd, &st) == 0) ? st.st_size : 0;
+
+    std::vector<char> log(size);
+    long got = 0;
+    while(got < size){
+        ssize_t n = pread(this->fd, log.data()+got, size-got, got);
+        if(n <= 0)
+            break;
+        got += n;
+    }
+
+    // Images of the operation being read, applied on its commit
+    std::vector<long> pending;
+    int applied = 0;
+    long pos = 0;
+    while(pos+(long)sizeof(LogRecord) <= got){
+        LogRecord record;
+        memcpy(&record, &log[pos], sizeof(LogRecord));
+        if(record.magic != WAL_MAGIC || pos+(long)sizeof(LogRecord)+record.length > got)
+            break;
+
+        uint32_t checksum = record.checksum;
+        record.checksum = 0;
+        uint32_t crc = crc32(0, (const char*)&record, sizeof(LogRecord));
+        crc = crc32(crc, &log[pos+sizeof(LogRecord)], record.length);
+        if(crc != checksum)
+            break;
+
+        if(record.type == WAL_PAGE){
+            pending.push_back(pos);
+        }else if(record.type == WAL_COMMIT){
+            for(long p : pending){
+                LogRecord page;
+                memcpy(&page, &log[p], sizeof(LogRecord));
+                storage->write(page.offset, &log[p+sizeof(LogRecord)], page.length);
+            }
+            pending.clear();
+            applied++;
+        }
+        pos += sizeof(LogRecord)+record.length;
+    }
+
+    // The tree file must hold the images before they leave the log
+    if(applied > 0)
+        storage->sync();
+    this->reset();
+
+    return applied;
+}
+
+void WriteAheadLog::reset(){
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if(this->fd == -1)
+        return;
+
+    // A leader writes at an offset of the file it found, it must be done
+    // before the file starts over
+    while(this->flushing)
+        this->synced.wait(lock);
+
+    if(ftruncate(this->fd, 0) == 0)
+        fsync(this->fd);
+
+    // Everything appended is on the tree file, so waiters are done too
+    this->buffer.clear();
+    this->base = this->appended;
+    this->written = this->appended;
+    this->durable = this->appended;
+    this->synced.notify_all();
+}
+
+void WriteAheadLog::append(std::vector<char> &records, int type, long offset, const char* data, int length){
+    LogRecord record;
+    record.magic = WAL_MAGIC;
+    record.type = type;
+    record.offset = offset;
+    record.length = length;
+    record.checksum = 0;
+
+    uint32_t crc = crc32(0, (const char*)&record, sizeof(LogRecord));
+    record.checksum = crc32(crc, data, length);
+
+    const char* header = (const char*)&record;
+    records.insert(records.end(), header, header+sizeof(LogRecord));
+    if(length > 0)
+        records.insert(records.end(), data, data+length);
+}
+
+#endif
@@ -4,7 +4,7 @@ using namespace std;
 
 // Driver program to test above functions
 int main(){
-    BTree t(3); // A B-Tree with minium degree 3
+    memory::BTree<int, 3> t; // A B-Tree with minium degree 3
  
     t.insert(1);
     t.insert(3);
@@ -0,0 +1,57 @@
+#include <cstdio>
+#include <vector>
+#include "b_tree_file.hh"
+
+int main(){
+    // Key filter test
+    std::remove("btree_filter");
+    std::remove("btree_filter.bloom");
+    {
+        BTree btree = BTree("btree_filter");
+        btree.init(8);
+        for(int key = 0; key < 200; key++)
+            btree.insert(key);
+        btree.enable_filter();
+    }
+    if(!BloomFilter::exists("btree_filter.bloom"))
+        return 1;
+
+    // A tree built again by an object that never loaded the filter must
+    // not be searched through the old one
+    {
+        BTree btree = BTree("btree_filter");
+        btree.init(8);
+        for(int key = 1000; key < 1200; key++)
+            btree.insert(key);
+    }
+    {
+        BTree btree = BTree("btree_filter");
+        btree.load_info_header();
+        for(int key = 1000; key < 1200; key++)
+            if(btree.find(key) == -1)
+                return 1;
+        btree.enable_filter();
+    }
+
+    // The same for a bulk load
+    {
+        BTree btree = BTree("btree_filter");
+        btree.load_info_header();
+        std::vector<int> keys;
+        for(int key = 5000; key < 5200; key++)
+            keys.push_back(key);
+        if(!btree.bulk_load(keys.begin(), keys.end()))
+            return 1;
+    }
+    {
+        BTree btree = BTree("btree_filter");
+        btree.load_info_header();
+        for(int key = 5000; key < 5200; key++)
+            if(btree.find(key) == -1)
+                return 1;
+        for(int key = 1000; key < 1200; key++)
+            if(btree.find(key) != -1)
+                return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "b_tree_file.hh"
+
+// Threads and keys inserted by each one
+#define THREADS 8
+#define KEYS 4000
+
+int main(){
+    // Concurrent file BTree test, every thread inserts its own keys and
+    // finds them while the others insert. The cache is small, so pages
+    // are evicted and written back along
+    std::remove("btree_latch");
+    BTree btree = BTree("btree_latch", 64*1024);
+    btree.init(0);
+    std::atomic<int> missing(0);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < THREADS; i++)
+        threads.emplace_back([&btree, &missing, i](){
+            for(int j = 0; j < KEYS; j++){
+                btree.insert(j*THREADS+i);
+                if(btree.find(j*THREADS+i) == -1)
+                    missing++;
+            }
+        });
+    for(std::thread &thread : threads)
+        thread.join();
+    if(missing != 0)
+        return 1;
+    for(int key = 0; key < THREADS*KEYS; key++)
+        if(btree.find(key) == -1)
+            return 1;
+    return 0;
+}
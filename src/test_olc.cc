@@ -0,0 +1,35 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "b_tree_olc.hh"
+
+// Threads and keys inserted by each one
+#define THREADS 8
+#define KEYS 4000
+
+int main(){
+    // Concurrent in-memory BTree test, every thread inserts, searches
+    // and removes its own keys while the others do the same
+    ConcurrentBTree tree(3);
+    std::atomic<int> wrong(0);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < THREADS; i++)
+        threads.emplace_back([&tree, &wrong, i](){
+            for(int j = 0; j < KEYS; j++)
+                tree.insert(j*THREADS+i);
+            for(int j = 0; j < KEYS; j++)
+                if(!tree.search(j*THREADS+i))
+                    wrong++;
+            for(int j = 1; j < KEYS; j += 2)
+                if(!tree.remove(j*THREADS+i))
+                    wrong++;
+        });
+    for(std::thread &thread : threads)
+        thread.join();
+    if(wrong != 0)
+        return 1;
+    for(int key = 0; key < THREADS*KEYS; key++)
+        if(tree.search(key) != (key/THREADS % 2 == 0))
+            return 1;
+    return 0;
+}
@@ -0,0 +1,43 @@
+#include <cstdio>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "b_tree_file.hh"
+
+int main(){
+    // WAL recovery test
+    std::remove("btree_wal");
+    std::remove("btree_wal.wal");
+    {
+        BTree btree = BTree("btree_wal", DEFAULT_CACHE_SIZE, FSTREAM_STORAGE, 0, true);
+        btree.init(3);
+        for(int key = 0; key < 1000; key++)
+            btree.insert(key);
+    }
+
+    // A child changes the tree and dies before any page is written back,
+    // only the log has the changes
+    pid_t pid = fork();
+    if(pid == 0){
+        BTree* btree = new BTree("btree_wal", DEFAULT_CACHE_SIZE, FSTREAM_STORAGE, 0, true);
+        btree->load_info_header();
+        for(int key = 1000; key < 2000; key++)
+            btree->insert(key);
+        for(int key = 0; key < 1000; key += 2)
+            if(!btree->remove(key))
+                _exit(1);
+        _exit(0);
+    }
+    int status;
+    if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return 1;
+
+    BTree btree = BTree("btree_wal", DEFAULT_CACHE_SIZE, FSTREAM_STORAGE, 0, true);
+    btree.load_info_header();
+    for(int key = 0; key < 1000; key++)
+        if((btree.find(key) != -1) != (key % 2 == 1))
+            return 1;
+    for(int key = 1000; key < 2000; key++)
+        if(btree.find(key) == -1)
+            return 1;
+    return 0;
+}